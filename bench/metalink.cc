@@ -0,0 +1,300 @@
+/* Run the plugin in process, against the fake Traffic Server API in
+ * ts/ts.h, and measure the two hot paths:
+ *
+ *    1.  the transformation: how fast vconn_write_ready() passes the
+ *        content through and hashes it, for several content and block
+ *        sizes, and
+ *
+ *    2.  the lookups: how long TS_EVENT_HTTP_SEND_RESPONSE_HDR takes
+ *        to reenable the response, when the Location URL is cached,
+ *        when nothing is cached, when a candidate from the record is
+ *        cached and when the index remembers it, and a mix of them.
+ *
+ * The cache is a hash table that calls back right away and the event
+ * queue runs on one thread, so the numbers are the plugin's own cost,
+ * not the cache's.
+ *
+ *    $ make bench
+ *    $ bench/metalink [requests] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "../metalink.cc"
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+base64_encode(const unsigned char *src, int length, char *dst)
+{
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  for (int i = 0; i < length; i += 3) {
+    unsigned int bits = src[i] << 16 | (i + 1 < length ? src[i + 1] << 8 : 0) | (i + 2 < length ? src[i + 2] : 0);
+
+    *dst++ = alphabet[bits >> 18 & 63];
+    *dst++ = alphabet[bits >> 12 & 63];
+    *dst++ = i + 1 < length ? alphabet[bits >> 6 & 63] : '=';
+    *dst++ = i + 2 < length ? alphabet[bits & 63] : '=';
+  }
+
+  *dst = '\0';
+}
+
+/* A distinct SHA-256 digest for each request, so no request finds what
+ * an earlier one left behind unless it's meant to */
+
+static void
+digest_make(int scenario, int i, unsigned char *digest)
+{
+  memset(digest, 0, 32);
+
+  digest[0] = scenario;
+  memcpy(digest + 1, &i, sizeof(i));
+}
+
+/* Transformation throughput */
+
+static void
+bench_transform(void)
+{
+  static const int64_t sizes[] = { 64 << 10, 1 << 20, 16 << 20 };
+  static const int64_t block_sizes[] = { 4 << 10, 32 << 10, 128 << 10 };
+
+  char *body = (char *) malloc(sizes[2]);
+  for (int64_t i = 0; i < sizes[2]; i += 1) {
+    body[i] = rand();
+  }
+
+  printf("%-12s %10s %10s %12s\n", "transform", "block", "MB/s", "us/request");
+
+  int n = 0;
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i += 1) {
+    for (size_t j = 0; j < sizeof(block_sizes) / sizeof(*block_sizes); j += 1) {
+
+      /* About 256 MB each */
+      int requests = (256 << 20) / sizes[i];
+
+      double start = now();
+
+      for (int k = 0; k < requests; k += 1) {
+        char url[64];
+        snprintf(url, sizeof(url), "http://origin.example/transform/%d", n++);
+
+        TSHttpTxn txnp = ts_txn_create(url, TS_HTTP_STATUS_OK);
+
+        handler(handler_contp, TS_EVENT_HTTP_READ_RESPONSE_HDR, txnp);
+        ts_txn_transform(txnp, body, sizes[i], block_sizes[j]);
+
+        ts_txn_destroy(txnp);
+      }
+
+      double elapsed = now() - start;
+
+      printf("%10lldK %9lldK %10.0f %12.1f\n", (long long) sizes[i] >> 10, (long long) block_sizes[j] >> 10,
+             sizes[i] * requests / elapsed / 1e6, elapsed / requests * 1e6);
+    }
+  }
+
+  free(body);
+}
+
+/* Lookup latency */
+
+enum {
+  SCENARIO_MISS,
+  SCENARIO_LOCATION,
+  SCENARIO_RECORD,
+  SCENARIO_INDEX,
+  SCENARIO_MIX
+};
+
+static const char *scenario_names[] = {
+  "miss",
+  "location",
+  "record",
+  "index",
+  "mix"
+};
+
+/* Cache what the scenario needs: The Location URL, or a record at the
+ * digest with one candidate that's cached */
+
+static void
+scenario_prepare(int scenario, int i, unsigned char *digest, char *location)
+{
+  char candidate[64];
+
+  digest_make(scenario, i, digest);
+
+  snprintf(location, 64, "http://origin.example/%d/%d", scenario, i);
+  snprintf(candidate, sizeof(candidate), "http://mirror.example/%d/%d", scenario, i);
+
+  switch (scenario) {
+  case SCENARIO_LOCATION:
+    ts_cache_url_put(location, "x", 1);
+
+    break;
+
+  case SCENARIO_RECORD:
+  case SCENARIO_INDEX: {
+    RecordCandidate record_candidate;
+
+    record_candidate.value = candidate;
+    record_candidate.length = strlen(candidate);
+    record_candidate.size = 1;
+    record_candidate.seen = time(NULL);
+
+    int length;
+
+    /* Allocation!  Must free! */
+    char *record = record_encode(&record_candidate, 1, &length);
+
+    TSCacheKey key = TSCacheKeyCreate();
+    digest_key_set(key, DIGEST_SHA256, (const char *) digest);
+
+    ts_cache_key_put(key, record, length);
+
+    TSCacheKeyDestroy(key);
+    TSfree(record);
+
+    ts_cache_url_put(candidate, "x", 1);
+
+    break;
+  }
+  }
+}
+
+/* Microseconds from the hook until the response is reenabled */
+
+static double
+lookup(const unsigned char *digest, const char *location)
+{
+  char value[sizeof("SHA-256=") + 64];
+  char encoded[64];
+
+  base64_encode(digest, 32, encoded);
+  snprintf(value, sizeof(value), "SHA-256=%s", encoded);
+
+  TSHttpTxn txnp = ts_txn_create("http://origin.example/", TS_HTTP_STATUS_MOVED_TEMPORARILY);
+
+  ts_txn_resp_field_add(txnp, 0, TS_MIME_FIELD_LOCATION, location);
+  ts_txn_resp_field_add(txnp, 0, "Digest", value);
+
+  double start = now();
+
+  handler(handler_contp, TS_EVENT_HTTP_SEND_RESPONSE_HDR, txnp);
+  ts_run();
+
+  double elapsed = now() - start;
+
+  if (ts_txn_reenabled(txnp) != 1) {
+    fprintf(stderr, "Response reenabled %d times\n", ts_txn_reenabled(txnp));
+
+    exit(1);
+  }
+
+  ts_txn_destroy(txnp);
+
+  return elapsed * 1e6;
+}
+
+static void
+bench_lookup(int requests)
+{
+  unsigned char digest[32];
+  char location[64];
+
+  printf("%-12s %10s %10s %10s %12s\n", "lookup", "mean us", "p50 us", "p99 us", "outcome");
+
+  for (int scenario = SCENARIO_MISS; scenario <= SCENARIO_MIX; scenario += 1) {
+    std::vector<double> latencies;
+
+    /* The index remembers the candidate after the first lookup */
+    if (scenario == SCENARIO_INDEX) {
+      scenario_prepare(scenario, 0, digest, location);
+      lookup(digest, location);
+    }
+
+    TSMgmtInt rewritten = ts_stat_get("plugin.metalink.send.rewritten_candidate");
+    TSMgmtInt index_hits = ts_stat_get("plugin.metalink.send.index_hit");
+
+    for (int i = 0; i < requests; i += 1) {
+
+      /* Mix: Mostly misses, like a mirror network's long tail */
+      int s = scenario;
+      if (scenario == SCENARIO_MIX) {
+        static const int mix[] = { SCENARIO_MISS, SCENARIO_MISS, SCENARIO_MISS, SCENARIO_MISS, SCENARIO_LOCATION,
+                                   SCENARIO_LOCATION, SCENARIO_LOCATION, SCENARIO_RECORD, SCENARIO_INDEX, SCENARIO_INDEX };
+
+        s = mix[rand() % 10];
+      }
+
+      if (s == SCENARIO_INDEX) {
+        digest_make(SCENARIO_INDEX, 0, digest);
+        snprintf(location, sizeof(location), "http://origin.example/%d/%d", SCENARIO_INDEX, 0);
+
+      } else {
+        scenario_prepare(s, requests * (scenario + 1) + i, digest, location);
+      }
+
+      latencies.push_back(lookup(digest, location));
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    double sum = 0;
+    for (size_t i = 0; i < latencies.size(); i += 1) {
+      sum += latencies[i];
+    }
+
+    char outcome[32];
+    snprintf(outcome, sizeof(outcome), "%lld/%lld", (long long) (ts_stat_get("plugin.metalink.send.rewritten_candidate") - rewritten),
+             (long long) (ts_stat_get("plugin.metalink.send.index_hit") - index_hits));
+
+    printf("%-12s %10.2f %10.2f %10.2f %12s\n", scenario_names[scenario], sum / requests, latencies[requests / 2],
+           latencies[requests * 99 / 100], outcome);
+  }
+
+  printf("(outcome: rewritten from a record/index hits)\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int requests = argc > 1 ? atoi(argv[1]) : 10000;
+
+  const char *plugin_argv[] = { "metalink" };
+  TSPluginInit(1, plugin_argv);
+
+  bench_transform();
+
+  ts_cache_clear();
+
+  bench_lookup(requests);
+
+  /* Everything's finished, so the plugin should be holding nothing */
+  int failed = 0;
+
+  static const char *live[] = { "plugin.metalink.live.send", "plugin.metalink.live.write", "plugin.metalink.live.transform" };
+  for (size_t i = 0; i < sizeof(live) / sizeof(*live); i += 1) {
+    if (ts_stat_get(live[i])) {
+      printf("LEAKED %lld %s\n", (long long) ts_stat_get(live[i]), live[i]);
+      failed = 1;
+    }
+  }
+
+  return failed;
+}
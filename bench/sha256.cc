@@ -0,0 +1,368 @@
+/* Check every SHA-256 kernel against OpenSSL, then measure how many
+ * bytes each one digests per cycle.  Then do the same for all the
+ * digest algorithms at once, in one pass and in one pass each.  Cycles are TSC ticks, so they
+ * don't track frequency scaling: pin the frequency for comparable
+ * numbers.
+ *
+ *    $ make bench
+ *    $ bench/sha256 [megabytes] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cpuid.h>
+#include <immintrin.h>
+#include <x86intrin.h>
+
+#include "../digest.h"
+#include "../sha256.h"
+
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Feed the kernel odd sized pieces, like TSIOBufferBlock would */
+
+static int
+check(const Sha256Kernel *kernel, const unsigned char *data, size_t length)
+{
+  unsigned char expected[32];
+  unsigned char actual[32];
+
+  SHA256(data, length, expected);
+
+  Sha256Context c;
+  kernel->init(&c);
+
+  size_t offset = 0;
+  for (size_t piece = 1; offset < length; piece = piece * 7 % 4099 + 1) {
+    size_t n = piece < length - offset ? piece : length - offset;
+    kernel->update(&c, data + offset, n);
+
+    offset += n;
+  }
+
+  kernel->final(actual, &c);
+
+  return !memcmp(expected, actual, sizeof(expected));
+}
+
+/* AVX2 multi-buffer: Compress nblocks 64 byte blocks of each of
+ * eight messages in one pass, lane i of each vector is message i.
+ * The plugin hashes one transaction's content at a time, so it has no
+ * use for it, it's only here to see what batching would buy.  The
+ * contexts must belong to a block kernel (shani or generic, which
+ * share the same state) and be at a block boundary.
+ *
+ * Needs AVX2 (leaf 7, EBX bit 5) and the OS to save the YMM state:
+ * OSXSAVE (leaf 1, ECX bit 27) and XCR0 bits 1 and 2, otherwise it's
+ * SIGILL */
+
+static const uint32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static int
+x8_supported(void)
+{
+  unsigned int regs[4];
+
+  if (!__get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]) || !(regs[2] >> 27 & 1)) {
+    return 0;
+  }
+
+  unsigned int eax, edx;
+  __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+
+  if ((eax & 6) != 6) {
+    return 0;
+  }
+
+  return __get_cpuid_count(7, 0, &regs[0], &regs[1], &regs[2], &regs[3]) && regs[1] >> 5 & 1;
+}
+
+static inline uint32_t
+load_be32(const unsigned char *p)
+{
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+#define ROR8(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+__attribute__((target("avx2"))) static inline __m256i
+x8_load(const unsigned char *data[8], size_t offset)
+{
+  return _mm256_setr_epi32(load_be32(data[0] + offset), load_be32(data[1] + offset), load_be32(data[2] + offset), load_be32(data[3] + offset), load_be32(data[4] + offset), load_be32(data[5] + offset), load_be32(data[6] + offset), load_be32(data[7] + offset));
+}
+
+__attribute__((target("avx2"))) static void
+x8_update(Sha256Context *c[8], const unsigned char *data[8], size_t nblocks)
+{
+  __m256i s[8];
+  __m256i w[16];
+
+  const unsigned char *p[8];
+
+  for (int i = 0; i < 8; i += 1) {
+    s[i] = _mm256_setr_epi32(c[0]->b.state[i], c[1]->b.state[i], c[2]->b.state[i], c[3]->b.state[i], c[4]->b.state[i], c[5]->b.state[i], c[6]->b.state[i], c[7]->b.state[i]);
+
+    p[i] = data[i];
+  }
+
+  for (size_t n = 0; n < nblocks; n += 1) {
+    __m256i a = s[0], b = s[1], cc = s[2], d = s[3];
+    __m256i e = s[4], f = s[5], g = s[6], h = s[7];
+
+#pragma GCC unroll 64
+    for (int t = 0; t < 64; t += 1) {
+      if (t < 16) {
+        w[t] = x8_load(p, n * 64 + t * 4);
+
+      } else {
+        __m256i w15 = w[(t - 15) % 16];
+        __m256i w2 = w[(t - 2) % 16];
+
+        __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROR8(w15, 7), ROR8(w15, 18)), _mm256_srli_epi32(w15, 3));
+        __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROR8(w2, 17), ROR8(w2, 19)), _mm256_srli_epi32(w2, 10));
+
+        w[t % 16] = _mm256_add_epi32(_mm256_add_epi32(w[t % 16], s0), _mm256_add_epi32(w[(t - 7) % 16], s1));
+      }
+
+      __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+      __m256i maj = _mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(a, cc)), _mm256_and_si256(b, cc));
+
+      __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, _mm256_xor_si256(_mm256_xor_si256(ROR8(e, 6), ROR8(e, 11)), ROR8(e, 25))), _mm256_add_epi32(_mm256_add_epi32(ch, _mm256_set1_epi32(K[t])), w[t % 16]));
+      __m256i t2 = _mm256_add_epi32(_mm256_xor_si256(_mm256_xor_si256(ROR8(a, 2), ROR8(a, 13)), ROR8(a, 22)), maj);
+
+      h = g;
+      g = f;
+      f = e;
+      e = _mm256_add_epi32(d, t1);
+      d = cc;
+      cc = b;
+      b = a;
+      a = _mm256_add_epi32(t1, t2);
+    }
+
+    s[0] = _mm256_add_epi32(s[0], a);
+    s[1] = _mm256_add_epi32(s[1], b);
+    s[2] = _mm256_add_epi32(s[2], cc);
+    s[3] = _mm256_add_epi32(s[3], d);
+    s[4] = _mm256_add_epi32(s[4], e);
+    s[5] = _mm256_add_epi32(s[5], f);
+    s[6] = _mm256_add_epi32(s[6], g);
+    s[7] = _mm256_add_epi32(s[7], h);
+  }
+
+  for (int i = 0; i < 8; i += 1) {
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i *) lanes, s[i]);
+
+    for (int j = 0; j < 8; j += 1) {
+      c[j]->b.state[i] = lanes[j];
+    }
+  }
+
+  for (int j = 0; j < 8; j += 1) {
+    c[j]->b.length += nblocks * 64;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  size_t length = (argc > 1 ? atoi(argv[1]) : 256) << 20;
+
+  unsigned char *data = (unsigned char *) malloc(length);
+  for (size_t i = 0; i < length; i += 1) {
+    data[i] = rand();
+  }
+
+  int failed = 0;
+
+  printf("%-10s %10s %10s\n", "kernel", "bytes/cyc", "MB/s");
+
+  for (const Sha256Kernel *kernel = sha256_kernels; kernel->name; kernel += 1) {
+    if (!kernel->supported()) {
+      printf("%-10s %21s\n", kernel->name, "unsupported");
+
+      continue;
+    }
+
+    for (size_t n = 0; n < 300; n += 1) {
+      if (!check(kernel, data, n)) {
+        printf("%-10s FAILED length %zu\n", kernel->name, n);
+        failed = 1;
+
+        break;
+      }
+    }
+
+    if (!check(kernel, data, 1 << 20)) {
+      printf("%-10s FAILED length %d\n", kernel->name, 1 << 20);
+      failed = 1;
+    }
+
+    unsigned char md[32];
+
+    Sha256Context c;
+    kernel->init(&c);
+
+    double start = now();
+    unsigned long long cycles = __rdtsc();
+
+    /* 32 KiB, the usual TSIOBufferBlock size */
+    for (size_t offset = 0; offset < length; offset += 32768) {
+      kernel->update(&c, data + offset, 32768 < length - offset ? 32768 : length - offset);
+    }
+
+    kernel->final(md, &c);
+
+    cycles = __rdtsc() - cycles;
+    double elapsed = now() - start;
+
+    printf("%-10s %10.3f %10.0f\n", kernel->name, (double) length / cycles, length / elapsed / 1e6);
+  }
+
+  /* Multi-buffer: Eight messages of length / 8 each */
+
+  if (!x8_supported()) {
+    printf("%-10s %21s\n", "avx2x8", "unsupported");
+
+  } else {
+    const Sha256Kernel *kernel = sha256_kernel_get("generic");
+
+    size_t nblocks = length / 8 / 64;
+
+    Sha256Context contexts[8];
+    Sha256Context *c[8];
+    const unsigned char *p[8];
+
+    for (int i = 0; i < 8; i += 1) {
+      kernel->init(&contexts[i]);
+
+      c[i] = &contexts[i];
+      p[i] = data + i * nblocks * 64;
+    }
+
+    double start = now();
+    unsigned long long cycles = __rdtsc();
+
+    for (size_t n = 0; n < nblocks; n += 512) {
+      size_t m = 512 < nblocks - n ? 512 : nblocks - n;
+      x8_update(c, p, m);
+
+      for (int i = 0; i < 8; i += 1) {
+        p[i] += m * 64;
+      }
+    }
+
+    cycles = __rdtsc() - cycles;
+    double elapsed = now() - start;
+
+    for (int i = 0; i < 8; i += 1) {
+      unsigned char expected[32];
+      unsigned char actual[32];
+
+      SHA256(data + i * nblocks * 64, nblocks * 64, expected);
+      kernel->final(actual, c[i]);
+
+      if (memcmp(expected, actual, sizeof(expected))) {
+        printf("%-10s FAILED lane %d\n", "avx2x8", i);
+        failed = 1;
+      }
+    }
+
+    printf("%-10s %10.3f %10.0f\n", "avx2x8", (double) nblocks * 64 * 8 / cycles, nblocks * 64 * 8 / elapsed / 1e6);
+  }
+
+  /* All the digest algorithms: One pass over the content, then one
+   * pass for each algorithm */
+
+  {
+    const Sha256Kernel *kernel = sha256_kernel_get(NULL);
+    unsigned int all = (1 << DIGEST_NALGS) - 1;
+
+    unsigned char md[DIGEST_NALGS][DIGEST_MAX_LENGTH];
+    unsigned char expected[DIGEST_MAX_LENGTH];
+
+    DigestContext c;
+    digest_init(&c, all, kernel);
+
+    double start = now();
+    unsigned long long cycles = __rdtsc();
+
+    for (size_t offset = 0; offset < length; offset += 32768) {
+      digest_update(&c, data + offset, 32768 < length - offset ? 32768 : length - offset);
+    }
+
+    digest_final(md, &c);
+
+    cycles = __rdtsc() - cycles;
+    double elapsed = now() - start;
+
+    SHA256(data, length, expected);
+    if (memcmp(expected, md[DIGEST_SHA256], 32)) {
+      printf("%-10s FAILED SHA-256\n", "one pass");
+      failed = 1;
+    }
+
+    SHA512(data, length, expected);
+    if (memcmp(expected, md[DIGEST_SHA512], 64)) {
+      printf("%-10s FAILED SHA-512\n", "one pass");
+      failed = 1;
+    }
+
+    SHA1(data, length, expected);
+    if (memcmp(expected, md[DIGEST_SHA1], 20)) {
+      printf("%-10s FAILED SHA\n", "one pass");
+      failed = 1;
+    }
+
+    MD5(data, length, expected);
+    if (memcmp(expected, md[DIGEST_MD5], 16)) {
+      printf("%-10s FAILED MD5\n", "one pass");
+      failed = 1;
+    }
+
+    printf("%-10s %10.3f %10.0f\n", "one pass", (double) length / cycles, length / elapsed / 1e6);
+
+    start = now();
+    cycles = __rdtsc();
+
+    for (int alg = 0; alg < DIGEST_NALGS; alg += 1) {
+      digest_init(&c, 1 << alg, kernel);
+
+      for (size_t offset = 0; offset < length; offset += 32768) {
+        digest_update(&c, data + offset, 32768 < length - offset ? 32768 : length - offset);
+      }
+
+      digest_final(md, &c);
+    }
+
+    cycles = __rdtsc() - cycles;
+    elapsed = now() - start;
+
+    printf("%-10s %10.3f %10.0f\n", "each", (double) length / cycles, length / elapsed / 1e6);
+  }
+
+  free(data);
+
+  return failed;
+}
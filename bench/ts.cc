@@ -0,0 +1,1552 @@
+/* A fake of the Traffic Server plugin API, see ts/ts.h */
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ts/ts.h"
+
+/* TSIOBufferWrite() splits the data into blocks of this size, like the
+ * default TSIOBuffer block size */
+#define BLOCK_SIZE 32768
+
+enum {
+  CONT,
+  TRANSFORM,
+  TRANSFORM_OUTPUT,
+  CACHE_READ,
+  CACHE_WRITE
+};
+
+struct tsapi_mutex {
+  pthread_mutex_t m;
+
+  /* Continuations using it, it's freed with the last one */
+  int refs;
+};
+
+struct tsapi_vio {
+  TSCont contp;
+  TSVConn connp;
+
+  TSIOBuffer bufp;
+  TSIOBufferReader readerp;
+
+  int64_t nbytes;
+  int64_t ndone;
+
+  int complete;
+};
+
+struct tsapi_cont {
+  int kind;
+
+  TSEventFunc funcp;
+  void *data;
+  TSMutex mutexp;
+
+  int destroyed;
+
+  /* TRANSFORM: The input, and the output virtual connection */
+  TSVIO write_viop;
+  TSVConn output_connp;
+  int closed;
+
+  /* TRANSFORM_OUTPUT, CACHE_READ and CACHE_WRITE */
+  TSVIO viop;
+
+  /* CACHE_READ and CACHE_WRITE */
+  std::string key;
+  std::string object;
+};
+
+struct tsapi_action {
+  TSCont contp;
+  TSEvent event;
+  void *edata;
+
+  int cancelled;
+};
+
+/* A reference counted piece of memory that blocks point into */
+
+typedef struct {
+  char *data;
+  int refs;
+} Chunk;
+
+struct tsapi_bufferblock {
+  Chunk *chunkp;
+
+  const char *start;
+  int64_t length;
+
+  /* Of the start in the buffer */
+  int64_t offset;
+
+  struct tsapi_bufferblock *next;
+};
+
+struct tsapi_bufferreader {
+  TSIOBuffer bufp;
+
+  /* Consumed up to here */
+  int64_t pos;
+};
+
+struct tsapi_iobuffer {
+  TSIOBufferBlock head;
+  TSIOBufferBlock tail;
+
+  /* Of the end of the last block */
+  int64_t end;
+
+  std::vector<TSIOBufferReader> readers;
+};
+
+struct tsapi_cachekey {
+  std::string key;
+};
+
+/* TSMLoc points at one of these */
+
+typedef struct {
+  std::string str;
+} Url;
+
+typedef struct {
+  std::string name;
+  std::vector<std::string> values;
+
+  /* All the values, for TSMimeHdrFieldValueStringGet() with idx -1 */
+  std::string joined;
+} Field;
+
+typedef struct {
+  TSHttpStatus status;
+  Url *urlp;
+  std::vector<Field *> fields;
+} Hdr;
+
+struct tsapi_httptxn {
+  Hdr client_req;
+  Hdr server_resp;
+  Hdr client_resp;
+
+  /* Created with TSUrlCreate(), freed with the transaction */
+  std::vector<Url *> urls;
+
+  /* TSCacheUrlSet() */
+  std::string cache_url;
+
+  /* TSHttpTxnRedirectUrlSet() */
+  std::string redirect_url;
+
+  void *args[4];
+
+  /* TSHttpTxnCacheLookupStatusGet() */
+  int lookup_status;
+
+  /* TSHttpTxnServerRespNoStoreSet() */
+  int no_store;
+
+  /* TSHttpTxnServerAddrGet(), AF_UNSPEC unless set */
+  struct sockaddr_in server_addr;
+
+  TSCont transformp;
+  int reenabled;
+};
+
+static std::deque<TSAction> ready;
+static std::deque<TSAction> delayed;
+
+/* Destroyed continuations and closed virtual connections, freed once
+ * no queued event can refer to them */
+static std::vector<TSCont> graveyard;
+
+static std::unordered_map<std::string, std::string> cache;
+
+typedef struct {
+  std::string name;
+  TSMgmtInt value;
+} Stat;
+
+static std::vector<Stat> stats;
+
+void *
+_TSmalloc(size_t size, const char * /* path */)
+{
+  return malloc(size);
+}
+
+void *
+_TSrealloc(void *p, size_t size, const char * /* path */)
+{
+  return realloc(p, size);
+}
+
+char *
+_TSstrdup(const char *str, int64_t length, const char * /* path */)
+{
+  if (length < 0) {
+    length = strlen(str);
+  }
+
+  char *p = (char *) malloc(length + 1);
+
+  memcpy(p, str, length);
+  p[length] = '\0';
+
+  return p;
+}
+
+void
+_TSfree(void *p)
+{
+  free(p);
+}
+
+void
+TSError(const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+
+  fputc('\n', stderr);
+}
+
+TSReturnCode
+TSPluginRegister(TSSDKVersion /* sdk_version */, TSPluginRegistrationInfo * /* plugin_info */)
+{
+  return TS_SUCCESS;
+}
+
+TSHRTime
+TShrtime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (TSHRTime) ts.tv_sec * TS_HRTIME_SECOND + ts.tv_nsec;
+}
+
+/* Continuations, mutexes and scheduling */
+
+TSMutex
+TSMutexCreate(void)
+{
+  TSMutex mutexp = new tsapi_mutex;
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+
+  pthread_mutex_init(&mutexp->m, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  mutexp->refs = 0;
+
+  return mutexp;
+}
+
+void
+TSMutexDestroy(TSMutex mutexp)
+{
+  pthread_mutex_destroy(&mutexp->m);
+
+  delete mutexp;
+}
+
+void
+TSMutexLock(TSMutex mutexp)
+{
+  pthread_mutex_lock(&mutexp->m);
+}
+
+TSReturnCode
+TSMutexLockTry(TSMutex mutexp)
+{
+  return pthread_mutex_trylock(&mutexp->m) ? TS_ERROR : TS_SUCCESS;
+}
+
+void
+TSMutexUnlock(TSMutex mutexp)
+{
+  pthread_mutex_unlock(&mutexp->m);
+}
+
+static TSCont
+cont_create(int kind, TSEventFunc funcp, TSMutex mutexp)
+{
+  TSCont contp = new tsapi_cont;
+
+  contp->kind = kind;
+
+  contp->funcp = funcp;
+  contp->data = NULL;
+  contp->mutexp = mutexp;
+
+  if (mutexp) {
+    mutexp->refs += 1;
+  }
+
+  contp->destroyed = 0;
+
+  contp->write_viop = NULL;
+  contp->output_connp = NULL;
+  contp->closed = 0;
+
+  contp->viop = NULL;
+
+  return contp;
+}
+
+static void
+cont_free(TSCont contp)
+{
+  if (contp->mutexp && !--contp->mutexp->refs) {
+    TSMutexDestroy(contp->mutexp);
+  }
+
+  delete contp->viop;
+  delete contp;
+}
+
+/* Call the handler with the lock held, like the event system does */
+
+static void
+cont_deliver(TSCont contp, TSEvent event, void *edata)
+{
+  if (contp->destroyed) {
+    return;
+  }
+
+  if (contp->mutexp) {
+    TSMutexLock(contp->mutexp);
+  }
+
+  contp->funcp(contp, event, edata);
+
+  if (contp->mutexp) {
+    TSMutexUnlock(contp->mutexp);
+  }
+}
+
+TSCont
+TSContCreate(TSEventFunc funcp, TSMutex mutexp)
+{
+  return cont_create(CONT, funcp, mutexp);
+}
+
+void
+TSContDestroy(TSCont contp)
+{
+  contp->destroyed = 1;
+
+  graveyard.push_back(contp);
+}
+
+void
+TSContDataSet(TSCont contp, void *data)
+{
+  contp->data = data;
+}
+
+void *
+TSContDataGet(TSCont contp)
+{
+  return contp->data;
+}
+
+int
+TSContCall(TSCont contp, TSEvent event, void *edata)
+{
+  return contp->funcp(contp, event, edata);
+}
+
+TSMutex
+TSContMutexGet(TSCont contp)
+{
+  return contp->mutexp;
+}
+
+static TSAction
+schedule(std::deque<TSAction> &queue, TSCont contp, TSEvent event, void *edata)
+{
+  TSAction actionp = new tsapi_action;
+
+  actionp->contp = contp;
+  actionp->event = event;
+  actionp->edata = edata;
+  actionp->cancelled = 0;
+
+  queue.push_back(actionp);
+
+  return actionp;
+}
+
+/* Delayed events run after everything that's ready, however short the
+ * delay */
+
+TSAction
+TSContSchedule(TSCont contp, TSHRTime timeout, TSThreadPool /* tp */)
+{
+  return schedule(timeout ? delayed : ready, contp, timeout ? TS_EVENT_TIMEOUT : TS_EVENT_IMMEDIATE, NULL);
+}
+
+TSAction
+TSContScheduleOnPool(TSCont contp, TSHRTime timeout, TSThreadPool tp)
+{
+  return TSContSchedule(contp, timeout, tp);
+}
+
+void
+TSActionCancel(TSAction actionp)
+{
+  actionp->cancelled = 1;
+}
+
+void
+ts_run(void)
+{
+  for (;;) {
+    if (ready.empty()) {
+      if (delayed.empty()) {
+        break;
+      }
+
+      ready.push_back(delayed.front());
+      delayed.pop_front();
+    }
+
+    TSAction actionp = ready.front();
+    ready.pop_front();
+
+    if (!actionp->cancelled) {
+      cont_deliver(actionp->contp, actionp->event, actionp->edata);
+    }
+
+    delete actionp;
+  }
+
+  for (size_t i = 0; i < graveyard.size(); i += 1) {
+    cont_free(graveyard[i]);
+  }
+
+  graveyard.clear();
+}
+
+/* Transactions */
+
+void
+TSHttpHookAdd(TSHttpHookID /* id */, TSCont /* contp */)
+{
+}
+
+void
+TSHttpTxnHookAdd(TSHttpTxn txnp, TSHttpHookID id, TSCont contp)
+{
+  if (id == TS_HTTP_RESPONSE_TRANSFORM_HOOK) {
+    txnp->transformp = contp;
+  }
+}
+
+TSReturnCode
+TSHttpTxnReenable(TSHttpTxn txnp, TSEvent /* event */)
+{
+  txnp->reenabled += 1;
+
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSHttpTxnClientReqGet(TSHttpTxn txnp, TSMBuffer *bufp, TSMLoc *offset)
+{
+  *bufp = (TSMBuffer) txnp;
+  *offset = (TSMLoc) &txnp->client_req;
+
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSHttpTxnClientRespGet(TSHttpTxn txnp, TSMBuffer *bufp, TSMLoc *offset)
+{
+  *bufp = (TSMBuffer) txnp;
+  *offset = (TSMLoc) &txnp->client_resp;
+
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSHttpTxnServerRespGet(TSHttpTxn txnp, TSMBuffer *bufp, TSMLoc *offset)
+{
+  *bufp = (TSMBuffer) txnp;
+  *offset = (TSMLoc) &txnp->server_resp;
+
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSHttpTxnCacheLookupStatusGet(TSHttpTxn txnp, int *lookup_status)
+{
+  *lookup_status = txnp->lookup_status;
+
+  return TS_SUCCESS;
+}
+
+const struct sockaddr *
+TSHttpTxnServerAddrGet(TSHttpTxn txnp)
+{
+  return txnp->server_addr.sin_family == AF_INET ? (const struct sockaddr *) &txnp->server_addr : NULL;
+}
+
+/* The response is the one from the server, as if it was cached */
+
+TSReturnCode
+TSHttpTxnCachedRespGet(TSHttpTxn txnp, TSMBuffer *bufp, TSMLoc *offset)
+{
+  *bufp = (TSMBuffer) txnp;
+  *offset = (TSMLoc) &txnp->server_resp;
+
+  return TS_SUCCESS;
+}
+
+void
+TSHttpTxnServerRespNoStoreSet(TSHttpTxn txnp, int flag)
+{
+  txnp->no_store = flag;
+}
+
+void
+TSHttpTxnUntransformedRespCache(TSHttpTxn /* txnp */, int /* on */)
+{
+}
+
+void
+TSHttpTxnTransformedRespCache(TSHttpTxn /* txnp */, int /* on */)
+{
+}
+
+TSReturnCode
+TSHttpArgIndexReserve(const char * /* name */, const char * /* description */, int *arg_idx)
+{
+  static int next;
+
+  if (next == (int) (sizeof(((TSHttpTxn) NULL)->args) / sizeof(void *))) {
+    return TS_ERROR;
+  }
+
+  *arg_idx = next++;
+
+  return TS_SUCCESS;
+}
+
+void
+TSHttpTxnArgSet(TSHttpTxn txnp, int arg_idx, void *arg)
+{
+  txnp->args[arg_idx] = arg;
+}
+
+void *
+TSHttpTxnArgGet(TSHttpTxn txnp, int arg_idx)
+{
+  return txnp->args[arg_idx];
+}
+
+/* Takes ownership of the URL, like the real one */
+
+void
+TSHttpTxnRedirectUrlSet(TSHttpTxn txnp, const char *url, const int url_len)
+{
+  txnp->redirect_url.assign(url, url_len);
+
+  TSfree((void *) url);
+}
+
+TSHttpTxn
+ts_txn_create(const char *url, TSHttpStatus status)
+{
+  TSHttpTxn txnp = new tsapi_httptxn;
+
+  txnp->client_req.status = TS_HTTP_STATUS_NONE;
+  txnp->client_req.urlp = new Url;
+  txnp->client_req.urlp->str = url;
+
+  txnp->urls.push_back(txnp->client_req.urlp);
+
+  txnp->server_resp.status = status;
+  txnp->server_resp.urlp = NULL;
+
+  txnp->client_resp.status = status;
+  txnp->client_resp.urlp = NULL;
+
+  memset(txnp->args, 0, sizeof(txnp->args));
+
+  txnp->lookup_status = TS_CACHE_LOOKUP_MISS;
+
+  txnp->transformp = NULL;
+  txnp->reenabled = 0;
+  txnp->no_store = 0;
+
+  memset(&txnp->server_addr, 0, sizeof(txnp->server_addr));
+
+  return txnp;
+}
+
+void
+ts_txn_destroy(TSHttpTxn txnp)
+{
+  for (size_t i = 0; i < txnp->urls.size(); i += 1) {
+    delete txnp->urls[i];
+  }
+
+  for (size_t i = 0; i < txnp->client_req.fields.size(); i += 1) {
+    delete txnp->client_req.fields[i];
+  }
+
+  for (size_t i = 0; i < txnp->server_resp.fields.size(); i += 1) {
+    delete txnp->server_resp.fields[i];
+  }
+
+  for (size_t i = 0; i < txnp->client_resp.fields.size(); i += 1) {
+    delete txnp->client_resp.fields[i];
+  }
+
+  delete txnp;
+}
+
+/* Values are split at commas, like the real MIME parser does */
+
+void
+ts_txn_resp_field_add(TSHttpTxn txnp, int server, const char *name, const char *value)
+{
+  Field *fieldp = new Field;
+  fieldp->name = name;
+
+  for (const char *p = value; *p;) {
+    while (*p == ' ') {
+      p += 1;
+    }
+
+    const char *end = strchr(p, ',');
+    if (!end) {
+      end = p + strlen(p);
+    }
+
+    fieldp->values.push_back(std::string(p, end - p));
+
+    p = *end ? end + 1 : end;
+  }
+
+  (server ? txnp->server_resp : txnp->client_resp).fields.push_back(fieldp);
+}
+
+void
+ts_txn_cache_lookup_set(TSHttpTxn txnp, TSCacheLookupResult lookup_status)
+{
+  txnp->lookup_status = lookup_status;
+}
+
+int
+ts_txn_reenabled(TSHttpTxn txnp)
+{
+  return txnp->reenabled;
+}
+
+int
+ts_txn_no_store(TSHttpTxn txnp)
+{
+  return txnp->no_store;
+}
+
+void
+ts_txn_server_addr_set(TSHttpTxn txnp, const char *address)
+{
+  txnp->server_addr.sin_family = AF_INET;
+  inet_pton(AF_INET, address, &txnp->server_addr.sin_addr);
+}
+
+/* Headers and URLs */
+
+TSReturnCode
+TSHandleMLocRelease(TSMBuffer /* bufp */, TSMLoc /* parent */, TSMLoc /* mloc */)
+{
+  return TS_SUCCESS;
+}
+
+TSHttpStatus
+TSHttpHdrStatusGet(TSMBuffer /* bufp */, TSMLoc offset)
+{
+  return ((Hdr *) offset)->status;
+}
+
+const char *
+TSHttpHdrMethodGet(TSMBuffer /* bufp */, TSMLoc /* offset */, int *length)
+{
+  *length = TS_HTTP_LEN_GET;
+
+  return TS_HTTP_METHOD_GET;
+}
+
+TSReturnCode
+TSHttpHdrUrlGet(TSMBuffer /* bufp */, TSMLoc offset, TSMLoc *locp)
+{
+  Hdr *hdrp = (Hdr *) offset;
+  if (!hdrp->urlp) {
+    return TS_ERROR;
+  }
+
+  *locp = (TSMLoc) hdrp->urlp;
+
+  return TS_SUCCESS;
+}
+
+static TSMLoc
+field_find(Hdr *hdrp, size_t i, const char *name, int length)
+{
+  for (; i < hdrp->fields.size(); i += 1) {
+    Field *fieldp = hdrp->fields[i];
+    if ((int) fieldp->name.size() == length && !strncasecmp(fieldp->name.data(), name, length)) {
+      return (TSMLoc) fieldp;
+    }
+  }
+
+  return TS_NULL_MLOC;
+}
+
+TSMLoc
+TSMimeHdrFieldFind(TSMBuffer /* bufp */, TSMLoc hdr, const char *name, int length)
+{
+  return field_find((Hdr *) hdr, 0, name, length < 0 ? strlen(name) : length);
+}
+
+TSMLoc
+TSMimeHdrFieldNextDup(TSMBuffer /* bufp */, TSMLoc hdr, TSMLoc field)
+{
+  Hdr *hdrp = (Hdr *) hdr;
+  Field *fieldp = (Field *) field;
+
+  for (size_t i = 0; i < hdrp->fields.size(); i += 1) {
+    if (hdrp->fields[i] == fieldp) {
+      return field_find(hdrp, i + 1, fieldp->name.data(), fieldp->name.size());
+    }
+  }
+
+  return TS_NULL_MLOC;
+}
+
+int
+TSMimeHdrFieldValuesCount(TSMBuffer /* bufp */, TSMLoc /* hdr */, TSMLoc field)
+{
+  return ((Field *) field)->values.size();
+}
+
+const char *
+TSMimeHdrFieldValueStringGet(TSMBuffer /* bufp */, TSMLoc /* hdr */, TSMLoc field, int idx, int *value_len_ptr)
+{
+  Field *fieldp = (Field *) field;
+
+  if (idx >= 0) {
+    *value_len_ptr = fieldp->values[idx].size();
+
+    return fieldp->values[idx].data();
+  }
+
+  fieldp->joined.clear();
+  for (size_t i = 0; i < fieldp->values.size(); i += 1) {
+    if (i) {
+      fieldp->joined += ", ";
+    }
+
+    fieldp->joined += fieldp->values[i];
+  }
+
+  *value_len_ptr = fieldp->joined.size();
+
+  return fieldp->joined.data();
+}
+
+int64_t
+TSMimeHdrFieldValueInt64Get(TSMBuffer /* bufp */, TSMLoc /* hdr */, TSMLoc field, int idx)
+{
+  return strtoll(((Field *) field)->values[idx].c_str(), NULL, 10);
+}
+
+TSReturnCode
+TSMimeHdrFieldValuesClear(TSMBuffer /* bufp */, TSMLoc /* hdr */, TSMLoc field)
+{
+  ((Field *) field)->values.clear();
+
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSMimeHdrFieldValueStringInsert(TSMBuffer /* bufp */, TSMLoc /* hdr */, TSMLoc field, int idx, const char *value, int length)
+{
+  Field *fieldp = (Field *) field;
+
+  if (length < 0) {
+    length = strlen(value);
+  }
+
+  if (idx < 0 || idx >= (int) fieldp->values.size()) {
+    fieldp->values.push_back(std::string(value, length));
+
+  } else {
+    fieldp->values.insert(fieldp->values.begin() + idx, std::string(value, length));
+  }
+
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSMimeHdrFieldCreateNamed(TSMBuffer /* bufp */, TSMLoc /* mh_mloc */, const char *name, int name_len, TSMLoc *locp)
+{
+  Field *fieldp = new Field;
+  fieldp->name.assign(name, name_len < 0 ? strlen(name) : name_len);
+
+  *locp = (TSMLoc) fieldp;
+
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSMimeHdrFieldAppend(TSMBuffer /* bufp */, TSMLoc hdr, TSMLoc field)
+{
+  ((Hdr *) hdr)->fields.push_back((Field *) field);
+
+  return TS_SUCCESS;
+}
+
+/* A buffer is a transaction of its own, only its URLs are used */
+
+TSMBuffer
+TSMBufferCreate(void)
+{
+  return (TSMBuffer) ts_txn_create("", TS_HTTP_STATUS_NONE);
+}
+
+TSReturnCode
+TSMBufferDestroy(TSMBuffer bufp)
+{
+  ts_txn_destroy((TSHttpTxn) bufp);
+
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSUrlCreate(TSMBuffer bufp, TSMLoc *locp)
+{
+  Url *urlp = new Url;
+
+  ((TSHttpTxn) bufp)->urls.push_back(urlp);
+  *locp = (TSMLoc) urlp;
+
+  return TS_SUCCESS;
+}
+
+TSParseResult
+TSUrlParse(TSMBuffer /* bufp */, TSMLoc offset, const char **start, const char *end)
+{
+  if (end == *start) {
+    return TS_PARSE_ERROR;
+  }
+
+  ((Url *) offset)->str.assign(*start, end - *start);
+  *start = end;
+
+  return TS_PARSE_DONE;
+}
+
+char *
+TSUrlStringGet(TSMBuffer /* bufp */, TSMLoc offset, int *length)
+{
+  Url *urlp = (Url *) offset;
+
+  *length = urlp->str.size();
+
+  return TSstrndup(urlp->str.data(), urlp->str.size());
+}
+
+TSReturnCode
+TSBase64Encode(const char *str, size_t str_len, char *dst, size_t dst_size, size_t *length)
+{
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  const unsigned char *src = (const unsigned char *) str;
+
+  /* Room for the terminator too, like the real one */
+  if ((str_len + 2) / 3 * 4 + 1 > dst_size) {
+    return TS_ERROR;
+  }
+
+  *length = 0;
+
+  for (size_t i = 0; i < str_len; i += 3) {
+    uint32_t bits = src[i] << 16 | (i + 1 < str_len ? src[i + 1] << 8 : 0) | (i + 2 < str_len ? src[i + 2] : 0);
+
+    dst[(*length)++] = alphabet[bits >> 18 & 63];
+    dst[(*length)++] = alphabet[bits >> 12 & 63];
+    dst[(*length)++] = i + 1 < str_len ? alphabet[bits >> 6 & 63] : '=';
+    dst[(*length)++] = i + 2 < str_len ? alphabet[bits & 63] : '=';
+  }
+
+  dst[*length] = '\0';
+
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSBase64Decode(const char *str, size_t str_len, unsigned char *dst, size_t dst_size, size_t *length)
+{
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  uint32_t bits = 0;
+  int nbits = 0;
+
+  *length = 0;
+
+  for (size_t i = 0; i < str_len && str[i] != '='; i += 1) {
+    const char *p = strchr(alphabet, str[i]);
+    if (!p || !str[i]) {
+      return TS_ERROR;
+    }
+
+    bits = bits << 6 | (p - alphabet);
+    nbits += 6;
+
+    if (nbits >= 8) {
+      nbits -= 8;
+
+      if (*length == dst_size) {
+        return TS_ERROR;
+      }
+
+      dst[(*length)++] = bits >> nbits;
+    }
+  }
+
+  return TS_SUCCESS;
+}
+
+/* Cache */
+
+TSCacheKey
+TSCacheKeyCreate(void)
+{
+  return new tsapi_cachekey;
+}
+
+TSReturnCode
+TSCacheKeyDigestSet(TSCacheKey key, const char *input, int length)
+{
+  key->key = "D";
+  key->key.append(input, length);
+
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSCacheKeyDigestFromUrlSet(TSCacheKey key, TSMLoc url)
+{
+  key->key = "U" + ((Url *) url)->str;
+
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSCacheKeyDestroy(TSCacheKey key)
+{
+  delete key;
+
+  return TS_SUCCESS;
+}
+
+/* Both call back right away, which the plugin must be ready for */
+
+TSAction
+TSCacheRead(TSCont contp, TSCacheKey key)
+{
+  std::unordered_map<std::string, std::string>::iterator it = cache.find(key->key);
+  if (it == cache.end()) {
+    cont_deliver(contp, TS_EVENT_CACHE_OPEN_READ_FAILED, NULL);
+
+    return NULL;
+  }
+
+  TSVConn connp = cont_create(CACHE_READ, NULL, NULL);
+
+  connp->key = key->key;
+  connp->object = it->second;
+
+  cont_deliver(contp, TS_EVENT_CACHE_OPEN_READ, connp);
+
+  return NULL;
+}
+
+TSAction
+TSCacheWrite(TSCont contp, TSCacheKey key)
+{
+  TSVConn connp = cont_create(CACHE_WRITE, NULL, NULL);
+
+  connp->key = key->key;
+
+  cont_deliver(contp, TS_EVENT_CACHE_OPEN_WRITE, connp);
+
+  return NULL;
+}
+
+/* Only what the cache lookup uses changes */
+
+TSReturnCode
+TSCacheUrlSet(TSHttpTxn txnp, const char *url, int length)
+{
+  txnp->cache_url.assign(url, length);
+
+  return TS_SUCCESS;
+}
+
+void
+ts_cache_url_put(const char *url, const char *object, int64_t length)
+{
+  cache["U" + std::string(url)] = std::string(object, length);
+}
+
+void
+ts_cache_key_put(TSCacheKey key, const char *object, int64_t length)
+{
+  cache[key->key] = std::string(object, length);
+}
+
+void
+ts_cache_clear(void)
+{
+  cache.clear();
+}
+
+/* Virtual connections and VIOs */
+
+static TSVIO
+vio_create(TSCont contp, TSVConn connp, TSIOBuffer bufp, TSIOBufferReader readerp, int64_t nbytes)
+{
+  TSVIO viop = new tsapi_vio;
+
+  viop->contp = contp;
+  viop->connp = connp;
+
+  viop->bufp = bufp;
+  viop->readerp = readerp;
+
+  viop->nbytes = nbytes;
+  viop->ndone = 0;
+
+  viop->complete = 0;
+
+  return viop;
+}
+
+/* The whole object is read at once */
+
+TSVIO
+TSVConnRead(TSVConn connp, TSCont contp, TSIOBuffer bufp, int64_t nbytes)
+{
+  connp->viop = vio_create(contp, connp, bufp, NULL, nbytes);
+
+  connp->viop->ndone = TSIOBufferWrite(bufp, connp->object.data(), connp->object.size());
+  connp->viop->complete = 1;
+
+  schedule(ready, contp, TS_EVENT_VCONN_READ_COMPLETE, connp->viop);
+
+  return connp->viop;
+}
+
+TSVIO
+TSVConnWrite(TSVConn connp, TSCont contp, TSIOBufferReader readerp, int64_t nbytes)
+{
+  connp->viop = vio_create(contp, connp, NULL, readerp, nbytes);
+
+  if (connp->kind != CACHE_WRITE) {
+    return connp->viop;
+  }
+
+  /* Write the whole object at once */
+  for (TSIOBufferBlock blockp = TSIOBufferReaderStart(readerp); blockp; blockp = TSIOBufferBlockNext(blockp)) {
+    int64_t avail;
+    const char *start = TSIOBufferBlockReadStart(blockp, readerp, &avail);
+
+    connp->object.append(start, avail);
+  }
+
+  connp->viop->ndone = TSIOBufferReaderAvail(readerp);
+  TSIOBufferReaderConsume(readerp, connp->viop->ndone);
+
+  schedule(ready, contp, TS_EVENT_VCONN_WRITE_COMPLETE, connp->viop);
+
+  return connp->viop;
+}
+
+void
+TSVConnClose(TSVConn connp)
+{
+  if (connp->kind == CACHE_WRITE) {
+    cache[connp->key] = connp->object;
+  }
+
+  TSContDestroy(connp);
+}
+
+int
+TSVConnClosedGet(TSVConn connp)
+{
+  return connp->closed;
+}
+
+TSVIO
+TSVConnWriteVIOGet(TSVConn connp)
+{
+  return connp->write_viop;
+}
+
+int64_t
+TSVConnCacheObjectSizeGet(TSVConn connp)
+{
+  return connp->object.size();
+}
+
+TSVConn
+TSTransformCreate(TSEventFunc event_funcp, TSHttpTxn /* txnp */)
+{
+  TSVConn connp = cont_create(TRANSFORM, event_funcp, TSMutexCreate());
+
+  connp->output_connp = cont_create(TRANSFORM_OUTPUT, NULL, NULL);
+
+  return connp;
+}
+
+TSVConn
+TSTransformOutputVConnGet(TSVConn connp)
+{
+  return connp->output_connp;
+}
+
+int64_t
+TSVIONBytesGet(TSVIO viop)
+{
+  return viop->nbytes;
+}
+
+void
+TSVIONBytesSet(TSVIO viop, int64_t nbytes)
+{
+  viop->nbytes = nbytes;
+}
+
+int64_t
+TSVIONDoneGet(TSVIO viop)
+{
+  return viop->ndone;
+}
+
+void
+TSVIONDoneSet(TSVIO viop, int64_t ndone)
+{
+  viop->ndone = ndone;
+}
+
+int64_t
+TSVIONTodoGet(TSVIO viop)
+{
+  return viop->nbytes - viop->ndone;
+}
+
+TSIOBufferReader
+TSVIOReaderGet(TSVIO viop)
+{
+  return viop->readerp;
+}
+
+TSCont
+TSVIOContGet(TSVIO viop)
+{
+  return viop->contp;
+}
+
+/* Only the output of a transformation does anything: Like a client
+ * with an infinitely fast connection, it consumes whatever is
+ * available, and says so once it's got everything */
+
+static FILE *transform_output;
+
+void
+ts_transform_output_set(FILE *fp)
+{
+  transform_output = fp;
+}
+
+void
+TSVIOReenable(TSVIO viop)
+{
+  if (viop->connp->kind != TRANSFORM_OUTPUT) {
+    return;
+  }
+
+  int64_t avail = TSIOBufferReaderAvail(viop->readerp);
+
+  if (transform_output) {
+    int64_t written = 0;
+    for (TSIOBufferBlock blockp = TSIOBufferReaderStart(viop->readerp); blockp && written < avail; blockp = TSIOBufferBlockNext(blockp)) {
+      int64_t length;
+      const char *start = TSIOBufferBlockReadStart(blockp, viop->readerp, &length);
+
+      if (length > avail - written) {
+        length = avail - written;
+      }
+
+      fwrite(start, 1, length, transform_output);
+      written += length;
+    }
+  }
+
+  TSIOBufferReaderConsume(viop->readerp, avail);
+  viop->ndone += avail;
+
+  if (viop->ndone >= viop->nbytes && !viop->complete) {
+    viop->complete = 1;
+
+    schedule(ready, viop->contp, TS_EVENT_VCONN_WRITE_COMPLETE, viop);
+  }
+}
+
+/* IOBuffers */
+
+TSIOBuffer
+TSIOBufferCreate(void)
+{
+  TSIOBuffer bufp = new tsapi_iobuffer;
+
+  bufp->head = NULL;
+  bufp->tail = NULL;
+  bufp->end = 0;
+
+  return bufp;
+}
+
+static void
+block_append(TSIOBuffer bufp, Chunk *chunkp, const char *start, int64_t length)
+{
+  TSIOBufferBlock blockp = new tsapi_bufferblock;
+
+  blockp->chunkp = chunkp;
+  chunkp->refs += 1;
+
+  blockp->start = start;
+  blockp->length = length;
+  blockp->offset = bufp->end;
+  blockp->next = NULL;
+
+  if (bufp->tail) {
+    bufp->tail->next = blockp;
+
+  } else {
+    bufp->head = blockp;
+  }
+
+  bufp->tail = blockp;
+  bufp->end += length;
+}
+
+static void
+block_free(TSIOBufferBlock blockp)
+{
+  if (!--blockp->chunkp->refs) {
+    free(blockp->chunkp->data);
+    delete blockp->chunkp;
+  }
+
+  delete blockp;
+}
+
+void
+TSIOBufferDestroy(TSIOBuffer bufp)
+{
+  while (bufp->head) {
+    TSIOBufferBlock next = bufp->head->next;
+
+    block_free(bufp->head);
+    bufp->head = next;
+  }
+
+  for (size_t i = 0; i < bufp->readers.size(); i += 1) {
+    delete bufp->readers[i];
+  }
+
+  delete bufp;
+}
+
+int64_t
+TSIOBufferWrite(TSIOBuffer bufp, const void *buf, int64_t length)
+{
+  const char *p = (const char *) buf;
+
+  for (int64_t done = 0; done < length;) {
+    int64_t n = length - done < BLOCK_SIZE ? length - done : BLOCK_SIZE;
+
+    Chunk *chunkp = new Chunk;
+
+    chunkp->data = (char *) malloc(n);
+    chunkp->refs = 0;
+
+    memcpy(chunkp->data, p + done, n);
+
+    block_append(bufp, chunkp, chunkp->data, n);
+
+    done += n;
+  }
+
+  return length;
+}
+
+/* Clone the blocks, don't copy the bytes */
+
+int64_t
+TSIOBufferCopy(TSIOBuffer bufp, TSIOBufferReader readerp, int64_t length, int64_t offset)
+{
+  int64_t from = readerp->pos + offset;
+  int64_t to = from + length;
+
+  for (TSIOBufferBlock blockp = readerp->bufp->head; blockp && blockp->offset < to; blockp = blockp->next) {
+    int64_t start = from > blockp->offset ? from - blockp->offset : 0;
+    int64_t end = to < blockp->offset + blockp->length ? to - blockp->offset : blockp->length;
+
+    if (start < end) {
+      block_append(bufp, blockp->chunkp, blockp->start + start, end - start);
+    }
+  }
+
+  return length;
+}
+
+TSIOBufferReader
+TSIOBufferReaderAlloc(TSIOBuffer bufp)
+{
+  TSIOBufferReader readerp = new tsapi_bufferreader;
+
+  readerp->bufp = bufp;
+  readerp->pos = bufp->head ? bufp->head->offset : bufp->end;
+
+  bufp->readers.push_back(readerp);
+
+  return readerp;
+}
+
+int64_t
+TSIOBufferReaderAvail(TSIOBufferReader readerp)
+{
+  return readerp->bufp->end - readerp->pos;
+}
+
+/* Free the blocks every reader is done with */
+
+void
+TSIOBufferReaderConsume(TSIOBufferReader readerp, int64_t nbytes)
+{
+  TSIOBuffer bufp = readerp->bufp;
+
+  readerp->pos += nbytes;
+  if (readerp->pos > bufp->end) {
+    readerp->pos = bufp->end;
+  }
+
+  int64_t pos = bufp->end;
+  for (size_t i = 0; i < bufp->readers.size(); i += 1) {
+    if (bufp->readers[i]->pos < pos) {
+      pos = bufp->readers[i]->pos;
+    }
+  }
+
+  while (bufp->head && bufp->head->offset + bufp->head->length <= pos) {
+    TSIOBufferBlock next = bufp->head->next;
+
+    block_free(bufp->head);
+    bufp->head = next;
+  }
+
+  if (!bufp->head) {
+    bufp->tail = NULL;
+  }
+}
+
+TSIOBufferBlock
+TSIOBufferReaderStart(TSIOBufferReader readerp)
+{
+  TSIOBufferBlock blockp = readerp->bufp->head;
+  while (blockp && blockp->offset + blockp->length <= readerp->pos) {
+    blockp = blockp->next;
+  }
+
+  return blockp;
+}
+
+TSIOBufferBlock
+TSIOBufferBlockNext(TSIOBufferBlock blockp)
+{
+  return blockp->next;
+}
+
+const char *
+TSIOBufferBlockReadStart(TSIOBufferBlock blockp, TSIOBufferReader readerp, int64_t *avail)
+{
+  int64_t skip = readerp->pos > blockp->offset ? readerp->pos - blockp->offset : 0;
+
+  *avail = blockp->length - skip;
+
+  return blockp->start + skip;
+}
+
+/* Statistics and logs */
+
+int
+TSStatCreate(const char *name, TSRecordDataType /* type */, TSStatPersistence /* persist */, TSStatSync /* sync */)
+{
+  Stat stat = { name, 0 };
+  stats.push_back(stat);
+
+  return stats.size() - 1;
+}
+
+void
+TSStatIntIncrement(int id, TSMgmtInt amount)
+{
+  stats[id].value += amount;
+}
+
+void
+TSStatIntSet(int id, TSMgmtInt value)
+{
+  stats[id].value = value;
+}
+
+TSMgmtInt
+ts_stat_get(const char *name)
+{
+  for (size_t i = 0; i < stats.size(); i += 1) {
+    if (stats[i].name == name) {
+      return stats[i].value;
+    }
+  }
+
+  return 0;
+}
+
+/* Format the line but throw it away */
+
+TSReturnCode
+TSTextLogObjectCreate(const char * /* filename */, int /* mode */, TSTextLogObject *new_log_obj)
+{
+  *new_log_obj = (TSTextLogObject) &stats;
+
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSTextLogObjectWrite(TSTextLogObject /* the_object */, const char *format, ...)
+{
+  char line[4096];
+  va_list ap;
+
+  va_start(ap, format);
+  vsnprintf(line, sizeof(line), format, ap);
+  va_end(ap);
+
+  return TS_SUCCESS;
+}
+
+/* Run a response through the transaction's transformation: A producer
+ * continuation stands in for the origin.  It writes a block each time
+ * the transformation asks for more. */
+
+typedef struct {
+  const char *body;
+  int64_t length;
+  int64_t block_size;
+
+  int64_t written;
+
+  TSVConn transformp;
+  TSVIO viop;
+} Producer;
+
+static int
+producer_handler(TSCont contp, TSEvent event, void * /* edata */)
+{
+  Producer *producerp = (Producer *) TSContDataGet(contp);
+
+  if (event != TS_EVENT_VCONN_WRITE_READY || producerp->written == producerp->length) {
+    return 0;
+  }
+
+  int64_t n = producerp->length - producerp->written;
+  if (n > producerp->block_size) {
+    n = producerp->block_size;
+  }
+
+  TSIOBufferWrite(producerp->viop->bufp, producerp->body + producerp->written, n);
+  producerp->written += n;
+
+  schedule(ready, producerp->transformp, TS_EVENT_IMMEDIATE, NULL);
+
+  return 0;
+}
+
+void
+ts_txn_transform(TSHttpTxn txnp, const char *body, int64_t length, int64_t block_size)
+{
+  TSVConn transformp = txnp->transformp;
+  if (!transformp) {
+    return;
+  }
+
+  txnp->transformp = NULL;
+
+  Producer producer;
+
+  producer.body = body;
+  producer.length = length;
+  producer.block_size = block_size;
+  producer.written = 0;
+  producer.transformp = transformp;
+
+  TSCont contp = cont_create(CONT, producer_handler, NULL);
+  TSContDataSet(contp, &producer);
+
+  TSIOBuffer bufp = TSIOBufferCreate();
+  TSIOBufferReader readerp = TSIOBufferReaderAlloc(bufp);
+
+  producer.viop = vio_create(contp, transformp, bufp, readerp, length);
+  transformp->write_viop = producer.viop;
+
+  /* The output is the transformation's own to free */
+  graveyard.push_back(transformp->output_connp);
+
+  producer_handler(contp, TS_EVENT_VCONN_WRITE_READY, NULL);
+
+  ts_run();
+
+  TSIOBufferDestroy(bufp);
+  delete producer.viop;
+
+  cont_free(contp);
+}
@@ -0,0 +1,24 @@
+/* The remap plugin part of the fake, see ts.h */
+
+#ifndef METALINK_BENCH_REMAP_H
+#define METALINK_BENCH_REMAP_H
+
+#include "ts.h"
+
+typedef enum {
+  TSREMAP_NO_REMAP = 0,
+  TSREMAP_DID_REMAP = 1
+} TSRemapStatus;
+
+typedef struct {
+  unsigned long size;
+  unsigned long tsremap_version;
+} TSRemapInterface;
+
+typedef struct {
+  TSMBuffer requestBufp;
+  TSMLoc requestHdrp;
+  TSMLoc requestUrl;
+} TSRemapRequestInfo;
+
+#endif /* METALINK_BENCH_REMAP_H */
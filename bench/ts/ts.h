@@ -0,0 +1,343 @@
+/* A fake of the part of the Traffic Server plugin API that the plugin
+ * uses, so bench/metalink can run the plugin's own code in-process,
+ * without a proxy.  Not a general purpose implementation:
+ *
+ *    - one thread, events run from a queue by ts_run()
+ *    - the cache is a hash map from key to object
+ *    - IOBuffer blocks are reference counted, so TSIOBufferCopy()
+ *      clones them without copying the bytes, like the real thing
+ *    - headers are parsed values only, nothing is marshalled
+ *
+ * The declarations follow ts/ts.h from the Traffic Server SDK. */
+
+#ifndef METALINK_BENCH_TS_H
+#define METALINK_BENCH_TS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+typedef struct tsapi_cont *TSCont;
+typedef struct tsapi_cont *TSVConn;
+typedef struct tsapi_httptxn *TSHttpTxn;
+typedef struct tsapi_mbuffer *TSMBuffer;
+typedef struct tsapi_mloc *TSMLoc;
+typedef struct tsapi_cachekey *TSCacheKey;
+typedef struct tsapi_iobuffer *TSIOBuffer;
+typedef struct tsapi_bufferreader *TSIOBufferReader;
+typedef struct tsapi_bufferblock *TSIOBufferBlock;
+typedef struct tsapi_vio *TSVIO;
+typedef struct tsapi_mutex *TSMutex;
+typedef struct tsapi_action *TSAction;
+typedef struct tsapi_textlogobject *TSTextLogObject;
+
+typedef int64_t TSHRTime;
+typedef int64_t TSMgmtInt;
+
+#define TS_HRTIME_NSECOND 1LL
+#define TS_HRTIME_USECOND (1000 * TS_HRTIME_NSECOND)
+#define TS_HRTIME_MSECOND (1000 * TS_HRTIME_USECOND)
+#define TS_HRTIME_SECOND (1000 * TS_HRTIME_MSECOND)
+#define TS_HRTIME_SECONDS(x) ((x) * TS_HRTIME_SECOND)
+
+#define TS_NULL_MLOC ((TSMLoc) 0)
+
+typedef enum {
+  TS_ERROR = -1,
+  TS_SUCCESS = 0
+} TSReturnCode;
+
+typedef enum {
+  TS_PARSE_ERROR = -1,
+  TS_PARSE_DONE = 0
+} TSParseResult;
+
+typedef enum {
+  TS_EVENT_NONE = 0,
+  TS_EVENT_IMMEDIATE = 1,
+  TS_EVENT_TIMEOUT = 2,
+  TS_EVENT_VCONN_READ_READY = 100,
+  TS_EVENT_VCONN_WRITE_READY = 101,
+  TS_EVENT_VCONN_READ_COMPLETE = 102,
+  TS_EVENT_VCONN_WRITE_COMPLETE = 103,
+  TS_EVENT_CACHE_OPEN_READ = 1102,
+  TS_EVENT_CACHE_OPEN_READ_FAILED = 1103,
+  TS_EVENT_CACHE_OPEN_WRITE = 1108,
+  TS_EVENT_CACHE_OPEN_WRITE_FAILED = 1109,
+  TS_EVENT_HTTP_CONTINUE = 60000,
+  TS_EVENT_HTTP_ERROR = 60001,
+  TS_EVENT_HTTP_READ_RESPONSE_HDR = 60006,
+  TS_EVENT_HTTP_SEND_RESPONSE_HDR = 60007,
+  TS_EVENT_HTTP_CACHE_LOOKUP_COMPLETE = 60015,
+  TS_EVENT_HTTP_POST_REMAP = 60017
+} TSEvent;
+
+typedef enum {
+  TS_HTTP_READ_RESPONSE_HDR_HOOK = 4,
+  TS_HTTP_SEND_RESPONSE_HDR_HOOK = 5,
+  TS_HTTP_RESPONSE_TRANSFORM_HOOK = 7,
+  TS_HTTP_CACHE_LOOKUP_COMPLETE_HOOK = 13,
+  TS_HTTP_POST_REMAP_HOOK = 15
+} TSHttpHookID;
+
+typedef enum {
+  TS_HTTP_STATUS_NONE = 0,
+  TS_HTTP_STATUS_OK = 200,
+  TS_HTTP_STATUS_MOVED_TEMPORARILY = 302
+} TSHttpStatus;
+
+typedef enum {
+  TS_CACHE_LOOKUP_MISS,
+  TS_CACHE_LOOKUP_HIT_STALE,
+  TS_CACHE_LOOKUP_HIT_FRESH,
+  TS_CACHE_LOOKUP_SKIPPED
+} TSCacheLookupResult;
+
+typedef enum {
+  TS_THREAD_POOL_DEFAULT = -1,
+  TS_THREAD_POOL_NET,
+  TS_THREAD_POOL_TASK
+} TSThreadPool;
+
+typedef enum {
+  TS_RECORDDATATYPE_INT = 1
+} TSRecordDataType;
+
+typedef enum {
+  TS_STAT_PERSISTENT = 1,
+  TS_STAT_NON_PERSISTENT
+} TSStatPersistence;
+
+typedef enum {
+  TS_STAT_SYNC_SUM = 0
+} TSStatSync;
+
+typedef enum {
+  TS_LOG_MODE_ADD_TIMESTAMP = 1
+} TSLogMode;
+
+typedef enum {
+  TS_SDK_VERSION_3_0 = 0
+} TSSDKVersion;
+
+typedef struct {
+  char *plugin_name;
+  char *vendor_name;
+  char *support_email;
+} TSPluginRegistrationInfo;
+
+typedef int (*TSEventFunc)(TSCont contp, TSEvent event, void *edata);
+
+#define TS_MIME_FIELD_CACHE_CONTROL "Cache-Control"
+#define TS_MIME_LEN_CACHE_CONTROL 13
+#define TS_MIME_FIELD_CONTENT_LENGTH "Content-Length"
+#define TS_MIME_LEN_CONTENT_LENGTH 14
+#define TS_MIME_FIELD_CONTENT_LOCATION "Content-Location"
+#define TS_MIME_LEN_CONTENT_LOCATION 16
+#define TS_MIME_FIELD_CONTENT_TYPE "Content-Type"
+#define TS_MIME_LEN_CONTENT_TYPE 12
+#define TS_MIME_FIELD_LOCATION "Location"
+#define TS_MIME_LEN_LOCATION 8
+
+#define TS_HTTP_METHOD_GET "GET"
+#define TS_HTTP_LEN_GET 3
+
+#define TS_HTTP_VALUE_NO_STORE "no-store"
+#define TS_HTTP_LEN_NO_STORE 8
+#define TS_HTTP_VALUE_PRIVATE "private"
+#define TS_HTTP_LEN_PRIVATE 7
+
+/* Memory */
+
+void *_TSmalloc(size_t size, const char *path);
+void *_TSrealloc(void *p, size_t size, const char *path);
+char *_TSstrdup(const char *str, int64_t length, const char *path);
+void _TSfree(void *p);
+
+#define TSmalloc(s) _TSmalloc((s), __FILE__)
+#define TSrealloc(p, s) _TSrealloc((p), (s), __FILE__)
+#define TSstrdup(p) _TSstrdup((p), -1, __FILE__)
+#define TSstrndup(p, n) _TSstrdup((p), (n), __FILE__)
+#define TSfree(p) _TSfree(p)
+
+/* Diagnostics */
+
+void TSError(const char *fmt, ...);
+
+#define TSDebug(tag, ...) ((void) 0)
+#define TSAssert(expr) ((void) 0)
+
+TSReturnCode TSPluginRegister(TSSDKVersion sdk_version, TSPluginRegistrationInfo *plugin_info);
+
+TSHRTime TShrtime(void);
+
+/* Continuations, mutexes and scheduling */
+
+TSCont TSContCreate(TSEventFunc funcp, TSMutex mutexp);
+void TSContDestroy(TSCont contp);
+void TSContDataSet(TSCont contp, void *data);
+void *TSContDataGet(TSCont contp);
+int TSContCall(TSCont contp, TSEvent event, void *edata);
+TSMutex TSContMutexGet(TSCont contp);
+
+TSAction TSContSchedule(TSCont contp, TSHRTime timeout, TSThreadPool tp);
+TSAction TSContScheduleOnPool(TSCont contp, TSHRTime timeout, TSThreadPool tp);
+void TSActionCancel(TSAction actionp);
+
+TSMutex TSMutexCreate(void);
+void TSMutexDestroy(TSMutex mutexp);
+void TSMutexLock(TSMutex mutexp);
+TSReturnCode TSMutexLockTry(TSMutex mutexp);
+void TSMutexUnlock(TSMutex mutexp);
+
+/* Transactions */
+
+void TSHttpHookAdd(TSHttpHookID id, TSCont contp);
+void TSHttpTxnHookAdd(TSHttpTxn txnp, TSHttpHookID id, TSCont contp);
+TSReturnCode TSHttpArgIndexReserve(const char *name, const char *description, int *arg_idx);
+void TSHttpTxnArgSet(TSHttpTxn txnp, int arg_idx, void *arg);
+void *TSHttpTxnArgGet(TSHttpTxn txnp, int arg_idx);
+void TSHttpTxnRedirectUrlSet(TSHttpTxn txnp, const char *url, const int url_len);
+TSReturnCode TSHttpTxnReenable(TSHttpTxn txnp, TSEvent event);
+
+TSReturnCode TSHttpTxnClientReqGet(TSHttpTxn txnp, TSMBuffer *bufp, TSMLoc *offset);
+TSReturnCode TSHttpTxnClientRespGet(TSHttpTxn txnp, TSMBuffer *bufp, TSMLoc *offset);
+TSReturnCode TSHttpTxnServerRespGet(TSHttpTxn txnp, TSMBuffer *bufp, TSMLoc *offset);
+TSReturnCode TSHttpTxnCachedRespGet(TSHttpTxn txnp, TSMBuffer *bufp, TSMLoc *offset);
+TSReturnCode TSHttpTxnCacheLookupStatusGet(TSHttpTxn txnp, int *lookup_status);
+const struct sockaddr *TSHttpTxnServerAddrGet(TSHttpTxn txnp);
+
+void TSHttpTxnServerRespNoStoreSet(TSHttpTxn txnp, int flag);
+void TSHttpTxnUntransformedRespCache(TSHttpTxn txnp, int on);
+void TSHttpTxnTransformedRespCache(TSHttpTxn txnp, int on);
+
+/* Headers and URLs */
+
+TSReturnCode TSHandleMLocRelease(TSMBuffer bufp, TSMLoc parent, TSMLoc mloc);
+
+TSHttpStatus TSHttpHdrStatusGet(TSMBuffer bufp, TSMLoc offset);
+const char *TSHttpHdrMethodGet(TSMBuffer bufp, TSMLoc offset, int *length);
+TSReturnCode TSHttpHdrUrlGet(TSMBuffer bufp, TSMLoc offset, TSMLoc *locp);
+
+TSMLoc TSMimeHdrFieldFind(TSMBuffer bufp, TSMLoc hdr, const char *name, int length);
+TSMLoc TSMimeHdrFieldNextDup(TSMBuffer bufp, TSMLoc hdr, TSMLoc field);
+int TSMimeHdrFieldValuesCount(TSMBuffer bufp, TSMLoc hdr, TSMLoc field);
+const char *TSMimeHdrFieldValueStringGet(TSMBuffer bufp, TSMLoc hdr, TSMLoc field, int idx, int *value_len_ptr);
+int64_t TSMimeHdrFieldValueInt64Get(TSMBuffer bufp, TSMLoc hdr, TSMLoc field, int idx);
+TSReturnCode TSMimeHdrFieldValuesClear(TSMBuffer bufp, TSMLoc hdr, TSMLoc field);
+TSReturnCode TSMimeHdrFieldCreateNamed(TSMBuffer bufp, TSMLoc mh_mloc, const char *name, int name_len, TSMLoc *locp);
+TSReturnCode TSMimeHdrFieldAppend(TSMBuffer bufp, TSMLoc hdr, TSMLoc field);
+TSReturnCode TSMimeHdrFieldValueStringInsert(TSMBuffer bufp, TSMLoc hdr, TSMLoc field, int idx, const char *value, int length);
+
+TSMBuffer TSMBufferCreate(void);
+TSReturnCode TSMBufferDestroy(TSMBuffer bufp);
+
+TSReturnCode TSUrlCreate(TSMBuffer bufp, TSMLoc *locp);
+TSParseResult TSUrlParse(TSMBuffer bufp, TSMLoc offset, const char **start, const char *end);
+char *TSUrlStringGet(TSMBuffer bufp, TSMLoc offset, int *length);
+
+TSReturnCode TSBase64Encode(const char *str, size_t str_len, char *dst, size_t dst_size, size_t *length);
+TSReturnCode TSBase64Decode(const char *str, size_t str_len, unsigned char *dst, size_t dst_size, size_t *length);
+
+/* Cache */
+
+TSCacheKey TSCacheKeyCreate(void);
+TSReturnCode TSCacheKeyDigestSet(TSCacheKey key, const char *input, int length);
+TSReturnCode TSCacheKeyDigestFromUrlSet(TSCacheKey key, TSMLoc url);
+TSReturnCode TSCacheKeyDestroy(TSCacheKey key);
+
+TSAction TSCacheRead(TSCont contp, TSCacheKey key);
+TSReturnCode TSCacheUrlSet(TSHttpTxn txnp, const char *url, int length);
+TSAction TSCacheWrite(TSCont contp, TSCacheKey key);
+
+/* Virtual connections, VIOs and IOBuffers */
+
+TSVIO TSVConnRead(TSVConn connp, TSCont contp, TSIOBuffer bufp, int64_t nbytes);
+TSVIO TSVConnWrite(TSVConn connp, TSCont contp, TSIOBufferReader readerp, int64_t nbytes);
+void TSVConnClose(TSVConn connp);
+int TSVConnClosedGet(TSVConn connp);
+TSVIO TSVConnWriteVIOGet(TSVConn connp);
+int64_t TSVConnCacheObjectSizeGet(TSVConn connp);
+
+TSVConn TSTransformCreate(TSEventFunc event_funcp, TSHttpTxn txnp);
+TSVConn TSTransformOutputVConnGet(TSVConn connp);
+
+int64_t TSVIONBytesGet(TSVIO viop);
+void TSVIONBytesSet(TSVIO viop, int64_t nbytes);
+int64_t TSVIONDoneGet(TSVIO viop);
+void TSVIONDoneSet(TSVIO viop, int64_t ndone);
+int64_t TSVIONTodoGet(TSVIO viop);
+TSIOBufferReader TSVIOReaderGet(TSVIO viop);
+TSCont TSVIOContGet(TSVIO viop);
+void TSVIOReenable(TSVIO viop);
+
+TSIOBuffer TSIOBufferCreate(void);
+void TSIOBufferDestroy(TSIOBuffer bufp);
+int64_t TSIOBufferWrite(TSIOBuffer bufp, const void *buf, int64_t length);
+int64_t TSIOBufferCopy(TSIOBuffer bufp, TSIOBufferReader readerp, int64_t length, int64_t offset);
+
+TSIOBufferReader TSIOBufferReaderAlloc(TSIOBuffer bufp);
+int64_t TSIOBufferReaderAvail(TSIOBufferReader readerp);
+void TSIOBufferReaderConsume(TSIOBufferReader readerp, int64_t nbytes);
+TSIOBufferBlock TSIOBufferReaderStart(TSIOBufferReader readerp);
+
+TSIOBufferBlock TSIOBufferBlockNext(TSIOBufferBlock blockp);
+const char *TSIOBufferBlockReadStart(TSIOBufferBlock blockp, TSIOBufferReader readerp, int64_t *avail);
+
+/* Statistics and logs */
+
+int TSStatCreate(const char *name, TSRecordDataType type, TSStatPersistence persist, TSStatSync sync);
+void TSStatIntIncrement(int id, TSMgmtInt amount);
+void TSStatIntSet(int id, TSMgmtInt value);
+
+TSReturnCode TSTextLogObjectCreate(const char *filename, int mode, TSTextLogObject *new_log_obj);
+TSReturnCode TSTextLogObjectWrite(TSTextLogObject the_object, const char *format, ...);
+
+/* Only in the fake: Drive it from the benchmark */
+
+/* Run the queued events, the delayed ones last, until there are
+ * none */
+void ts_run(void);
+
+/* A transaction with a client request for the URL and a response with
+ * the status.  The request is a GET. */
+TSHttpTxn ts_txn_create(const char *url, TSHttpStatus status);
+void ts_txn_destroy(TSHttpTxn txnp);
+
+/* Add a header field to the client response (the send hook) or the
+ * server response (the read hook) */
+void ts_txn_resp_field_add(TSHttpTxn txnp, int server, const char *name, const char *value);
+
+/* What TSHttpTxnCacheLookupStatusGet() says, TS_CACHE_LOOKUP_MISS
+ * unless set */
+void ts_txn_cache_lookup_set(TSHttpTxn txnp, TSCacheLookupResult lookup_status);
+
+/* Write what the transformations pass on to this file, unless it's
+ * NULL (the default) */
+void ts_transform_output_set(FILE *fp);
+
+/* Times TSHttpTxnReenable() was called */
+int ts_txn_reenabled(TSHttpTxn txnp);
+
+/* Whether TSHttpTxnServerRespNoStoreSet() was set */
+int ts_txn_no_store(TSHttpTxn txnp);
+
+/* What TSHttpTxnServerAddrGet() says, an IPv4 address, NULL unless
+ * set */
+void ts_txn_server_addr_set(TSHttpTxn txnp, const char *address);
+
+/* Run the transaction's response transformation over a body of the
+ * length, delivered in blocks of the block size.  Returns once the
+ * transformation is done. */
+void ts_txn_transform(TSHttpTxn txnp, const char *body, int64_t length, int64_t block_size);
+
+/* Store or remove objects directly */
+void ts_cache_url_put(const char *url, const char *object, int64_t length);
+void ts_cache_key_put(TSCacheKey key, const char *object, int64_t length);
+void ts_cache_clear(void);
+
+/* The current value of the statistic with the name, or 0 */
+TSMgmtInt ts_stat_get(const char *name);
+
+#endif /* METALINK_BENCH_TS_H */
@@ -0,0 +1,116 @@
+#include <string.h>
+#include <strings.h>
+
+#include "digest.h"
+
+const DigestAlgorithm digest_algorithms[DIGEST_NALGS] = {
+  { "SHA-256", 32 },
+  { "SHA-512", 64 },
+  { "SHA", 20 }, /* SHA-1 */
+  { "MD5", 16 }
+};
+
+/* Feed each algorithm this many bytes before moving on to the next, so
+ * the stride is read from memory once and stays in the L1 cache for
+ * the rest */
+#define DIGEST_STRIDE 8192
+
+int
+digest_algorithm_get(const char *name, int length)
+{
+  for (int alg = 0; alg < DIGEST_NALGS; alg += 1) {
+    if ((int) strlen(digest_algorithms[alg].name) == length && !strncasecmp(digest_algorithms[alg].name, name, length)) {
+      return alg;
+    }
+  }
+
+  return -1;
+}
+
+/* OpenSSL 3.0 deprecates the low level functions in favor of EVP, but
+ * they're still the cheapest way to get at the same implementations
+ * without an allocation per transaction */
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+
+void
+digest_init(DigestContext *c, unsigned int algs, const Sha256Kernel *kernel)
+{
+  c->algs = algs;
+  c->kernel = kernel;
+
+  if (algs & 1 << DIGEST_SHA256) {
+    kernel->init(&c->sha256);
+  }
+
+  if (algs & 1 << DIGEST_SHA512) {
+    SHA512_Init(&c->sha512);
+  }
+
+  if (algs & 1 << DIGEST_SHA1) {
+    SHA1_Init(&c->sha1);
+  }
+
+  if (algs & 1 << DIGEST_MD5) {
+    MD5_Init(&c->md5);
+  }
+}
+
+void
+digest_update(DigestContext *c, const void *data, size_t length)
+{
+  const unsigned char *p = (const unsigned char *) data;
+
+  /* Common case: Nothing to share */
+  if (c->algs == 1 << DIGEST_SHA256) {
+    c->kernel->update(&c->sha256, p, length);
+
+    return;
+  }
+
+  while (length) {
+    size_t n = length < DIGEST_STRIDE ? length : DIGEST_STRIDE;
+
+    if (c->algs & 1 << DIGEST_SHA256) {
+      c->kernel->update(&c->sha256, p, n);
+    }
+
+    if (c->algs & 1 << DIGEST_SHA512) {
+      SHA512_Update(&c->sha512, p, n);
+    }
+
+    if (c->algs & 1 << DIGEST_SHA1) {
+      SHA1_Update(&c->sha1, p, n);
+    }
+
+    if (c->algs & 1 << DIGEST_MD5) {
+      MD5_Update(&c->md5, p, n);
+    }
+
+    p += n;
+    length -= n;
+  }
+}
+
+void
+digest_final(unsigned char md[DIGEST_NALGS][DIGEST_MAX_LENGTH], DigestContext *c)
+{
+  if (c->algs & 1 << DIGEST_SHA256) {
+    c->kernel->final(md[DIGEST_SHA256], &c->sha256);
+  }
+
+  if (c->algs & 1 << DIGEST_SHA512) {
+    SHA512_Final(md[DIGEST_SHA512], &c->sha512);
+  }
+
+  if (c->algs & 1 << DIGEST_SHA1) {
+    SHA1_Final(md[DIGEST_SHA1], &c->sha1);
+  }
+
+  if (c->algs & 1 << DIGEST_MD5) {
+    MD5_Final(md[DIGEST_MD5], &c->md5);
+  }
+}
+
+#pragma GCC diagnostic pop
@@ -0,0 +1,67 @@
+#ifndef METALINK_DIGEST_H
+#define METALINK_DIGEST_H
+
+#include <stddef.h>
+
+#include <openssl/md5.h>
+#include <openssl/sha.h>
+
+#include "sha256.h"
+
+/* Compute several message digests in one pass over the content.
+ * [RFC 3230] lets a response carry several, e.g.
+ *
+ *    Digest: SHA-256=...,MD5=...
+ *
+ * and a redirector might only publish some of them.  Re-reading a
+ * multi-gigabyte object for each algorithm isn't an option, so every
+ * enabled algorithm is fed the same content, a stride at a time, while
+ * the stride is still in the L1 cache. */
+
+/* In order of preference */
+enum {
+  DIGEST_SHA256,
+  DIGEST_SHA512,
+  DIGEST_SHA1,
+  DIGEST_MD5,
+  DIGEST_NALGS
+};
+
+#define DIGEST_MAX_LENGTH 64 /* SHA-512 */
+
+typedef struct {
+
+  /* Digest algorithm name from the IANA registry, e.g. "SHA-256" */
+  const char *name;
+
+  /* Bytes */
+  int length;
+
+} DigestAlgorithm;
+
+extern const DigestAlgorithm digest_algorithms[DIGEST_NALGS];
+
+typedef struct {
+
+  /* Bit set of the enabled algorithms */
+  unsigned int algs;
+
+  const Sha256Kernel *kernel;
+  Sha256Context sha256;
+
+  SHA512_CTX sha512;
+  SHA_CTX sha1;
+  MD5_CTX md5;
+
+} DigestContext;
+
+/* The algorithm with this name, case insensitive, or -1 */
+int digest_algorithm_get(const char *name, int length);
+
+void digest_init(DigestContext *c, unsigned int algs, const Sha256Kernel *kernel);
+void digest_update(DigestContext *c, const void *data, size_t length);
+
+/* One digest for each enabled algorithm, indexed by algorithm */
+void digest_final(unsigned char md[DIGEST_NALGS][DIGEST_MAX_LENGTH], DigestContext *c);
+
+#endif /* METALINK_DIGEST_H */
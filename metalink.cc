@@ -1,12 +1,31 @@
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-#include <openssl/sha.h>
-
+#include <ts/remap.h>
 #include <ts/ts.h>
 
+#include "digest.h"
+#include "sha256.h"
+
 /* Implement TS_HTTP_READ_RESPONSE_HDR_HOOK to implement a null
- * transformation.  Compute the SHA-256 digest of the content, write
- * it to the cache and store the request URL at that key.
+ * transformation.  Compute the digests of the content (by default
+ * SHA-256), write them to the cache and store the request URL at those
+ * keys.
  *
  * Implement TS_HTTP_SEND_RESPONSE_HDR_HOOK to check the Location and
  * Digest headers.  Use TSCacheRead() to check if the URL in the
@@ -18,20 +37,108 @@
  *
  *    [wiki page]   https://cwiki.apache.org/confluence/display/TS/Metalink */
 
-/* TSCacheWrite() and TSVConnWrite() data: Write the digest to the
- * cache and store the request URL at that key */
+/* A sampled transaction's trace: What happened at each transition of
+ * its state machine and when, on the monotonic clock.  It's written
+ * out as one line when the state machine is done. */
+
+#define TRACE_EVENTS 16
 
 typedef struct {
-  TSHttpTxn txnp;
+  const char *stage;
+  const char *outcome;
+  int64_t ns;
+} TraceEvent;
+
+typedef struct {
+  uint64_t id;
+
+  /* "transform", "write" or "send" */
+  const char *kind;
+
+  int64_t start;
 
+  /* Events after the last one are dropped */
+  TraceEvent events[TRACE_EVENTS];
+  int nevents;
+
+} Trace;
+
+/* TSCacheRead(), TSVConnRead(), TSCacheWrite() and TSVConnWrite()
+ * data: Write the digest to the cache and store the request URL at
+ * that key, unless it's already stored there */
+
+typedef struct {
   TSCacheKey key;
 
+  int alg;
+  char digest[DIGEST_MAX_LENGTH];
+
+  /* Request URL */
+  char *value;
+  int length;
+
+  /* Content length */
+  int64_t size;
+
+  /* The record, either read or to write */
+  char *record;
+  int record_length;
+
   TSVConn connp;
   TSIOBuffer cache_bufp;
+  TSIOBufferReader cache_readerp;
+  TSVIO cache_viop;
+
+  /* NULL unless sampled */
+  Trace *trace;
 
 } WriteData;
 
-/* TSTransformCreate() data: Compute the SHA-256 digest of the content */
+/* The ETag or Last-Modified header stored with a Digest header.
+ * Longer ones are treated like none. */
+#define HEADER_VALIDATOR_MAX 128
+
+/* TSContScheduleOnPool() data: Compute the digests of the content on
+ * a task thread instead of the net thread */
+
+typedef struct {
+  TSCont contp;
+
+  /* Protects everything the net thread and the task thread share:
+   * the buffer and the flags */
+  TSMutex mutexp;
+
+  /* References to the content that's not digested yet */
+  TSIOBuffer bufp;
+  TSIOBufferReader readerp;
+
+  /* A task is scheduled or running */
+  int scheduled;
+
+  /* All the content was handed over */
+  int complete;
+
+  /* The transformation was closed before the content was complete */
+  int aborted;
+
+  /* Message digest handle */
+  DigestContext c;
+
+  /* Request URL, got on the net thread while the transaction was
+   * still alive */
+  char *value;
+  int length;
+
+  /* Content length */
+  int64_t size;
+
+  /* ETag or Last-Modified, for the Digest header */
+  char validator[HEADER_VALIDATOR_MAX];
+  int validator_length;
+
+} HashData;
+
+/* TSTransformCreate() data: Compute the digests of the content */
 
 typedef struct {
   TSHttpTxn txnp;
@@ -41,12 +148,48 @@ typedef struct {
   TSVIO output_viop;
 
   /* Message digest handle */
-  SHA256_CTX c;
+  DigestContext c;
+
+  /* Offloaded digest, NULL if computing it on the net thread */
+  HashData *hash_data;
+
+  /* Digests from the response's Digest header, trusted instead of
+   * computed if it has all of them, otherwise zero */
+  unsigned int trusted_algs;
+  unsigned char trusted[DIGEST_NALGS][DIGEST_MAX_LENGTH];
+
+  /* ETag or Last-Modified of the response, for the Digest header */
+  char validator[HEADER_VALIDATOR_MAX];
+  int validator_length;
+
+  /* The fill this response registered, NULL if none */
+  char *fill_value;
+  int fill_length;
+  int fill_alg;
+  char fill_digest[32];
+
+  /* NULL unless sampled */
+  Trace *trace;
 
 } TransformData;
 
-/* TSCacheRead() and TSVConnRead() data: Check the Location and Digest
- * headers */
+/* TSCacheWrite() and TSVConnWrite() data: Store the Digest header of
+ * a URL's content */
+
+typedef struct {
+  TSCacheKey key;
+
+  /* The stored value */
+  char *value;
+  int length;
+
+  TSVConn connp;
+  TSIOBuffer cache_bufp;
+
+} HeaderWriteData;
+
+/* TSCacheRead() and TSVConnRead() data: Add the stored Digest header
+ * to a response from the cache */
 
 typedef struct {
   TSHttpTxn txnp;
@@ -54,693 +197,6131 @@ typedef struct {
   TSMBuffer resp_bufp;
   TSMLoc hdr_loc;
 
-  /* Location header */
-  TSMLoc location_loc;
+  /* Bit set of the algorithms the client wants */
+  unsigned int want;
 
-  /* Cache key */
-  TSMLoc url_loc;
-  TSCacheKey key;
+  /* Of the cached content, -1 if unknown */
+  int64_t size;
+
+  /* ETag or Last-Modified of the cached content */
+  char validator[HEADER_VALIDATOR_MAX];
+  int validator_length;
 
-  /* Digest header */
-  TSMLoc digest_loc;
+  /* SHA-256 of the request URL */
+  char hash[32];
 
-  /* Digest header field value index */
-  int idx;
+  TSCacheKey key;
 
   TSVConn connp;
   TSIOBuffer cache_bufp;
+  TSIOBufferReader cache_readerp;
+  TSVIO cache_viop;
 
-  const char *value;
-  int64_t length;
-
-} SendData;
+} HeaderData;
 
-/* Implement TS_HTTP_READ_RESPONSE_HDR_HOOK to implement a null
- * transformation */
-
-/* Write the digest to the cache and store the request URL at that key */
+/* TSTransformCreate() and TSCacheRead() data: Rewrite a Metalink
+ * document [RFC 5854] to put the cached mirrors first */
 
-static int
-cache_open_write(TSCont contp, void *edata)
-{
-  TSMBuffer req_bufp;
+typedef struct MetalinkData MetalinkData;
 
-  TSMLoc hdr_loc;
-  TSMLoc url_loc;
+typedef struct {
+  MetalinkData *data;
 
+  /* Allocation!  Must free!  Unescaped. */
   char *value;
   int length;
 
-  WriteData *data = (WriteData *) TSContDataGet(contp);
-  data->connp = (TSVConn) edata;
+  /* Offsets in the <file> element: the whitespace before the <url>
+   * element, the element itself, the '>' that ends its start tag and
+   * the end of the element.  start is -1 if it's not in the element,
+   * but from the index. */
+  int ws_start;
+  int start;
+  int tag_end;
+  int end;
 
-  TSCacheKeyDestroy(data->key);
+  /* The priority attribute, -1 if it has none */
+  int pri;
 
-  if (TSHttpTxnClientReqGet(data->txnp, &req_bufp, &hdr_loc) != TS_SUCCESS) {
-    TSError("Couldn't retrieve client request header");
+  TSCacheKey key;
 
-    TSContDestroy(contp);
+  /* Is it cached?  -1 if we don't know yet. */
+  int cached;
 
-    TSfree(data);
+} MetalinkUrl;
 
-    return 0;
-  }
+struct MetalinkData {
+  TSCont contp;
 
-  if (TSHttpHdrUrlGet(req_bufp, hdr_loc, &url_loc) != TS_SUCCESS) {
-    TSContDestroy(contp);
+  TSIOBuffer output_bufp;
+  TSVIO output_viop;
+  int64_t output_length;
 
-    TSfree(data);
+  /* Input that isn't passed on yet: Everything from the start of the
+   * <file> element being read, otherwise at most the start of one */
+  char *pending;
+  int64_t pending_length;
+  int64_t pending_size;
 
-    TSHandleMLocRelease(req_bufp, TS_NULL_MLOC, hdr_loc);
+  /* How much of the pending input was already searched for the end of
+   * the <file> element */
+  int64_t scanned;
 
-    return 0;
-  }
+  int state;
+
+  /* The <url> elements of the <file> element being looked up */
+  MetalinkUrl *urls;
+  int nurls;
+
+  /* Its length */
+  int64_t element_length;
+
+  /* Cache reads in flight, plus one while they're being started */
+  int lookups;
+
+  /* The event that resumes the transformation after the lookups */
+  TSAction actionp;
+
+  /* One for the transformation, one for each cache read in flight.
+   * The last one frees it. */
+  int refcount;
+
+  int closed;
+  int done;
+};
+
+/* TSCacheRead() data: Check if a URL we could rewrite the Location
+ * header with is cached, either a duplicate from a Link header or a
+ * candidate from the record at the digest */
+
+typedef struct SendData SendData;
+
+typedef struct {
+  SendData *data;
 
   /* Allocation!  Must free! */
-  value = TSUrlStringGet(req_bufp, url_loc, &length);
-  if (!value) {
-    TSContDestroy(contp);
+  char *value;
+  int length;
 
-    TSfree(data);
+  /* Lower is preferred */
+  int pri;
 
-    TSHandleMLocRelease(req_bufp, hdr_loc, url_loc);
-    TSHandleMLocRelease(req_bufp, TS_NULL_MLOC, hdr_loc);
+  TSCacheKey key;
 
-    return 0;
-  }
+  /* Is it cached?  -1 if we don't know yet. */
+  int cached;
 
-  TSHandleMLocRelease(req_bufp, hdr_loc, url_loc);
-  TSHandleMLocRelease(req_bufp, TS_NULL_MLOC, hdr_loc);
+} Candidate;
 
-  /* Store the request URL */
+/* A transaction waiting for another's lookups to finish, with the
+ * handles it needs to rewrite its response */
 
-  data->cache_bufp = TSIOBufferCreate();
-  TSIOBufferReader readerp = TSIOBufferReaderAlloc(data->cache_bufp);
+typedef struct Waiter {
+  TSHttpTxn txnp;
 
-  int nbytes = TSIOBufferWrite(data->cache_bufp, value, length);
+  TSMBuffer resp_bufp;
+  TSMLoc hdr_loc;
+  TSMLoc location_loc;
 
-  TSfree(value);
+  TSHRTime start;
 
-  /* Reentrant!  Reuse the TSCacheWrite() continuation. */
-  TSVConnWrite(data->connp, contp, readerp, nbytes);
+  struct Waiter *next;
 
-  return 0;
-}
+} Waiter;
 
-/* Do nothing */
+/* Lookups in flight, by the SHA-256 of what's looked up */
 
-static int
-cache_open_write_failed(TSCont contp, void */* edata ATS_UNUSED */)
-{
-  WriteData *data = (WriteData *) TSContDataGet(contp);
-  TSContDestroy(contp);
+typedef struct Flight {
+  char key[32];
 
-  TSCacheKeyDestroy(data->key);
-  TSfree(data);
+  Waiter *waiters;
 
-  return 0;
-}
+  struct Flight *next;
 
-static int
-write_vconn_write_complete(TSCont contp, void */* edata ATS_UNUSED */)
-{
-  WriteData *data = (WriteData *) TSContDataGet(contp);
-  TSContDestroy(contp);
+} Flight;
 
-  /* The object is not committed to the cache until the VConnection is
-   * closed.  When all the data has been transferred, the user (contp)
-   * must do a TSVConnClose() */
-  TSVConnClose(data->connp);
+typedef struct {
+  TSMutex mutexp;
 
-  TSIOBufferDestroy(data->cache_bufp);
-  TSfree(data);
+  Flight *flights;
 
-  return 0;
-}
+} FlightShard;
 
-/* TSCacheWrite() and TSVConnWrite() handler: Write the digest to the
- * cache and store the request URL at that key */
+/* TSCacheRead() and TSVConnRead() data: Check the Location and Digest
+ * headers */
 
-static int
-write_handler(TSCont contp, TSEvent event, void *edata)
-{
-  switch (event) {
-  case TS_EVENT_CACHE_OPEN_WRITE:
-    return cache_open_write(contp, edata);
+struct SendData {
+  TSHttpTxn txnp;
 
-  case TS_EVENT_CACHE_OPEN_WRITE_FAILED:
-    return cache_open_write_failed(contp, edata);
+  /* Checks if the Location URL is cached.  Its mutex is shared by all
+   * the transaction's lookups. */
+  TSCont contp;
 
-  case TS_EVENT_VCONN_WRITE_COMPLETE:
-    return write_vconn_write_complete(contp, edata);
+  TSMBuffer resp_bufp;
+  TSMLoc hdr_loc;
 
-  default:
-    TSAssert(!"Unexpected event");
-  }
+  /* Location header */
+  TSMLoc location_loc;
 
-  return 0;
-}
+  /* Cache key */
+  TSMLoc url_loc;
+  TSCacheKey key;
 
-/* Copy content from the input buffer to the output buffer without
- * modification and feed it through the message digest at the same
- * time.
+  /* Digest header, the algorithm we prefer out of the ones it lists */
+  int alg;
+  char digest[DIGEST_MAX_LENGTH];
+
+  /* URL remembered in the index */
+  char *index_value;
+  int index_length;
+  TSCacheKey index_key;
+
+  /* Lookups in flight, plus one for whoever is starting them */
+  int refcount;
+
+  /* The response was reenabled, don't touch it again */
+  int done;
+
+  /* Is the Location URL cached?  -1 if we don't know yet. */
+  int location_cached;
+
+  /* Was the record at the digest read?  -1 if we don't know yet, 0 if
+   * there's no record. */
+  int digest_read;
+
+  /* Record at the digest */
+  TSCacheKey digest_key;
+
+  TSVConn connp;
+  TSIOBuffer cache_bufp;
+  TSIOBufferReader cache_readerp;
+  TSVIO cache_viop;
+
+  /* Candidates from the record, most recently seen first */
+  Candidate *candidates;
+  int ncandidates;
+
+  /* Duplicates from Link headers, in order of priority */
+  Candidate *duplicates;
+  int nduplicates;
+
+  /* Don't wait for the duplicates forever */
+  TSCont timeout_contp;
+  TSAction timeout_actionp;
+  int timed_out;
+
+  /* When the response was held and the cache reads started, for the
+   * latency statistics */
+  TSHRTime start;
+  TSHRTime location_start;
+  TSHRTime record_start;
+
+  /* NULL unless sampled */
+  Trace *trace;
+
+  /* data->contp is reading the URL in the index, not the Location
+   * URL */
+  int index_reading;
+
+  /* Other transactions wait for these lookups, NULL unless
+   * coalescing */
+  Flight *flight;
+
+};
+
+/* In-memory index of the request URL stored at each digest.  Digests
+ * longer than 32 bytes are truncated, which is still plenty to tell
+ * them apart.  Check it before the cache so the common case costs one
+ * hash probe and one TSCacheRead() to confirm that URL is still
+ * cached, instead of three TSCacheRead() and a TSVConnRead() while the
+ * response is held.  It's only a hint: the cache is the authority, so
+ * entries can be missing or stale.
  *
- *    1.  Check if we are "closed" before doing anything else to avoid
- *        errors.
+ * The index is split into shards, each with its own lock, so threads
+ * rarely contend.  Each shard is a set associative table with
+ * INDEX_WAYS entries per set.  When a set is full the least recently
+ * used entry is replaced, so the index never grows beyond the size it
+ * was initialized with. */
+
+#define INDEX_SHARDS 64
+#define INDEX_WAYS 4
+
+typedef struct {
+  int alg;
+  char digest[32];
+
+  /* Request URL, NULL if the entry is empty */
+  char *value;
+  int length;
+
+  /* Least recently used */
+  unsigned int stamp;
+
+  /* When the URL was last known to be stored at the digest in the
+   * cache */
+  TSHRTime confirmed;
+
+} IndexEntry;
+
+typedef struct {
+  TSMutex mutexp;
+
+  IndexEntry *entries;
+  unsigned int stamp;
+
+} IndexShard;
+
+typedef struct {
+
+  /* Sets per shard, zero if the index is disabled */
+  int nsets;
+
+  IndexShard shards[INDEX_SHARDS];
+
+  /* Where changes are appended, if anywhere */
+  struct Snapshot *snapshotp;
+
+} Index;
+
+static Index digest_index;
+
+/* Fills in flight: The URL whose content is being written to the
+ * cache, by digest, so while the first client is still downloading the
+ * content from one mirror, clients redirected to other mirrors can be
+ * sent to the same URL instead and read it while it's written.
  *
- *    2.  Then deal with any input that's available now.
+ * A redirect only says which digest to expect: When nothing with it
+ * is cached yet, the digest is remembered by the SHA-256 of the
+ * Location URL.  The fill is registered only once the origin response
+ * for that URL is admitted, so a client that never follows the
+ * redirect doesn't steer the others to it.  It's forgotten when the
+ * transformation ends, complete or not, or after fill_timeout.
+ * Disabled unless --fill-timeout is given.
  *
- *    3.  Check if the input is complete after dealing with any
- *        available input in case it was the last of it.  If it is
- *        complete, tell downstream, thank upstream, and finish
- *        computing the digest.  Otherwise either wait for more input
- *        or abort if upstream is "closed".
+ *    alg           1 byte
+ *    digest        32 bytes, like the index */
+
+#define FILL_INDEX_SIZE 4096
+#define FILL_DIGEST_LENGTH 33
+
+static Index fill_index;
+static Index fill_redirect_index;
+
+static TSHRTime fill_timeout;
+
+/* Aliases: For URLs whose content is already cached under another
+ * URL, that URL, by the SHA-256 of the request URL.  The cache lookup
+ * of the request uses the other URL's key, so the content is stored
+ * once however many mirrors it's requested from.  All the URLs listed
+ * for the same content alias the smallest one, so aliases never form
+ * a cycle.  Disabled unless --alias is given.
  *
- * The handler is guaranteed to get called at least once, even if the
- * response is 304 Not Modified, so we are guaranteed an opportunity
- * to clean up e.g. data that we allocated when we called
- * TSTransformCreate().
+ * An alias only proves the two bodies matched once, so it's only used
+ * to serve a fresh hit.  On a miss or a stale hit the response from
+ * the request URL's origin isn't stored, it mustn't overwrite the
+ * other URL's content.  Then the alias is suspended, so the request
+ * URL's content is stored under its own key from the next request on,
+ * rather than fetched from its origin every time.  A suspended alias
+ * has no URL, and isn't renewed until alias_timeout.  The response is
+ * still hashed, and if its digest differs the alias is dropped.
+ * Entries are also forgotten after alias_timeout.
  *
- * TS_EVENT_VCONN_WRITE_READY and TS_EVENT_VCONN_WRITE_COMPLETE events
- * are sent from downstream, e.g. by
- * TransformTerminus::handle_event().  TS_EVENT_IMMEDIATE events are
- * sent by INKVConnInternal::do_io_write(),
- * INKVConnInternal::do_io_close(), and INKVConnInternal::reenable()
- * which are called from upstream, e.g. by
- * TransformVConnection::do_io_write(),
- * TransformVConnection::do_io_close(), and
- * HttpTunnel::producer_handler().
+ *    alg           1 byte
+ *    digest        32 bytes, like the index
+ *    URL           the rest, none if it's suspended */
+
+#define ALIAS_DIGEST_LENGTH 33
+
+static Index alias_index;
+
+static TSHRTime alias_timeout = TS_HRTIME_SECONDS(86400);
+
+/* Serve mode: When a redirect is rewritten to a cached URL, have the
+ * proxy follow it itself, from the cache, instead of the client.  The
+ * transaction argument marks the transactions that were redirected,
+ * so the response can say where it came from. */
+static int serve;
+static int serve_arg;
+
+/* Digest headers: The digests of the content at each URL, by the
+ * SHA-256 of the URL, so responses from the cache can carry a Digest
+ * header [RFC 3230] and the proxies downstream don't have to hash the
+ * content again.  They're also stored in the cache, so they outlive the
+ * index.  Disabled unless --digest-header is given.
  *
- * Clean up the output buffer on TS_EVENT_VCONN_WRITE_COMPLETE and not
- * before.  We are guaranteed a TS_EVENT_VCONN_WRITE_COMPLETE event
- * *unless* we are "closed".  In that case we instead get a
- * TS_EVENT_IMMEDIATE event where TSVConnClosedGet() is one.  We'll
- * only ever get one event where TSVConnClosedGet() is one and it will
- * be our last, so we *must* check for this case and clean up then
- * too.  Because we'll only ever get one such event and it will be our
- * last, there's no risk of double freeing.
+ *    content length, a space, the validator, a newline, then the
+ *    Digest header value
  *
- * The response headers get sent when TSVConnWrite() gets called and
- * not before.  (We could potentially edit them until then.)
+ * The validator is the ETag header, or else the Last-Modified header.
+ * Both it and the length have to match the cached response's, in case
+ * the content changed but wasn't admitted the next time.  Content
+ * without either gets no Digest header. */
+
+static Index header_index;
+
+/* "1234567 "abc"\nSHA-256=...,SHA-512=...,SHA=...,MD5=..." */
+#define HEADER_VALUE_MAX 512
+
+/* Take the digests from the Digest header of the response instead of
+ * hashing the content, when it's from a parent proxy that runs this
+ * plugin with --digest-header.  Only from the addresses given with
+ * --trust-digest: anyone else could claim the digest of a popular file
+ * and have the redirects for it rewritten to their URL. */
+static struct sockaddr_storage *trusted_addrs;
+static int ntrusted_addrs;
+
+/* Peers: The other proxies in the pool, e.g. behind the same load
+ * balancer.  Each time a record is written, the digest and the request
+ * URL are announced to them in a UDP datagram, and what they announce
+ * is remembered in the peer index.  When nothing with the digest is
+ * cached here, the redirect is rewritten with a URL a peer has cached,
+ * so the load balancer sends the client to that peer (with URL hashing)
+ * instead of another mirror.  The confirmed time is when it was
+ * announced, entries are forgotten after peer_timeout.  Disabled
+ * unless --peer or --peer-port is given.
  *
- * The events say nothing about the state of the input.  Gather this
- * instead from TSVConnClosedGet(), TSVIOReaderGet(), and
- * TSVIONTodoGet() and handle the end of the input independently from
- * the TS_EVENT_VCONN_WRITE_COMPLETE event from downstream.
+ * Announcements steer clients' redirects, so only the ones from the
+ * addresses of the configured peers are remembered.  That's no
+ * protection from spoofed datagrams, the peers must be on a trusted
+ * network.  Binding to that network's address keeps the port off the
+ * rest.
  *
- * When TSVConnClosedGet() is one, *we* are "closed".  We *must* check
- * for this case, if only to clean up allocated data.  Some state is
- * already inconsistent.  (This happens when the response is 304 Not
- * Modified or when the client or origin disconnect before the message
- * is complete.)
+ *    magic         4 bytes, "\177MLP"
+ *    alg           1 byte
+ *    digest        the algorithm's length
+ *    URL           the rest of the datagram
  *
- * When TSVIOReaderGet() is NULL, upstream is "closed".  In that case
- * it's clearly an error to call TSIOBufferReaderAvail(), it's also an
- * error at that point to send any events upstream with TSContCall().
- * (This happens when the content length is zero or when we get the
- * final chunk of a chunked response.)
+ * Datagrams that don't fit in PEER_DATAGRAM_MAX aren't sent. */
+
+#define PEER_MAGIC "\177MLP"
+
+#define PEER_DATAGRAM_MAX 1472
+
+/* How often the socket is drained, in milliseconds */
+#define PEER_POLL_INTERVAL 100
+
+typedef struct {
+  struct sockaddr_storage addr;
+  socklen_t length;
+} Peer;
+
+static Index peer_index;
+
+static TSHRTime peer_timeout = TS_HRTIME_SECONDS(7200);
+
+static Peer *peers;
+static int npeers;
+
+/* Sends the announcements, and receives them if --peer-port is given */
+static int peer_fd = -1;
+
+/* Metalink documents: Rewrite the <url> elements of Metalink documents
+ * [RFC 5854] so the cached ones come first, because download managers
+ * use those instead of the Location header.  The document is passed on
+ * as it arrives, except for one <file> element at a time, which is held
+ * until its URLs are looked up.  Disabled unless --metalink-xml is
+ * given. */
+
+#define METALINK_CONTENT_TYPE "application/metalink4+xml"
+
+/* A <file> element bigger than this is passed on as it is, and so is
+ * the rest of the document */
+#define METALINK_FILE_MAX (64 << 10)
+
+/* Only look up this many <url> elements in each <file> element */
+#define METALINK_URLS_MAX 64
+
+enum {
+  METALINK_OUTSIDE,
+  METALINK_FILE,
+  METALINK_WAITING,
+  METALINK_PASS
+};
+
+static int metalink_xml;
+
+static TSCont metalink_contp;
+
+/* Coalescing: Bursts of identical redirects, same Location URL, Link
+ * headers and digest, e.g. from a popular download button, attach to
+ * the first one's lookups instead of starting their own, and all get
+ * its answer.  The answer is also remembered for coalesce_ttl, by the
+ * SHA-256 of what was looked up, so the cache reads scale with the
+ * distinct files, not the requests.  The first byte of the remembered
+ * value is '1' if the URL is cached here (the proxy can follow it),
+ * '0' if not, then the URL the Location header was rewritten with,
+ * empty if it was kept.  Disabled unless --coalesce is given. */
+
+#define COALESCE_INDEX_SIZE 4096
+
+static int coalesce;
+
+static TSHRTime coalesce_ttl;
+
+static Index coalesce_index;
+
+static FlightShard flight_shards[INDEX_SHARDS];
+
+/* Snapshot of the index, so it's warm right after a restart: An
+ * append-only file with an entry each time the URL at a digest
+ * changes, or is forgotten.  TSPluginInit() maps it and replays it
+ * into the index (and the filter), then compacts it.  Each entry has
+ * a checksum, so replaying stops at an entry torn by a crash.  When
+ * appends have doubled the file, it's compacted again on a task
+ * thread: rewritten from the index and renamed over.  Appends that
+ * would wait for that are dropped, the index is only a hint anyway.
  *
- * The input is complete only when TSVIONTodoGet() is zero.  (Don't
- * update the downstream nbytes otherwise!)  Update the downstream
- * nbytes when the input is complete in case the response is chunked
- * (in which case nbytes is unknown until then).  Downstream will
- * (normally) send the TS_EVENT_VCONN_WRITE_COMPLETE event (and the
- * final chunk if the response is chunked) when ndone equals nbytes
- * and not before.
+ *    magic         4 bytes, "\177MLS"
+ *    version       1 byte, 1
+ *    reserved      3 bytes
  *
- * Send our own TS_EVENT_VCONN_WRITE_COMPLETE event upstream when the
- * input is complete otherwise HttpSM::update_stats() won't get called
- * and the transaction won't get logged.  (If there are upstream
- * transformations they won't get a chance to clean up otherwise!)
+ * then for each entry
  *
- * Summary of the cases each event can fall into:
+ *    checksum      4 bytes, FNV-1a of the rest of the entry
+ *    alg           1 byte
+ *    removed       1 byte
+ *    length        2 bytes
+ *    digest        32 bytes, like the index
+ *    URL           length bytes
  *
- *    Closed        *We* are "closed".  Clean up allocated data.
- *     │
- *     ├ Start      First (and last) time the handler was called.
- *     │            (This happens when the response is 304 Not
- *     │            Modified.)
- *     │
- *     └ Not start  (This happens when the client or origin disconnect
- *                  before the message is complete.)
+ * in host byte order. */
+
+#define SNAPSHOT_MAGIC "\177MLS"
+#define SNAPSHOT_VERSION 1
+
+#define SNAPSHOT_HEADER_LENGTH 8
+#define SNAPSHOT_ENTRY_LENGTH 40
+
+/* Compact when the file is this much bigger than after the last
+ * compaction */
+#define SNAPSHOT_SLACK (1 << 20)
+
+typedef struct Snapshot {
+
+  /* NULL if there's no snapshot */
+  char *path;
+
+  /* Protects everything else */
+  TSMutex mutexp;
+
+  /* -1 while it isn't open for appending */
+  int fd;
+
+  int64_t length;
+  int64_t compacted_length;
+
+  /* Compacts on a task thread */
+  TSCont contp;
+  int compacting;
+
+} Snapshot;
+
+static Snapshot digest_snapshot;
+
+static void snapshot_append(Snapshot *snapshotp, int alg, const char *digest, const char *value, int length, int removed);
+
+/* Bloom filter of the digests that have records in the cache, so most
+ * redirects, which carry digests of files nobody downloaded through us
+ * yet, don't need a cache read to find that out.  False positives
+ * just cost the cache read.
  *
- *    Start         First time the handler was called.  Initialize
- *     │            data here because we can't call TSVConnWrite()
- *     │            before TS_HTTP_RESPONSE_TRANSFORM_HOOK.
- *     │
- *     ├ Content length
- *     │
- *     └ Chunked response
+ * It can have false negatives too: No source lists every record in the
+ * cache.  It's seeded from the snapshot, which is required, and until
+ * it's warmed up digests also get added when their records are found.
+ * A record the index had already forgotten, that isn't written or
+ * found in that time, is missing from it after.  So it's only a hint
+ * for the redirects, which lose a rewrite, and records are always read
+ * before they're written, so no candidates are lost.
  *
- *    Upstream closed
- *                  (This happens when the content length is zero or
- *                  when we get the final chunk of a chunked
- *                  response.)
+ * Neither the snapshot nor the index lists every record either, so
+ * there's nothing to rebuild it from and it's never cleared.  When so
+ * many bits are set that the false positive rate climbs above
+ * FILTER_MAX_FPR it just saves fewer cache reads, and an error says
+ * to make it bigger.  Bits are only ever set, with atomic operations,
+ * so it needs no lock. */
+
+#define FILTER_HASHES 7
+#define FILTER_BITS_PER_DIGEST 10
+#define FILTER_MAX_FPR 0.05
+
+typedef struct {
+  uint64_t *bits;
+
+  /* Zero if the filter is disabled */
+  uint64_t nbits;
+
+  /* Bits set, to estimate the false positive rate */
+  uint64_t nset;
+
+  /* Nonzero once it said it's full */
+  int full;
+
+  /* Don't trust it before this time */
+  TSHRTime trusted;
+
+} Filter;
+
+static Filter digest_filter;
+
+static TSHRTime filter_warmup = TS_HRTIME_SECONDS(3600);
+
+/* Fastest SHA-256 kernel the CPU supports */
+static const Sha256Kernel *sha256_kernel;
+
+/* Compute digests on the task threads */
+static int hash_offload;
+
+/* Cache the response as it comes from the origin, not as it comes out
+ * of the transformation */
+static int tap;
+
+/* Don't check or write a record more often than this, if it stores
+ * the same URL */
+static TSHRTime write_interval = TS_HRTIME_SECONDS(60);
+
+/* Bit set of the digest algorithms to compute */
+static unsigned int digest_algs = 1 << DIGEST_SHA256;
+
+/* At most this many duplicates from Link headers are checked and not
+ * for longer than this many milliseconds */
+static int duplicates_max = 8;
+static int duplicates_timeout = 250;
+
+/* Admission policy: Which responses are worth computing the digest
+ * of */
+
+static char admit_status[600];
+
+static int64_t admit_min_length;
+static int64_t admit_max_length = INT64_MAX;
+
+/* Content-Type prefixes, all types if none */
+static char **admit_types;
+static int admit_ntypes;
+
+/* Which hooks to add, for each remap rule or for all transactions */
+typedef struct {
+  int hash;
+  int rewrite;
+} Rule;
+
+/* Handles both hooks, created once all the options are read */
+static TSCont handler_contp;
+
+/* Statistics, e.g.
  *
- *    Available input
+ *    traffic_ctl metric match plugin.metalink
  *
- *    Input complete
- *     │
- *     ├ Deja vu    There might be multiple TS_EVENT_IMMEDIATE events
- *     │            between the end of the input and the
- *     │            TS_EVENT_VCONN_WRITE_COMPLETE event from
- *     │            downstream.
- *     │
- *     └ Not deja vu
- *                  Tell downstream and thank upstream.
+ * One counter for each outcome of each handler, so it's plain how
+ * often the cache reads and writes are skipped and why, plus the bytes
+ * hashed and the time spent hashing them. */
+
+enum {
+  STAT_TRANSFORM_ADMITTED,
+  STAT_TRANSFORM_NOT_ADMITTED,
+  STAT_TRANSFORM_ABORTED,
+  STAT_TRANSFORM_TRUSTED,
+  STAT_TRANSFORM_FILL_REGISTERED,
+  STAT_HASH_BYTES,
+  STAT_HASH_NS,
+  STAT_WRITE_SKIPPED_INDEX,
+  STAT_WRITE_SKIPPED_RECORD,
+  STAT_WRITE_NEW,
+  STAT_WRITE_MERGED,
+  STAT_WRITE_SUCCEEDED,
+  STAT_WRITE_FAILED,
+  STAT_SEND_LOOKUPS,
+  STAT_SEND_INDEX_HIT,
+  STAT_SEND_INDEX_SAME,
+  STAT_SEND_INDEX_STALE,
+  STAT_SEND_LOCATION_CACHED,
+  STAT_SEND_REWRITTEN_DUPLICATE,
+  STAT_SEND_REWRITTEN_CANDIDATE,
+  STAT_SEND_REWRITTEN_FILL,
+  STAT_SEND_REWRITTEN_PEER,
+  STAT_SEND_NOT_REWRITTEN,
+  STAT_SEND_RECORD_MISSING,
+  STAT_SEND_FILTER_SKIPPED,
+  STAT_SEND_TIMEOUTS,
+  STAT_SEND_SERVED,
+  STAT_SEND_COALESCED,
+  STAT_SEND_MEMO_HIT,
+  STAT_ALIAS_CREATED,
+  STAT_ALIAS_HITS,
+  STAT_ALIAS_MISSES,
+  STAT_ALIAS_DROPPED,
+  STAT_HEADER_WRITTEN,
+  STAT_HEADER_ADDED,
+  STAT_HEADER_MISSING,
+  STAT_PEER_ANNOUNCED,
+  STAT_PEER_RECEIVED,
+  STAT_PEER_REJECTED,
+  STAT_XML_DOCUMENTS,
+  STAT_XML_FILES,
+  STAT_XML_REWRITTEN,
+  STAT_FILTER_FPR_PPM,
+  STAT_LIVE_SEND,
+  STAT_LIVE_WRITE,
+  STAT_LIVE_TRANSFORM,
+  STAT_COUNT
+};
+
+static const char *stat_names[STAT_COUNT] = {
+  "plugin.metalink.transform.admitted",
+  "plugin.metalink.transform.not_admitted",
+  "plugin.metalink.transform.aborted",
+  "plugin.metalink.transform.trusted",
+  "plugin.metalink.transform.fill_registered",
+  "plugin.metalink.hash.bytes",
+  "plugin.metalink.hash.ns",
+  "plugin.metalink.write.skipped_index",
+  "plugin.metalink.write.skipped_record",
+  "plugin.metalink.write.new",
+  "plugin.metalink.write.merged",
+  "plugin.metalink.write.succeeded",
+  "plugin.metalink.write.failed",
+  "plugin.metalink.send.lookups",
+  "plugin.metalink.send.index_hit",
+  "plugin.metalink.send.index_same",
+  "plugin.metalink.send.index_stale",
+  "plugin.metalink.send.location_cached",
+  "plugin.metalink.send.rewritten_duplicate",
+  "plugin.metalink.send.rewritten_candidate",
+  "plugin.metalink.send.rewritten_fill",
+  "plugin.metalink.send.rewritten_peer",
+  "plugin.metalink.send.not_rewritten",
+  "plugin.metalink.send.record_missing",
+  "plugin.metalink.send.filter_skipped",
+  "plugin.metalink.send.timeouts",
+  "plugin.metalink.send.served",
+  "plugin.metalink.send.coalesced",
+  "plugin.metalink.send.memo_hit",
+  "plugin.metalink.alias.created",
+  "plugin.metalink.alias.hits",
+  "plugin.metalink.alias.misses",
+  "plugin.metalink.alias.dropped",
+  "plugin.metalink.header.written",
+  "plugin.metalink.header.added",
+  "plugin.metalink.header.missing",
+  "plugin.metalink.peer.announced",
+  "plugin.metalink.peer.received",
+  "plugin.metalink.peer.rejected",
+  "plugin.metalink.xml.documents",
+  "plugin.metalink.xml.files",
+  "plugin.metalink.xml.rewritten",
+  "plugin.metalink.filter.fpr_ppm",
+  "plugin.metalink.live.send",
+  "plugin.metalink.live.write",
+  "plugin.metalink.live.transform"
+};
+
+static int stats[STAT_COUNT];
+
+/* Latency of each lookup stage, in log2 buckets of microseconds:
+ * Bucket i counts the lookups that took less than 2^i us, the last one
+ * the rest.  The buckets aren't cumulative. */
+
+enum {
+  LATENCY_HOLD, /* Response header held, from the send hook to reenable */
+  LATENCY_LOCATION, /* Cache read of the Location URL */
+  LATENCY_RECORD, /* Cache read of the record at the digest */
+  LATENCY_COUNT
+};
+
+#define LATENCY_BUCKETS 21 /* 2^20 us, about a second */
+
+static const char *latency_names[LATENCY_COUNT] = {
+  "hold",
+  "location",
+  "record"
+};
+
+static int latency_stats[LATENCY_COUNT][LATENCY_BUCKETS + 1];
+
+/* Trace one in this many transactions, zero none */
+static int trace_rate;
+static uint64_t trace_count;
+
+static TSTextLogObject trace_log;
+
+static void
+stats_init(void)
+{
+  char name[64];
+
+  for (int i = 0; i < STAT_COUNT; i += 1) {
+    stats[i] = TSStatCreate(stat_names[i], TS_RECORDDATATYPE_INT, TS_STAT_NON_PERSISTENT, TS_STAT_SYNC_SUM);
+  }
+
+  for (int i = 0; i < LATENCY_COUNT; i += 1) {
+    for (int j = 0; j < LATENCY_BUCKETS; j += 1) {
+      snprintf(name, sizeof(name), "plugin.metalink.latency.%s.us_lt_%d", latency_names[i], 1 << j);
+      latency_stats[i][j] = TSStatCreate(name, TS_RECORDDATATYPE_INT, TS_STAT_NON_PERSISTENT, TS_STAT_SYNC_SUM);
+    }
+
+    snprintf(name, sizeof(name), "plugin.metalink.latency.%s.us_inf", latency_names[i]);
+    latency_stats[i][LATENCY_BUCKETS] = TSStatCreate(name, TS_RECORDDATATYPE_INT, TS_STAT_NON_PERSISTENT, TS_STAT_SYNC_SUM);
+  }
+}
+
+static void
+stat_increment(int stat, TSMgmtInt amount)
+{
+  TSStatIntIncrement(stats[stat], amount);
+}
+
+/* Count the time since the start of a stage in its bucket */
+
+static void
+latency_record(int stage, TSHRTime start)
+{
+  if (!start) {
+    return;
+  }
+
+  TSHRTime us = (TShrtime() - start) / TS_HRTIME_USECOND;
+
+  int bucket = 0;
+  while (bucket < LATENCY_BUCKETS && us >= (TSHRTime) 1 << bucket) {
+    bucket += 1;
+  }
+
+  TSStatIntIncrement(latency_stats[stage][bucket], 1);
+}
+
+/* Each thread keeps the transaction data it freed for reuse, up to
+ * FREELIST_MAX of each kind, so the allocator isn't hit on every
+ * transaction and threads don't contend on it.  Data freed on another
+ * thread than the one that allocated it just goes on the other
+ * thread's list. */
+
+#define FREELIST_MAX 64
+
+typedef struct FreeItem {
+  struct FreeItem *next;
+} FreeItem;
+
+typedef struct {
+  FreeItem *head;
+  int n;
+} FreeList;
+
+static __thread FreeList send_freelist;
+static __thread FreeList write_freelist;
+static __thread FreeList transform_freelist;
+
+/* All the data on a list must be the same size.  The stat counts the
+ * data in use, on every thread, so leaks show up as a steady climb. */
+
+static void *
+freelist_alloc(FreeList *listp, int stat, size_t size)
+{
+  stat_increment(stat, 1);
+
+  FreeItem *itemp = listp->head;
+  if (!itemp) {
+    return TSmalloc(size);
+  }
+
+  listp->head = itemp->next;
+  listp->n -= 1;
+
+  return itemp;
+}
+
+static void
+freelist_free(FreeList *listp, int stat, void *p)
+{
+  stat_increment(stat, -1);
+
+  if (listp->n == FREELIST_MAX) {
+    TSfree(p);
+
+    return;
+  }
+
+  FreeItem *itemp = (FreeItem *) p;
+
+  itemp->next = listp->head;
+  listp->head = itemp;
+  listp->n += 1;
+}
+
+static int64_t
+trace_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Sample this transaction?  NULL if not. */
+
+static Trace *
+trace_start(const char *kind)
+{
+  if (!trace_log) {
+    return NULL;
+  }
+
+  uint64_t id = __sync_add_and_fetch(&trace_count, 1);
+  if (id % trace_rate) {
+    return NULL;
+  }
+
+  Trace *tracep = (Trace *) TSmalloc(sizeof(Trace));
+
+  tracep->id = id;
+  tracep->kind = kind;
+
+  tracep->start = trace_now();
+  tracep->nevents = 0;
+
+  return tracep;
+}
+
+/* Call with the state machine's lock held */
+
+static void
+trace_event(Trace *tracep, const char *stage, const char *outcome)
+{
+  if (!tracep || tracep->nevents == TRACE_EVENTS) {
+    return;
+  }
+
+  TraceEvent *eventp = &tracep->events[tracep->nevents];
+
+  eventp->stage = stage;
+  eventp->outcome = outcome;
+  eventp->ns = trace_now();
+
+  tracep->nevents += 1;
+}
+
+/* Write out one line and free the trace, e.g.
  *
- *    Downstream complete
- *                  Clean up the output buffer. */
+ *    send id=1024 total_us=812 location=miss@35 record=found@410 ...
+ *
+ * The microseconds after each outcome are since the start, the stage
+ * durations are the differences. */
+
+static void
+trace_end(Trace *tracep)
+{
+  char line[1024];
+
+  if (!tracep) {
+    return;
+  }
+
+  int64_t now = trace_now();
+
+  int n = snprintf(line, sizeof(line), "%s id=%" PRIu64 " total_us=%" PRId64, tracep->kind, tracep->id, (now - tracep->start) / 1000);
+
+  for (int i = 0; i < tracep->nevents && n < (int) sizeof(line); i += 1) {
+    TraceEvent *eventp = &tracep->events[i];
+
+    n += snprintf(line + n, sizeof(line) - n, " %s=%s@%" PRId64, eventp->stage, eventp->outcome, (eventp->ns - tracep->start) / 1000);
+  }
+
+  TSTextLogObjectWrite(trace_log, "%s", line);
+
+  TSfree(tracep);
+}
+
+static void
+index_init(Index *indexp, int size)
+{
+  indexp->nsets = (size + INDEX_SHARDS * INDEX_WAYS - 1) / (INDEX_SHARDS * INDEX_WAYS);
+  if (!indexp->nsets) {
+    return;
+  }
+
+  for (int i = 0; i < INDEX_SHARDS; i += 1) {
+    IndexShard *shardp = &indexp->shards[i];
+
+    shardp->mutexp = TSMutexCreate();
+
+    shardp->entries = (IndexEntry *) TSmalloc(sizeof(IndexEntry) * indexp->nsets * INDEX_WAYS);
+    memset(shardp->entries, 0, sizeof(IndexEntry) * indexp->nsets * INDEX_WAYS);
+
+    shardp->stamp = 0;
+  }
+}
+
+/* Compare the first 32 bytes at most */
 
 static int
-vconn_write_ready(TSCont contp, void */* edata ATS_UNUSED */)
+index_match(const IndexEntry *entryp, int alg, const char *digest)
 {
-  const char *value;
-  int64_t length;
+  int length = digest_algorithms[alg].length;
+  if (length > (int) sizeof(entryp->digest)) {
+    length = sizeof(entryp->digest);
+  }
 
-  char digest[32]; /* SHA-256 */
+  return entryp->value && entryp->alg == alg && !memcmp(entryp->digest, digest, length);
+}
 
-  TransformData *transform_data = (TransformData *) TSContDataGet(contp);
+/* Find the shard and the set for a digest.  The digest is already
+ * uniformly distributed, so just use its first bytes. */
 
-  /* Check if we are "closed" before doing anything else to avoid
-   * errors.  We *must* check for this case, if only to clean up
-   * allocated data.  Some state is already inconsistent.  (This
-   * happens if the response is 304 Not Modified or if the client or
-   * origin disconnect before the message is complete.) */
-  int closed = TSVConnClosedGet(contp);
-  if (closed) {
-    TSContDestroy(contp);
+static IndexEntry *
+index_set_get(Index *indexp, const char *digest, IndexShard **shardp)
+{
+  unsigned int hash;
+  memcpy(&hash, digest, sizeof(hash));
 
-    /* Avoid failed assert "sdk_sanity_check_iocore_structure(bufp) ==
-     * TS_SUCCESS" in TSIOBufferDestroy() if the response is 304 Not
-     * Modified */
-    if (transform_data->output_bufp) {
-      TSIOBufferDestroy(transform_data->output_bufp);
-    }
+  *shardp = &indexp->shards[hash % INDEX_SHARDS];
 
-    TSfree(transform_data);
+  return &(*shardp)->entries[hash / INDEX_SHARDS % indexp->nsets * INDEX_WAYS];
+}
 
-    return 0;
+/* Allocation!  Must free! */
+
+static char *
+index_lookup(Index *indexp, int alg, const char *digest, TSHRTime since, int *length)
+{
+  IndexShard *shardp;
+
+  char *value = NULL;
+
+  if (!indexp->nsets) {
+    return NULL;
   }
 
-  TSVIO input_viop = TSVConnWriteVIOGet(contp);
+  IndexEntry *setp = index_set_get(indexp, digest, &shardp);
 
-  /* Initialize data here because we can't call TSVConnWrite() before
-   * TS_HTTP_RESPONSE_TRANSFORM_HOOK */
-  if (!transform_data->output_bufp) {
-    TSVConn output_connp = TSTransformOutputVConnGet(contp);
+  TSMutexLock(shardp->mutexp);
 
-    transform_data->output_bufp = TSIOBufferCreate();
-    TSIOBufferReader readerp = TSIOBufferReaderAlloc(transform_data->output_bufp);
+  for (int i = 0; i < INDEX_WAYS; i += 1) {
+    if (index_match(&setp[i], alg, digest)) {
+      if (setp[i].confirmed < since) {
+        break;
+      }
 
-    /* Determines the Content-Length header (or a chunked response) */
+      setp[i].stamp = ++shardp->stamp;
 
-    /* Reentrant!  Avoid failed assert "nbytes >= 0" if the response
-     * is chunked. */
-    int nbytes = TSVIONBytesGet(input_viop);
-    transform_data->output_viop = TSVConnWrite(output_connp, contp, readerp, nbytes < 0 ? INT64_MAX : nbytes);
+      value = TSstrndup(setp[i].value, setp[i].length);
+      *length = setp[i].length;
 
-    SHA256_Init(&transform_data->c);
+      break;
+    }
   }
 
-  /* Then deal with any input that's available now.  Avoid failed
-   * assert "sdk_sanity_check_iocore_structure(readerp) == TS_SUCCESS"
-   * in TSIOBufferReaderAvail() if the content length is zero or when
-   * we get the final chunk of a chunked response. */
-  TSIOBufferReader readerp = TSVIOReaderGet(input_viop);
-  if (readerp) {
+  TSMutexUnlock(shardp->mutexp);
 
-    int avail = TSIOBufferReaderAvail(readerp);
-    if (avail) {
-      TSIOBufferCopy(transform_data->output_bufp, readerp, avail, 0);
+  return value;
+}
+
+/* Return nonzero if the URL at the digest changed */
+
+static int
+index_set(Index *indexp, int alg, const char *digest, const char *value, int length, TSHRTime confirmed)
+{
+  IndexShard *shardp;
+
+  int changed = 1;
+
+  if (!indexp->nsets) {
+    return 0;
+  }
+
+  IndexEntry *setp = index_set_get(indexp, digest, &shardp);
+
+  TSMutexLock(shardp->mutexp);
+
+  /* Replace the entry for the same digest, otherwise an empty entry,
+   * otherwise the least recently used one */
+  IndexEntry *entryp = NULL;
+  for (int i = 0; i < INDEX_WAYS; i += 1) {
+    if (index_match(&setp[i], alg, digest)) {
+      entryp = &setp[i];
+
+      break;
+    }
+  }
+
+  if (!entryp) {
+    entryp = &setp[0];
+    for (int i = 1; i < INDEX_WAYS && entryp->value; i += 1) {
+      if (!setp[i].value || shardp->stamp - setp[i].stamp > shardp->stamp - entryp->stamp) {
+        entryp = &setp[i];
+      }
+    }
+  }
+
+  if (index_match(entryp, alg, digest) && entryp->length == length && !memcmp(entryp->value, value, length)) {
+    changed = 0;
+
+  } else {
+    if (entryp->value) {
+      TSfree(entryp->value);
+    }
+
+    entryp->alg = alg;
+
+    memset(entryp->digest, 0, sizeof(entryp->digest));
+    memcpy(entryp->digest, digest, digest_algorithms[alg].length < (int) sizeof(entryp->digest) ? digest_algorithms[alg].length : sizeof(entryp->digest));
+
+    entryp->value = TSstrndup(value, length);
+    entryp->length = length;
+  }
+
+  entryp->stamp = ++shardp->stamp;
+  entryp->confirmed = confirmed;
+
+  TSMutexUnlock(shardp->mutexp);
+
+  return changed;
+}
+
+static void
+index_insert(Index *indexp, int alg, const char *digest, const char *value, int length)
+{
+  if (index_set(indexp, alg, digest, value, length, TShrtime()) && indexp->snapshotp) {
+    snapshot_append(indexp->snapshotp, alg, digest, value, length, 0);
+  }
+}
+
+/* Is the URL known to be stored at the digest since this time? */
+
+static int
+index_confirmed(Index *indexp, int alg, const char *digest, const char *value, int length, TSHRTime since)
+{
+  IndexShard *shardp;
+
+  int confirmed = 0;
+
+  if (!indexp->nsets) {
+    return 0;
+  }
+
+  IndexEntry *setp = index_set_get(indexp, digest, &shardp);
+
+  TSMutexLock(shardp->mutexp);
+
+  for (int i = 0; i < INDEX_WAYS; i += 1) {
+    if (index_match(&setp[i], alg, digest)) {
+      confirmed = setp[i].length == length && !memcmp(setp[i].value, value, length) && setp[i].confirmed >= since;
+
+      break;
+    }
+  }
+
+  TSMutexUnlock(shardp->mutexp);
+
+  return confirmed;
+}
+
+/* Forget a stale entry, but only if it wasn't replaced in the
+ * meantime */
+
+static void
+index_remove(Index *indexp, int alg, const char *digest, const char *value, int length)
+{
+  IndexShard *shardp;
+
+  if (!indexp->nsets) {
+    return;
+  }
+
+  IndexEntry *setp = index_set_get(indexp, digest, &shardp);
+
+  TSMutexLock(shardp->mutexp);
+
+  int removed = 0;
+
+  for (int i = 0; i < INDEX_WAYS; i += 1) {
+    if (index_match(&setp[i], alg, digest)) {
+      if (setp[i].length == length && !memcmp(setp[i].value, value, length)) {
+        TSfree(setp[i].value);
+        setp[i].value = NULL;
+
+        removed = 1;
+      }
+
+      break;
+    }
+  }
+
+  TSMutexUnlock(shardp->mutexp);
+
+  if (removed && indexp->snapshotp) {
+    snapshot_append(indexp->snapshotp, alg, digest, value, length, 1);
+  }
+}
+
+static void
+filter_init(Filter *filterp, int size)
+{
+  filterp->nbits = ((uint64_t) size * FILTER_BITS_PER_DIGEST + 63) & ~(uint64_t) 63;
+  if (!filterp->nbits) {
+    return;
+  }
+
+  filterp->bits = (uint64_t *) TSmalloc(filterp->nbits / 8);
+  memset(filterp->bits, 0, filterp->nbits / 8);
+
+  filterp->nset = 0;
+  filterp->full = 0;
+
+  filterp->trusted = TShrtime() + filter_warmup;
+}
+
+/* Double hashing: The digest is already uniformly distributed, so
+ * derive the bit indexes from its first sixteen bytes */
+
+static uint64_t
+filter_bit(const Filter *filterp, int alg, const char *digest, int i)
+{
+  uint64_t h1;
+  uint64_t h2;
+
+  memcpy(&h1, digest, sizeof(h1));
+  memcpy(&h2, digest + 8, sizeof(h2));
+
+  h1 ^= (uint64_t) alg * 0x9e3779b97f4a7c15;
+
+  return (h1 + i * (h2 | 1)) % filterp->nbits;
+}
+
+/* (Bits set / bits) ^ hashes */
+
+static double
+filter_fpr(const Filter *filterp)
+{
+  double fpr = 1;
+
+  double fill = (double) filterp->nset / filterp->nbits;
+  for (int i = 0; i < FILTER_HASHES; i += 1) {
+    fpr *= fill;
+  }
+
+  return fpr;
+}
+
+/* Might the digest have a record?  Always yes if the filter is
+ * disabled or not warmed up. */
+
+static int
+filter_maybe(const Filter *filterp, int alg, const char *digest)
+{
+  if (!filterp->nbits || TShrtime() < filterp->trusted) {
+    return 1;
+  }
+
+  for (int i = 0; i < FILTER_HASHES; i += 1) {
+    uint64_t bit = filter_bit(filterp, alg, digest, i);
+    if (!(filterp->bits[bit / 64] & (uint64_t) 1 << bit % 64)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static void
+filter_insert(Filter *filterp, int alg, const char *digest)
+{
+  if (!filterp->nbits) {
+    return;
+  }
+
+  int changed = 0;
+
+  for (int i = 0; i < FILTER_HASHES; i += 1) {
+    uint64_t bit = filter_bit(filterp, alg, digest, i);
+    uint64_t mask = (uint64_t) 1 << bit % 64;
+
+    if (!(__sync_fetch_and_or(&filterp->bits[bit / 64], mask) & mask)) {
+      __sync_add_and_fetch(&filterp->nset, 1);
+
+      changed = 1;
+    }
+  }
+
+  if (!changed) {
+    return;
+  }
+
+  double fpr = filter_fpr(filterp);
+  TSStatIntSet(stats[STAT_FILTER_FPR_PPM], fpr * 1e6);
+
+  if (fpr > FILTER_MAX_FPR && __sync_bool_compare_and_swap(&filterp->full, 0, 1)) {
+    TSError("The filter's false positive rate passed %g, give a bigger --filter-size", FILTER_MAX_FPR);
+  }
+}
+
+static uint32_t
+snapshot_checksum(const char *p, int64_t length)
+{
+  uint32_t hash = 2166136261;
+
+  for (int64_t i = 0; i < length; i += 1) {
+    hash = (hash ^ (unsigned char) p[i]) * 16777619;
+  }
+
+  return hash;
+}
+
+/* Encode an entry at p, which has room for SNAPSHOT_ENTRY_LENGTH +
+ * length bytes.  Return its length. */
+
+static int
+snapshot_entry_encode(char *p, int alg, const char *digest, const char *value, int length, int removed)
+{
+  uint16_t url_length = length;
+
+  p[4] = alg;
+  p[5] = removed;
+  memcpy(p + 6, &url_length, 2);
+
+  memset(p + 8, 0, 32);
+  memcpy(p + 8, digest, digest_algorithms[alg].length < 32 ? digest_algorithms[alg].length : 32);
+
+  memcpy(p + SNAPSHOT_ENTRY_LENGTH, value, length);
+
+  uint32_t checksum = snapshot_checksum(p + 4, SNAPSHOT_ENTRY_LENGTH - 4 + length);
+  memcpy(p, &checksum, 4);
+
+  return SNAPSHOT_ENTRY_LENGTH + length;
+}
+
+/* Replay the file into the index and the filter.  Stop at the first
+ * entry that's torn or corrupt. */
+
+static void
+snapshot_load(Snapshot *snapshotp)
+{
+  struct stat st;
+
+  int fd = open(snapshotp->path, O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+
+  if (fstat(fd, &st) || st.st_size < SNAPSHOT_HEADER_LENGTH) {
+    close(fd);
+
+    return;
+  }
+
+  const char *map = (const char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    TSError("Couldn't map snapshot %s", snapshotp->path);
+
+    return;
+  }
+
+  if (memcmp(map, SNAPSHOT_MAGIC, 4) || map[4] != SNAPSHOT_VERSION) {
+    TSError("Snapshot %s has an unknown format, ignoring it", snapshotp->path);
+
+    munmap((void *) map, st.st_size);
+
+    return;
+  }
+
+  int n = 0;
+
+  const char *p = map + SNAPSHOT_HEADER_LENGTH;
+  const char *end = map + st.st_size;
+
+  while (end - p >= SNAPSHOT_ENTRY_LENGTH) {
+    uint32_t checksum;
+    uint16_t length;
+
+    memcpy(&checksum, p, 4);
+    memcpy(&length, p + 6, 2);
+
+    int alg = (unsigned char) p[4];
+    if (alg >= DIGEST_NALGS || end - p - SNAPSHOT_ENTRY_LENGTH < length || checksum != snapshot_checksum(p + 4, SNAPSHOT_ENTRY_LENGTH - 4 + length)) {
+      TSError("Snapshot %s is corrupt after %d entries", snapshotp->path, n);
+
+      break;
+    }
+
+    const char *digest = p + 8;
+    const char *value = p + SNAPSHOT_ENTRY_LENGTH;
+
+    if (p[5]) {
+      index_remove(&digest_index, alg, digest, value, length);
+
+    } else {
+
+      /* Not confirmed: It was stored at the digest, but who knows
+       * about now */
+      index_set(&digest_index, alg, digest, value, length, 0);
+      filter_insert(&digest_filter, alg, digest);
+    }
+
+    p += SNAPSHOT_ENTRY_LENGTH + length;
+    n += 1;
+  }
+
+  TSDebug("metalink", "Loaded %d entries from snapshot %s", n, snapshotp->path);
+
+  munmap((void *) map, st.st_size);
+}
+
+/* Rewrite the file from the index and rename it over.  Call with the
+ * lock held. */
+
+static void
+snapshot_compact(Snapshot *snapshotp)
+{
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s.tmp", snapshotp->path);
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    TSError("Couldn't create snapshot %s", path);
+
+    return;
+  }
+
+  int64_t length = SNAPSHOT_HEADER_LENGTH;
+  int failed = write(fd, SNAPSHOT_MAGIC "\001\0\0\0", SNAPSHOT_HEADER_LENGTH) != SNAPSHOT_HEADER_LENGTH;
+
+  /* One shard at a time, don't hold up the others */
+  for (int i = 0; i < INDEX_SHARDS && digest_index.nsets && !failed; i += 1) {
+    IndexShard *shardp = &digest_index.shards[i];
+
+    int buf_length = 0;
+    char *buf = NULL;
+
+    TSMutexLock(shardp->mutexp);
+
+    int size = 0;
+    for (int j = 0; j < digest_index.nsets * INDEX_WAYS; j += 1) {
+      if (shardp->entries[j].value) {
+        size += SNAPSHOT_ENTRY_LENGTH + shardp->entries[j].length;
+      }
+    }
+
+    if (size) {
+      buf = (char *) TSmalloc(size);
+
+      for (int j = 0; j < digest_index.nsets * INDEX_WAYS; j += 1) {
+        IndexEntry *entryp = &shardp->entries[j];
+
+        if (entryp->value) {
+          buf_length += snapshot_entry_encode(buf + buf_length, entryp->alg, entryp->digest, entryp->value, entryp->length, 0);
+        }
+      }
+    }
+
+    TSMutexUnlock(shardp->mutexp);
+
+    if (buf) {
+      failed = write(fd, buf, buf_length) != buf_length;
+      length += buf_length;
+
+      TSfree(buf);
+    }
+  }
+
+  if (failed || fsync(fd) || rename(path, snapshotp->path)) {
+    TSError("Couldn't write snapshot %s", path);
+
+    close(fd);
+    unlink(path);
+
+    return;
+  }
+
+  close(fd);
+
+  /* Append to the new file from now on */
+  if (snapshotp->fd >= 0) {
+    close(snapshotp->fd);
+  }
+
+  snapshotp->fd = open(snapshotp->path, O_WRONLY | O_APPEND);
+
+  snapshotp->length = length;
+  snapshotp->compacted_length = length;
+
+  TSDebug("metalink", "Compacted snapshot %s to %" PRId64 " bytes", snapshotp->path, length);
+}
+
+static int
+snapshot_handler(TSCont contp, TSEvent /* event ATS_UNUSED */, void */* edata ATS_UNUSED */)
+{
+  Snapshot *snapshotp = (Snapshot *) TSContDataGet(contp);
+
+  TSMutexLock(snapshotp->mutexp);
+
+  snapshot_compact(snapshotp);
+  snapshotp->compacting = 0;
+
+  TSMutexUnlock(snapshotp->mutexp);
+
+  return 0;
+}
+
+static void
+snapshot_append(Snapshot *snapshotp, int alg, const char *digest, const char *value, int length, int removed)
+{
+  if (!snapshotp->path || length > UINT16_MAX) {
+    return;
+  }
+
+  /* Don't wait for a compaction */
+  if (TSMutexLockTry(snapshotp->mutexp) != TS_SUCCESS) {
+    return;
+  }
+
+  if (snapshotp->fd >= 0) {
+    char *buf = (char *) TSmalloc(SNAPSHOT_ENTRY_LENGTH + length);
+
+    int buf_length = snapshot_entry_encode(buf, alg, digest, value, length, removed);
+    if (write(snapshotp->fd, buf, buf_length) == buf_length) {
+      snapshotp->length += buf_length;
+
+    /* Cut off a torn entry, replaying stops there and would miss the
+     * ones after it.  If that fails too, stop appending and compact it
+     * now, which rewrites it from the index. */
+    } else if (ftruncate(snapshotp->fd, snapshotp->length)) {
+      TSError("Couldn't append to snapshot %s, stopping until it's compacted", snapshotp->path);
+
+      close(snapshotp->fd);
+      snapshotp->fd = -1;
+    }
+
+    TSfree(buf);
+
+    if (!snapshotp->compacting && (snapshotp->fd < 0 || snapshotp->length > 2 * snapshotp->compacted_length + SNAPSHOT_SLACK)) {
+      snapshotp->compacting = 1;
+
+      TSContScheduleOnPool(snapshotp->contp, 0, TS_THREAD_POOL_TASK);
+    }
+  }
+
+  TSMutexUnlock(snapshotp->mutexp);
+}
+
+static void
+snapshot_init(Snapshot *snapshotp, const char *path)
+{
+  if (!path) {
+    return;
+  }
+
+  snapshotp->path = TSstrdup(path);
+  snapshotp->mutexp = TSMutexCreate();
+
+  snapshotp->fd = -1;
+
+  snapshotp->contp = TSContCreate(snapshot_handler, TSMutexCreate());
+  TSContDataSet(snapshotp->contp, snapshotp);
+
+  snapshotp->compacting = 0;
+
+  /* Nothing gets appended while it's loaded, the file isn't open for
+   * appending yet */
+  snapshot_load(snapshotp);
+
+  TSMutexLock(snapshotp->mutexp);
+  snapshot_compact(snapshotp);
+  TSMutexUnlock(snapshotp->mutexp);
+}
+
+/* Tell the peers the URL is stored at the digest.  Dropped if the
+ * socket buffer is full, the peer index is only a hint anyway. */
+
+static void
+peer_announce(int alg, const char *digest, const char *value, int length)
+{
+  char buf[PEER_DATAGRAM_MAX];
+
+  if (!npeers) {
+    return;
+  }
+
+  int digest_length = digest_algorithms[alg].length;
+  if (5 + digest_length + length > PEER_DATAGRAM_MAX) {
+    return;
+  }
+
+  memcpy(buf, PEER_MAGIC, 4);
+  buf[4] = alg;
+  memcpy(buf + 5, digest, digest_length);
+  memcpy(buf + 5 + digest_length, value, length);
+
+  for (int i = 0; i < npeers; i += 1) {
+    if (sendto(peer_fd, buf, 5 + digest_length + length, MSG_DONTWAIT, (struct sockaddr *) &peers[i].addr, peers[i].length) != -1) {
+      stat_increment(STAT_PEER_ANNOUNCED, 1);
+    }
+  }
+}
+
+/* Is the datagram from one of the peers?  Only the address is
+ * compared, not the port, so a peer that doesn't listen can still
+ * announce. */
+
+static int
+peer_known(const struct sockaddr_storage *addrp, socklen_t length)
+{
+  if (addrp->ss_family != AF_INET || length < sizeof(struct sockaddr_in)) {
+    return 0;
+  }
+
+  const struct sockaddr_in *sinp = (const struct sockaddr_in *) addrp;
+
+  for (int i = 0; i < npeers; i += 1) {
+    const struct sockaddr_in *peer_sinp = (const struct sockaddr_in *) &peers[i].addr;
+
+    if (peer_sinp->sin_addr.s_addr == sinp->sin_addr.s_addr) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* TSContScheduleOnPool() handler: Remember everything the peers
+ * announced since the last time, then check again later */
+
+static int
+peer_handler(TSCont contp, TSEvent /* event ATS_UNUSED */, void */* edata ATS_UNUSED */)
+{
+  char buf[PEER_DATAGRAM_MAX];
+
+  for (;;) {
+    struct sockaddr_storage addr;
+    socklen_t addr_length = sizeof(addr);
+
+    ssize_t length = recvfrom(peer_fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *) &addr, &addr_length);
+    if (length == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        TSError("Couldn't receive from the peers: %s", strerror(errno));
+      }
+
+      if (errno != EINTR) {
+        break;
+      }
+
+      continue;
+    }
+
+    /* Only from the peers */
+    if (!peer_known(&addr, addr_length)) {
+      stat_increment(STAT_PEER_REJECTED, 1);
+
+      continue;
+    }
+
+    if (length < 5 || memcmp(buf, PEER_MAGIC, 4)) {
+      continue;
+    }
+
+    int alg = (unsigned char) buf[4];
+    if (alg >= DIGEST_NALGS || length <= 5 + digest_algorithms[alg].length) {
+      continue;
+    }
+
+    int digest_length = digest_algorithms[alg].length;
+    index_set(&peer_index, alg, buf + 5, buf + 5 + digest_length, length - 5 - digest_length, TShrtime());
+
+    stat_increment(STAT_PEER_RECEIVED, 1);
+  }
+
+  TSContScheduleOnPool(contp, PEER_POLL_INTERVAL, TS_THREAD_POOL_TASK);
+
+  return 0;
+}
+
+/* "host:port" */
+
+static int
+peer_add(const char *name)
+{
+  struct addrinfo hints;
+  struct addrinfo *result;
+
+  const char *colon = strrchr(name, ':');
+  if (!colon) {
+    TSError("Invalid peer, expected host:port: %s", name);
+
+    return 0;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+
+  /* Allocation!  Must free! */
+  char *host = TSstrndup(name, colon - name);
+
+  int status = getaddrinfo(host, colon + 1, &hints, &result);
+
+  TSfree(host);
+
+  if (status) {
+    TSError("Couldn't resolve peer %s: %s", name, gai_strerror(status));
+
+    return 0;
+  }
+
+  peers = (Peer *) TSrealloc(peers, sizeof(Peer) * (npeers + 1));
+
+  memcpy(&peers[npeers].addr, result->ai_addr, result->ai_addrlen);
+  peers[npeers].length = result->ai_addrlen;
+
+  npeers += 1;
+
+  freeaddrinfo(result);
+
+  return 1;
+}
+
+/* Open the socket, and listen on the port unless it's zero, on the
+ * address unless it's NULL.  The peers are already added. */
+
+static void
+peer_init(const char *bind_name, int port, int size)
+{
+  if (!port && !npeers) {
+    return;
+  }
+
+  peer_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (peer_fd == -1) {
+    TSError("Couldn't create the peer socket: %s", strerror(errno));
+
+    return;
+  }
+
+  fcntl(peer_fd, F_SETFL, fcntl(peer_fd, F_GETFL) | O_NONBLOCK);
+
+  if (!port) {
+    return;
+  }
+
+  struct sockaddr_in addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+
+  if (bind_name && inet_pton(AF_INET, bind_name, &addr.sin_addr) != 1) {
+    TSError("Invalid address to listen for peers on: %s", bind_name);
+
+    return;
+  }
+
+  if (!npeers) {
+    TSError("No peers to accept announcements from, give --peer");
+  }
+
+  if (bind(peer_fd, (struct sockaddr *) &addr, sizeof(addr))) {
+    TSError("Couldn't listen for peers on port %d: %s", port, strerror(errno));
+
+    return;
+  }
+
+  index_init(&peer_index, size);
+
+  TSCont contp = TSContCreate(peer_handler, TSMutexCreate());
+  TSContScheduleOnPool(contp, PEER_POLL_INTERVAL, TS_THREAD_POOL_TASK);
+}
+
+/* A parent proxy's host name or address, all its addresses are
+ * trusted */
+
+static void
+trust_add(const char *name)
+{
+  struct addrinfo hints;
+  struct addrinfo *result;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  int status = getaddrinfo(name, NULL, &hints, &result);
+  if (status) {
+    TSError("Couldn't resolve parent %s, not trusting its Digest headers: %s", name, gai_strerror(status));
+
+    return;
+  }
+
+  for (struct addrinfo *ai = result; ai; ai = ai->ai_next) {
+    trusted_addrs = (struct sockaddr_storage *) TSrealloc(trusted_addrs, sizeof(struct sockaddr_storage) * (ntrusted_addrs + 1));
+
+    memset(&trusted_addrs[ntrusted_addrs], 0, sizeof(struct sockaddr_storage));
+    memcpy(&trusted_addrs[ntrusted_addrs], ai->ai_addr, ai->ai_addrlen);
+
+    ntrusted_addrs += 1;
+  }
+
+  freeaddrinfo(result);
+}
+
+/* Allocation!  Must free! */
+
+static char *
+request_url_get(TSHttpTxn txnp, int *length)
+{
+  TSMBuffer req_bufp;
+
+  TSMLoc hdr_loc;
+  TSMLoc url_loc;
+
+  if (TSHttpTxnClientReqGet(txnp, &req_bufp, &hdr_loc) != TS_SUCCESS) {
+    TSError("Couldn't retrieve client request header");
+
+    return NULL;
+  }
+
+  if (TSHttpHdrUrlGet(req_bufp, hdr_loc, &url_loc) != TS_SUCCESS) {
+    TSHandleMLocRelease(req_bufp, TS_NULL_MLOC, hdr_loc);
+
+    return NULL;
+  }
+
+  char *value = TSUrlStringGet(req_bufp, url_loc, length);
+
+  TSHandleMLocRelease(req_bufp, hdr_loc, url_loc);
+  TSHandleMLocRelease(req_bufp, TS_NULL_MLOC, hdr_loc);
+
+  return value;
+}
+
+/* Order URLs by their bytes, then by length */
+
+static int
+url_compare(const char *a, int a_length, const char *b, int b_length)
+{
+  int cmp = memcmp(a, b, a_length < b_length ? a_length : b_length);
+
+  return cmp ? cmp : a_length - b_length;
+}
+
+/* The alias index is keyed by the SHA-256 of the URL */
+
+static void
+url_hash(const char *value, int length, char *hash)
+{
+  Sha256Context c;
+
+  sha256_kernel->init(&c);
+  sha256_kernel->update(&c, value, length);
+  sha256_kernel->final((unsigned char *) hash, &c);
+}
+
+/* The record at a digest stores the URLs of the content.  Several
+ * URLs can have the same content, e.g. mirrors, and any one of them
+ * can be evicted, so keep a few candidates, most recently seen first:
+ *
+ *    magic         4 bytes, "\177MLR"
+ *    version       1 byte, 1
+ *    count         1 byte
+ *    reserved      2 bytes
+ *
+ * then for each candidate
+ *
+ *    size          8 bytes, content length
+ *    seen          8 bytes, seconds since the epoch
+ *    length        2 bytes
+ *    URL           length bytes
+ *
+ * Numbers are in host byte order, the cache never moves between hosts.
+ * Records written before there was a format are just the URL, read
+ * those as one candidate.
+ *
+ * We'd rather store each candidate's cache key than its URL, to skip
+ * TSUrlParse() and TSCacheKeyDigestFromUrlSet() when reading it, but
+ * TSCacheKeyDigestSet() hashes its input, there's no way to set the
+ * key itself.  Only the candidates that get checked are parsed. */
+
+#define RECORD_MAGIC "\177MLR"
+#define RECORD_VERSION 1
+
+#define RECORD_HEADER_LENGTH 8
+#define RECORD_CANDIDATE_LENGTH 18
+
+/* Don't rewrite a record just to update when a candidate was last
+ * seen, unless it's older than this */
+#define RECORD_REFRESH 3600
+
+typedef struct {
+
+  /* No allocation, points into the record */
+  const char *value;
+  int length;
+
+  int64_t size;
+  int64_t seen;
+
+} RecordCandidate;
+
+/* Keep at most this many candidates in each record */
+static int record_candidates = 4;
+
+/* Return the number of candidates, at most max.  Skip records from
+ * future versions. */
+
+static int
+record_parse(const char *record, int64_t length, RecordCandidate *candidates, int max)
+{
+  int n = 0;
+
+  if (!max) {
+    return 0;
+  }
+
+  /* Just the URL */
+  if (length < RECORD_HEADER_LENGTH || memcmp(record, RECORD_MAGIC, 4)) {
+    if (length) {
+      candidates[0].value = record;
+      candidates[0].length = length;
+
+      candidates[0].size = -1;
+      candidates[0].seen = 0;
+
+      n = 1;
+    }
+
+    return n;
+  }
+
+  if (record[4] != RECORD_VERSION) {
+    return 0;
+  }
+
+  int count = (unsigned char) record[5];
+
+  const char *p = record + RECORD_HEADER_LENGTH;
+  const char *end = record + length;
+
+  for (int i = 0; i < count && n < max; i += 1) {
+    uint16_t url_length;
+
+    if (end - p < RECORD_CANDIDATE_LENGTH) {
+      break;
+    }
+
+    memcpy(&candidates[n].size, p, 8);
+    memcpy(&candidates[n].seen, p + 8, 8);
+    memcpy(&url_length, p + 16, 2);
+
+    p += RECORD_CANDIDATE_LENGTH;
+
+    if (end - p < url_length) {
+      break;
+    }
+
+    candidates[n].value = p;
+    candidates[n].length = url_length;
+
+    p += url_length;
+
+    n += 1;
+  }
+
+  return n;
+}
+
+/* Skip candidates whose URL length doesn't fit in two bytes.
+ * Allocation!  Must free! */
+
+static char *
+record_encode(const RecordCandidate *candidates, int n, int *length)
+{
+  int count = 0;
+
+  *length = RECORD_HEADER_LENGTH;
+  for (int i = 0; i < n; i += 1) {
+    if (candidates[i].length <= UINT16_MAX) {
+      *length += RECORD_CANDIDATE_LENGTH + candidates[i].length;
+      count += 1;
+    }
+  }
+
+  char *record = (char *) TSmalloc(*length);
+  memcpy(record, RECORD_MAGIC, 4);
+
+  record[4] = RECORD_VERSION;
+  record[5] = count;
+  record[6] = 0;
+  record[7] = 0;
+
+  char *p = record + RECORD_HEADER_LENGTH;
+  for (int i = 0; i < n; i += 1) {
+    if (candidates[i].length > UINT16_MAX) {
+      continue;
+    }
+
+    uint16_t url_length = candidates[i].length;
+
+    memcpy(p, &candidates[i].size, 8);
+    memcpy(p + 8, &candidates[i].seen, 8);
+    memcpy(p + 16, &url_length, 2);
+
+    p += RECORD_CANDIDATE_LENGTH;
+
+    memcpy(p, candidates[i].value, url_length);
+    p += url_length;
+  }
+
+  return record;
+}
+
+/* Gather the record once it's all read.  Records are small, but they
+ * can still span several buffer blocks.  Allocation!  Must free!
+ * NULL if there's more to come. */
+
+static char *
+record_gather(TSVConn connp, TSIOBufferReader readerp, int complete, int64_t *length)
+{
+  const char *value;
+  int64_t block_length;
+
+  int64_t avail = TSIOBufferReaderAvail(readerp);
+  if (!complete && avail < TSVConnCacheObjectSizeGet(connp)) {
+    return NULL;
+  }
+
+  char *record = (char *) TSmalloc(avail + 1);
+  *length = 0;
+
+  for (TSIOBufferBlock blockp = TSIOBufferReaderStart(readerp); blockp && *length < avail; blockp = TSIOBufferBlockNext(blockp)) {
+
+    /* No allocation? */
+    value = TSIOBufferBlockReadStart(blockp, readerp, &block_length);
+    if (block_length > avail - *length) {
+      block_length = avail - *length;
+    }
+
+    memcpy(record + *length, value, block_length);
+    *length += block_length;
+  }
+
+  return record;
+}
+
+/* Look up the request URL in the alias index, and if the content is
+ * cached under another URL, look up that URL's cache key instead.
+ * Check what the lookup found before anything can be stored there. */
+
+static void
+alias_apply(TSHttpTxn txnp)
+{
+  char hash[32];
+
+  int length;
+  int alias_length;
+
+  /* Allocation!  Must free! */
+  char *value = request_url_get(txnp, &length);
+  if (!value) {
+    return;
+  }
+
+  url_hash(value, length, hash);
+  TSfree(value);
+
+  /* Allocation!  Must free! */
+  char *alias = index_lookup(&alias_index, DIGEST_SHA256, hash, TShrtime() - alias_timeout, &alias_length);
+  if (!alias) {
+    return;
+  }
+
+  /* Suspended */
+  if (alias_length == ALIAS_DIGEST_LENGTH) {
+    TSfree(alias);
+
+    return;
+  }
+
+  if (TSCacheUrlSet(txnp, alias + ALIAS_DIGEST_LENGTH, alias_length - ALIAS_DIGEST_LENGTH) == TS_SUCCESS) {
+    TSHttpTxnHookAdd(txnp, TS_HTTP_CACHE_LOOKUP_COMPLETE_HOOK, handler_contp);
+  }
+
+  TSfree(alias);
+}
+
+/* The other URL's content isn't fresh in the cache: Keep the digest
+ * but drop the URL, so the request URL's content is stored under its
+ * own key again */
+
+static void
+alias_suspend(TSHttpTxn txnp)
+{
+  char hash[32];
+
+  int length;
+  int alias_length;
+
+  /* Allocation!  Must free! */
+  char *value = request_url_get(txnp, &length);
+  if (!value) {
+    return;
+  }
+
+  url_hash(value, length, hash);
+  TSfree(value);
+
+  /* Allocation!  Must free! */
+  char *alias = index_lookup(&alias_index, DIGEST_SHA256, hash, 0, &alias_length);
+  if (!alias) {
+    return;
+  }
+
+  if (alias_length > ALIAS_DIGEST_LENGTH) {
+    index_set(&alias_index, DIGEST_SHA256, hash, alias, ALIAS_DIGEST_LENGTH, TShrtime());
+  }
+
+  TSfree(alias);
+}
+
+/* TS_HTTP_CACHE_LOOKUP_COMPLETE_HOOK, only for aliased requests: Serve
+ * a fresh hit, but don't let the request URL's origin fill or
+ * revalidate the other URL's content */
+
+static int
+http_cache_lookup_complete(TSCont /* contp ATS_UNUSED */, void *edata)
+{
+  TSHttpTxn txnp = (TSHttpTxn) edata;
+
+  int lookup_status;
+
+  if (TSHttpTxnCacheLookupStatusGet(txnp, &lookup_status) == TS_SUCCESS && lookup_status == TS_CACHE_LOOKUP_HIT_FRESH) {
+    stat_increment(STAT_ALIAS_HITS, 1);
+
+  } else {
+    TSHttpTxnServerRespNoStoreSet(txnp, 1);
+    alias_suspend(txnp);
+
+    stat_increment(STAT_ALIAS_MISSES, 1);
+  }
+
+  TSHttpTxnReenable(txnp, TS_EVENT_HTTP_CONTINUE);
+
+  return 0;
+}
+
+/* The request URL's content was hashed again: If the digest differs
+ * from the one it was aliased for, its content changed, so drop the
+ * alias */
+
+static void
+alias_check(int alg, const char *digest, const char *value, int length)
+{
+  char hash[32];
+
+  int alias_length;
+
+  if (!alias_index.nsets) {
+    return;
+  }
+
+  url_hash(value, length, hash);
+
+  /* Allocation!  Must free! */
+  char *alias = index_lookup(&alias_index, DIGEST_SHA256, hash, 0, &alias_length);
+  if (!alias) {
+    return;
+  }
+
+  int digest_length = digest_algorithms[alg].length < 32 ? digest_algorithms[alg].length : 32;
+
+  if ((unsigned char) alias[0] == alg && memcmp(alias + 1, digest, digest_length)) {
+    index_remove(&alias_index, DIGEST_SHA256, hash, alias, alias_length);
+
+    stat_increment(STAT_ALIAS_DROPPED, 1);
+  }
+
+  TSfree(alias);
+}
+
+/* A redirect to a URL that isn't cached yet: Remember the digest its
+ * content should have, in case the client fills it */
+
+static void
+fill_expect(int alg, const char *digest, const char *value, int length)
+{
+  char hash[32];
+  char expected[FILL_DIGEST_LENGTH];
+
+  url_hash(value, length, hash);
+
+  memset(expected, 0, sizeof(expected));
+
+  expected[0] = alg;
+  memcpy(expected + 1, digest, digest_algorithms[alg].length < 32 ? digest_algorithms[alg].length : 32);
+
+  index_set(&fill_redirect_index, DIGEST_SHA256, hash, expected, sizeof(expected), TShrtime());
+}
+
+/* The origin response for the request URL is admitted, so its
+ * content is about to be written to the cache: If a redirect said
+ * which digest to expect, register the fill, unless the same content
+ * is already being filled from another URL */
+
+static void
+fill_start(TSHttpTxn txnp, TransformData *data)
+{
+  char hash[32];
+
+  int length;
+  int expected_length;
+  int fill_length;
+
+  data->fill_value = NULL;
+
+  if (!fill_index.nsets) {
+    return;
+  }
+
+  /* Allocation!  Must free! */
+  char *value = request_url_get(txnp, &length);
+  if (!value) {
+    return;
+  }
+
+  url_hash(value, length, hash);
+
+  /* Allocation!  Must free! */
+  char *expected = index_lookup(&fill_redirect_index, DIGEST_SHA256, hash, TShrtime() - fill_timeout, &expected_length);
+  if (!expected) {
+    TSfree(value);
+
+    return;
+  }
+
+  index_remove(&fill_redirect_index, DIGEST_SHA256, hash, expected, expected_length);
+
+  data->fill_alg = (unsigned char) expected[0];
+  memcpy(data->fill_digest, expected + 1, sizeof(data->fill_digest));
+
+  TSfree(expected);
+
+  /* Allocation!  Must free! */
+  char *fill_value = index_lookup(&fill_index, data->fill_alg, data->fill_digest, TShrtime() - fill_timeout, &fill_length);
+  if (fill_value) {
+    TSfree(fill_value);
+    TSfree(value);
+
+    return;
+  }
+
+  index_set(&fill_index, data->fill_alg, data->fill_digest, value, length, TShrtime());
+
+  data->fill_value = value;
+  data->fill_length = length;
+
+  stat_increment(STAT_TRANSFORM_FILL_REGISTERED, 1);
+}
+
+/* The fill is done or abandoned, unless another one replaced it */
+
+static void
+fill_forget(TransformData *data)
+{
+  if (!data->fill_value) {
+    return;
+  }
+
+  index_remove(&fill_index, data->fill_alg, data->fill_digest, data->fill_value, data->fill_length);
+
+  TSfree(data->fill_value);
+  data->fill_value = NULL;
+}
+
+/* TS_HTTP_POST_REMAP_HOOK, before the cache lookup */
+
+static int
+http_post_remap(TSCont /* contp ATS_UNUSED */, void *edata)
+{
+  TSHttpTxn txnp = (TSHttpTxn) edata;
+
+  alias_apply(txnp);
+
+  TSHttpTxnReenable(txnp, TS_EVENT_HTTP_CONTINUE);
+
+  return 0;
+}
+
+/* Implement TS_HTTP_READ_RESPONSE_HDR_HOOK to implement a null
+ * transformation */
+
+/* The record exists: Read it */
+
+static int
+write_cache_open_read(TSCont contp, void *edata)
+{
+  WriteData *data = (WriteData *) TSContDataGet(contp);
+  data->connp = (TSVConn) edata;
+
+  trace_event(data->trace, "read", "open");
+
+  data->cache_bufp = TSIOBufferCreate();
+  data->cache_readerp = TSIOBufferReaderAlloc(data->cache_bufp);
+
+  /* Reentrant!  Reuse the TSCacheRead() continuation. */
+  data->cache_viop = TSVConnRead(data->connp, contp, data->cache_bufp, INT64_MAX);
+
+  return 0;
+}
+
+/* No record: Write one with just the request URL */
+
+static int
+write_cache_open_read_failed(TSCont contp, void */* edata ATS_UNUSED */)
+{
+  RecordCandidate candidate;
+
+  WriteData *data = (WriteData *) TSContDataGet(contp);
+
+  candidate.value = data->value;
+  candidate.length = data->length;
+
+  candidate.size = data->size;
+  candidate.seen = time(NULL);
+
+  data->record = record_encode(&candidate, 1, &data->record_length);
+
+  stat_increment(STAT_WRITE_NEW, 1);
+  trace_event(data->trace, "record", "new");
+
+  /* Reentrant!  Reuse the TSCacheRead() continuation. */
+  TSCacheWrite(contp, data->key);
+
+  return 0;
+}
+
+/* Alias the request URL to the smallest URL listed in the record for
+ * the same content, unless it's the smallest itself.  Candidates of
+ * unknown size, from records without a format, are never aliased. */
+
+static void
+alias_update(int alg, const char *digest, const char *value, int length, int64_t size, const RecordCandidate *candidates, int n)
+{
+  char hash[32];
+
+  if (!alias_index.nsets) {
+    return;
+  }
+
+  const RecordCandidate *canonicalp = NULL;
+  for (int i = 0; i < n; i += 1) {
+    if (candidates[i].size != size || url_compare(candidates[i].value, candidates[i].length, value, length) >= 0) {
+      continue;
+    }
+
+    if (!canonicalp || url_compare(candidates[i].value, candidates[i].length, canonicalp->value, canonicalp->length) < 0) {
+      canonicalp = &candidates[i];
+    }
+  }
+
+  if (!canonicalp) {
+    return;
+  }
+
+  url_hash(value, length, hash);
+
+  /* Don't renew a suspended alias */
+  int alias_length;
+
+  /* Allocation!  Must free! */
+  char *suspended = index_lookup(&alias_index, DIGEST_SHA256, hash, TShrtime() - alias_timeout, &alias_length);
+  if (suspended) {
+    TSfree(suspended);
+
+    if (alias_length == ALIAS_DIGEST_LENGTH) {
+      return;
+    }
+  }
+
+  /* Remember the digest, to tell when the content changes */
+  char *alias = (char *) TSmalloc(ALIAS_DIGEST_LENGTH + canonicalp->length);
+
+  memset(alias, 0, ALIAS_DIGEST_LENGTH);
+
+  alias[0] = alg;
+  memcpy(alias + 1, digest, digest_algorithms[alg].length < 32 ? digest_algorithms[alg].length : 32);
+  memcpy(alias + ALIAS_DIGEST_LENGTH, canonicalp->value, canonicalp->length);
+
+  if (index_set(&alias_index, DIGEST_SHA256, hash, alias, ALIAS_DIGEST_LENGTH + canonicalp->length, TShrtime())) {
+    stat_increment(STAT_ALIAS_CREATED, 1);
+  }
+
+  TSfree(alias);
+}
+
+/* Rewrite the record only if it doesn't list the request URL yet (or
+ * only a long time ago).  Put the request URL first, then the rest
+ * of the candidates, most recently seen first. */
+
+static int
+write_vconn_read_ready(TSCont contp, TSEvent event)
+{
+  int64_t length;
+
+  WriteData *data = (WriteData *) TSContDataGet(contp);
+
+  /* Allocation!  Must free! */
+  char *record = record_gather(data->connp, data->cache_readerp, event == TS_EVENT_VCONN_READ_COMPLETE, &length);
+  if (!record) {
+    TSVIOReenable(data->cache_viop);
+
+    return 0;
+  }
+
+  TSVConnClose(data->connp);
+
+  TSIOBufferDestroy(data->cache_bufp);
+  data->cache_bufp = NULL;
+
+  RecordCandidate *candidates = (RecordCandidate *) TSmalloc(sizeof(RecordCandidate) * (record_candidates + 1));
+
+  candidates[0].value = data->value;
+  candidates[0].length = data->length;
+
+  candidates[0].size = data->size;
+  candidates[0].seen = time(NULL);
+
+  int n = record_parse(record, length, candidates + 1, record_candidates);
+
+  alias_update(data->alg, data->digest, data->value, data->length, data->size, candidates + 1, n);
+
+  /* Already listed */
+  int i;
+  for (i = 1; i <= n; i += 1) {
+    if (candidates[i].length == data->length && !memcmp(candidates[i].value, data->value, data->length)) {
+      break;
+    }
+  }
+
+  if (i <= n && candidates[i].size == data->size && candidates[0].seen - candidates[i].seen < RECORD_REFRESH) {
+    TSContDestroy(contp);
+
+    TSfree(candidates);
+    TSfree(record);
+
+    /* Don't check it again for a while */
+    index_insert(&digest_index, data->alg, data->digest, data->value, data->length);
+
+    stat_increment(STAT_WRITE_SKIPPED_RECORD, 1);
+
+    trace_event(data->trace, "record", "listed");
+    trace_end(data->trace);
+
+    TSCacheKeyDestroy(data->key);
+
+    TSfree(data->value);
+    freelist_free(&write_freelist, STAT_LIVE_WRITE, data);
+
+    return 0;
+  }
+
+  /* Drop the old entry for the request URL, and the least recently
+   * seen candidate if there are too many */
+  if (i <= n) {
+    memmove(&candidates[i], &candidates[i + 1], sizeof(RecordCandidate) * (n - i));
+    n -= 1;
+  }
+
+  if (n + 1 > record_candidates) {
+    n = record_candidates - 1;
+  }
+
+  data->record = record_encode(candidates, n + 1, &data->record_length);
+
+  TSfree(candidates);
+  TSfree(record);
+
+  stat_increment(STAT_WRITE_MERGED, 1);
+  trace_event(data->trace, "record", "merged");
+
+  /* Reentrant!  Reuse the TSCacheRead() continuation. */
+  TSCacheWrite(contp, data->key);
+
+  return 0;
+}
+
+/* Write the digest to the cache and store the request URL at that key */
+
+static int
+cache_open_write(TSCont contp, void *edata)
+{
+  WriteData *data = (WriteData *) TSContDataGet(contp);
+  data->connp = (TSVConn) edata;
+
+  trace_event(data->trace, "write", "open");
+
+  TSCacheKeyDestroy(data->key);
+
+  /* Store the record */
+
+  data->cache_bufp = TSIOBufferCreate();
+  TSIOBufferReader readerp = TSIOBufferReaderAlloc(data->cache_bufp);
+
+  int nbytes = TSIOBufferWrite(data->cache_bufp, data->record, data->record_length);
+
+  /* Remember the request URL in the index, and tell the peers */
+  index_insert(&digest_index, data->alg, data->digest, data->value, data->length);
+  peer_announce(data->alg, data->digest, data->value, data->length);
+
+  TSfree(data->record);
+  TSfree(data->value);
+
+  /* Reentrant!  Reuse the TSCacheWrite() continuation. */
+  TSVConnWrite(data->connp, contp, readerp, nbytes);
+
+  return 0;
+}
+
+/* Do nothing */
+
+static int
+cache_open_write_failed(TSCont contp, void */* edata ATS_UNUSED */)
+{
+  WriteData *data = (WriteData *) TSContDataGet(contp);
+  TSContDestroy(contp);
+
+  stat_increment(STAT_WRITE_FAILED, 1);
+
+  trace_event(data->trace, "write", "failed");
+  trace_end(data->trace);
+
+  TSCacheKeyDestroy(data->key);
+
+  TSfree(data->record);
+  TSfree(data->value);
+  freelist_free(&write_freelist, STAT_LIVE_WRITE, data);
+
+  return 0;
+}
+
+static int
+write_vconn_write_complete(TSCont contp, void */* edata ATS_UNUSED */)
+{
+  WriteData *data = (WriteData *) TSContDataGet(contp);
+  TSContDestroy(contp);
+
+  /* The object is not committed to the cache until the VConnection is
+   * closed.  When all the data has been transferred, the user (contp)
+   * must do a TSVConnClose() */
+  TSVConnClose(data->connp);
+
+  stat_increment(STAT_WRITE_SUCCEEDED, 1);
+
+  trace_event(data->trace, "write", "done");
+  trace_end(data->trace);
+
+  TSIOBufferDestroy(data->cache_bufp);
+  freelist_free(&write_freelist, STAT_LIVE_WRITE, data);
+
+  return 0;
+}
+
+/* TSCacheRead(), TSVConnRead(), TSCacheWrite() and TSVConnWrite()
+ * handler: Write the digest to the cache and store the request URL at
+ * that key, unless it's already stored there */
+
+static int
+write_handler(TSCont contp, TSEvent event, void *edata)
+{
+  switch (event) {
+  case TS_EVENT_CACHE_OPEN_READ:
+    return write_cache_open_read(contp, edata);
+
+  case TS_EVENT_CACHE_OPEN_READ_FAILED:
+    return write_cache_open_read_failed(contp, edata);
+
+  case TS_EVENT_VCONN_READ_READY:
+  case TS_EVENT_VCONN_READ_COMPLETE:
+    return write_vconn_read_ready(contp, event);
+
+  case TS_EVENT_CACHE_OPEN_WRITE:
+    return cache_open_write(contp, edata);
+
+  case TS_EVENT_CACHE_OPEN_WRITE_FAILED:
+    return cache_open_write_failed(contp, edata);
+
+  case TS_EVENT_VCONN_WRITE_COMPLETE:
+    return write_vconn_write_complete(contp, edata);
+
+  default:
+    TSAssert(!"Unexpected event");
+  }
+
+  return 0;
+}
+
+/* The cache key for a digest.  SHA-256 digests are the key as is,
+ * like they always were, other algorithms are prefixed with their name
+ * so they can't collide. */
+
+static TSReturnCode
+digest_key_set(TSCacheKey key, int alg, const char *digest)
+{
+  char buf[16 + DIGEST_MAX_LENGTH];
+
+  if (alg == DIGEST_SHA256) {
+    return TSCacheKeyDigestSet(key, digest, digest_algorithms[alg].length);
+  }
+
+  int length = strlen(digest_algorithms[alg].name);
+
+  memcpy(buf, digest_algorithms[alg].name, length);
+  buf[length++] = '=';
+
+  memcpy(buf + length, digest, digest_algorithms[alg].length);
+  length += digest_algorithms[alg].length;
+
+  return TSCacheKeyDigestSet(key, buf, length);
+}
+
+/* Write the digest to the cache and store the request URL at that
+ * key, but not if it's already stored there: Popular files would
+ * otherwise rewrite the same record over and over.  If the index
+ * confirmed the same URL recently, do nothing.  Otherwise read the
+ * record first, reads are cheaper than writes.  Takes ownership of the
+ * request URL. */
+
+static void
+digest_write(int alg, const char *digest, char *value, int length, int64_t size)
+{
+  alias_check(alg, digest, value, length);
+
+  /* Records can't store it */
+  if (length > UINT16_MAX) {
+    TSfree(value);
+
+    return;
+  }
+
+  if (write_interval && index_confirmed(&digest_index, alg, digest, value, length, TShrtime() - write_interval)) {
+    stat_increment(STAT_WRITE_SKIPPED_INDEX, 1);
+
+    TSfree(value);
+
+    return;
+  }
+
+  /* Always read the record first, even if the filter doesn't know it.
+   * The filter can miss records, and writing without reading would
+   * lose their other candidates. */
+  filter_insert(&digest_filter, alg, digest);
+
+  WriteData *data = (WriteData *) freelist_alloc(&write_freelist, STAT_LIVE_WRITE, sizeof(WriteData));
+
+  data->alg = alg;
+  memcpy(data->digest, digest, digest_algorithms[alg].length);
+
+  data->value = value;
+  data->length = length;
+
+  data->size = size;
+  data->record = NULL;
+
+  data->cache_bufp = NULL;
+
+  data->trace = trace_start("write");
+
+  data->key = TSCacheKeyCreate();
+  if (digest_key_set(data->key, alg, digest) != TS_SUCCESS) {
+    trace_end(data->trace);
+
+    TSCacheKeyDestroy(data->key);
+
+    TSfree(data->value);
+    freelist_free(&write_freelist, STAT_LIVE_WRITE, data);
+
+    return;
+  }
+
+  /* Can't reuse the TSTransformCreate() continuation because we
+   * don't know whether to destroy it in
+   * cache_open_write()/cache_open_write_failed() or
+   * transform_vconn_write_complete() */
+  TSCont contp = TSContCreate(write_handler, NULL);
+  TSContDataSet(contp, data);
+
+  /* Reentrant! */
+  TSCacheRead(contp, data->key);
+}
+
+/* The ETag header, or else the Last-Modified header.  Zero if there's
+ * neither, or it doesn't fit. */
+
+static int
+validator_get(TSMBuffer bufp, TSMLoc hdr_loc, char *validator)
+{
+  const char *value;
+  int length = 0;
+
+  TSMLoc field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, "ETag", 4);
+  if (!field_loc) {
+    field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, "Last-Modified", 13);
+  }
+
+  if (!field_loc) {
+    return 0;
+  }
+
+  /* No allocation, freed with bufp? */
+  value = TSMimeHdrFieldValueStringGet(bufp, hdr_loc, field_loc, -1, &length);
+  if (!value || length > HEADER_VALIDATOR_MAX || memchr(value, '\n', length)) {
+    length = 0;
+
+  } else {
+    memcpy(validator, value, length);
+  }
+
+  TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+
+  return length;
+}
+
+/* The cache key for a URL's Digest header.  Prefixed so it can't
+ * collide with the URL itself or a digest. */
+
+static TSReturnCode
+header_key_set(TSCacheKey key, const char *url, int length)
+{
+  char *buf = (char *) TSmalloc(length + 4);
+
+  memcpy(buf, "\177MLH", 4);
+  memcpy(buf + 4, url, length);
+
+  TSReturnCode status = TSCacheKeyDigestSet(key, buf, length + 4);
+
+  TSfree(buf);
+
+  return status;
+}
+
+/* TSCacheWrite() and TSVConnWrite() handler: Store the Digest header */
+
+static int
+header_write_handler(TSCont contp, TSEvent event, void *edata)
+{
+  HeaderWriteData *data = (HeaderWriteData *) TSContDataGet(contp);
+
+  switch (event) {
+  case TS_EVENT_CACHE_OPEN_WRITE: {
+    data->connp = (TSVConn) edata;
+
+    TSCacheKeyDestroy(data->key);
+
+    data->cache_bufp = TSIOBufferCreate();
+    TSIOBufferReader readerp = TSIOBufferReaderAlloc(data->cache_bufp);
+
+    int nbytes = TSIOBufferWrite(data->cache_bufp, data->value, data->length);
+
+    TSfree(data->value);
+
+    /* Reentrant!  Reuse the TSCacheWrite() continuation. */
+    TSVConnWrite(data->connp, contp, readerp, nbytes);
+
+    break;
+  }
+
+  case TS_EVENT_CACHE_OPEN_WRITE_FAILED:
+    TSContDestroy(contp);
+
+    TSCacheKeyDestroy(data->key);
+
+    TSfree(data->value);
+    TSfree(data);
+
+    break;
+
+  case TS_EVENT_VCONN_WRITE_COMPLETE:
+    TSContDestroy(contp);
+
+    TSVConnClose(data->connp);
+
+    stat_increment(STAT_HEADER_WRITTEN, 1);
+
+    TSIOBufferDestroy(data->cache_bufp);
+    TSfree(data);
+
+    break;
+
+  default:
+    TSAssert(!"Unexpected event");
+  }
+
+  return 0;
+}
+
+/* Remember the Digest header of the content at the request URL, and
+ * store it in the cache unless it's unchanged */
+
+static void
+header_write(const char *url, int url_length, unsigned char digests[DIGEST_NALGS][DIGEST_MAX_LENGTH], unsigned int algs, int64_t size,
+             const char *validator, int validator_length)
+{
+  char hash[32];
+  char value[HEADER_VALUE_MAX];
+
+  /* Without a validator it can't tell later if it's the same content */
+  if (!header_index.nsets || !validator_length) {
+    return;
+  }
+
+  int length = snprintf(value, sizeof(value), "%" PRId64 " %.*s\n", size, validator_length, validator);
+
+  const char *separator = "";
+  for (int alg = 0; alg < DIGEST_NALGS; alg += 1) {
+    if (!(algs & 1 << alg)) {
+      continue;
+    }
+
+    length += snprintf(value + length, sizeof(value) - length, "%s%s=", separator, digest_algorithms[alg].name);
+    separator = ",";
+
+    size_t encoded_length;
+    if (TSBase64Encode((const char *) digests[alg], digest_algorithms[alg].length, value + length, sizeof(value) - length, &encoded_length) != TS_SUCCESS) {
+      return;
+    }
+
+    length += encoded_length;
+  }
+
+  url_hash(url, url_length, hash);
+
+  /* Unchanged, so it's already stored */
+  if (!index_set(&header_index, DIGEST_SHA256, hash, value, length, TShrtime())) {
+    return;
+  }
+
+  HeaderWriteData *data = (HeaderWriteData *) TSmalloc(sizeof(HeaderWriteData));
+
+  data->value = TSstrndup(value, length);
+  data->length = length;
+
+  data->key = TSCacheKeyCreate();
+  if (header_key_set(data->key, url, url_length) != TS_SUCCESS) {
+    TSCacheKeyDestroy(data->key);
+
+    TSfree(data->value);
+    TSfree(data);
+
+    return;
+  }
+
+  TSCont contp = TSContCreate(header_write_handler, NULL);
+  TSContDataSet(contp, data);
+
+  /* Reentrant! */
+  TSCacheWrite(contp, data->key);
+}
+
+/* Write one record for each algorithm, and the Digest header.  Takes
+ * ownership of the request URL. */
+
+static void
+digests_record(unsigned char digests[DIGEST_NALGS][DIGEST_MAX_LENGTH], unsigned int algs, char *value, int length, int64_t size,
+               const char *validator, int validator_length)
+{
+  header_write(value, length, digests, algs, size, validator, validator_length);
+
+  for (int alg = 0; algs; alg += 1) {
+    if (!(algs & 1 << alg)) {
+      continue;
+    }
+
+    algs &= ~(1 << alg);
+
+    /* Each write takes ownership of its own copy, the last takes the
+     * original */
+    digest_write(alg, (const char *) digests[alg], algs ? TSstrndup(value, length) : value, length, size);
+  }
+}
+
+/* Finish computing the digests and write them.  Takes ownership of
+ * the request URL. */
+
+static void
+digests_write(DigestContext *c, char *value, int length, int64_t size, const char *validator, int validator_length)
+{
+  unsigned char digests[DIGEST_NALGS][DIGEST_MAX_LENGTH];
+
+  digest_final(digests, c);
+
+  digests_record(digests, c->algs, value, length, size, validator, validator_length);
+}
+
+/* Offload computing the digest to the task threads.  The transform
+ * only hands over references to the content: TSIOBufferCopy() clones
+ * the buffer blocks, it doesn't copy bytes, and the clones keep the
+ * blocks alive until the task thread is done with them.  The net
+ * thread then just passes the content through.
+ *
+ * At most one task per transaction is scheduled or running at a time,
+ * so the content is digested in order.  The net thread holds the lock
+ * only long enough to append to the buffer, and the task thread only
+ * long enough to check what's available and to consume it, not while
+ * it digests.  That's safe because the net thread only ever appends
+ * blocks after the ones the task thread is reading. */
+
+static void
+hash_destroy(HashData *data)
+{
+  TSContDestroy(data->contp);
+
+  TSIOBufferDestroy(data->bufp);
+  TSMutexDestroy(data->mutexp);
+
+  if (data->value) {
+    TSfree(data->value);
+  }
+
+  TSfree(data);
+}
+
+/* Call with the lock held */
+
+static void
+hash_schedule(HashData *data)
+{
+  if (!data->scheduled) {
+    data->scheduled = 1;
+
+    TSContScheduleOnPool(data->contp, 0, TS_THREAD_POOL_TASK);
+  }
+}
+
+static int
+hash_handler(TSCont contp, TSEvent /* event ATS_UNUSED */, void */* edata ATS_UNUSED */)
+{
+  const char *value;
+  int64_t length;
+
+  HashData *data = (HashData *) TSContDataGet(contp);
+
+  for (;;) {
+    TSMutexLock(data->mutexp);
+
+    /* Nobody else will touch it */
+    if (data->aborted) {
+      TSMutexUnlock(data->mutexp);
+
+      hash_destroy(data);
+
+      return 0;
+    }
+
+    int64_t avail = TSIOBufferReaderAvail(data->readerp);
+    int complete = data->complete;
+
+    if (!avail && !complete) {
+      data->scheduled = 0;
+
+      TSMutexUnlock(data->mutexp);
+
+      return 0;
+    }
+
+    TSIOBufferBlock blockp = TSIOBufferReaderStart(data->readerp);
+
+    TSMutexUnlock(data->mutexp);
+
+    TSHRTime start = TShrtime();
+
+    /* Feed content to the message digest.  Stop at avail, the blocks
+     * after that might still be changing. */
+    for (int64_t todo = avail; todo; todo -= length) {
+
+      /* No allocation? */
+      value = TSIOBufferBlockReadStart(blockp, data->readerp, &length);
+      if (length > todo) {
+        length = todo;
+      }
+
+      digest_update(&data->c, value, length);
+
+      if (todo > length) {
+        blockp = TSIOBufferBlockNext(blockp);
+      }
+    }
+
+    stat_increment(STAT_HASH_BYTES, avail);
+    stat_increment(STAT_HASH_NS, TShrtime() - start);
+
+    TSMutexLock(data->mutexp);
+    TSIOBufferReaderConsume(data->readerp, avail);
+    TSMutexUnlock(data->mutexp);
+
+    /* Nothing gets appended after the content is complete */
+    if (complete) {
+      digests_write(&data->c, data->value, data->length, data->size, data->validator, data->validator_length);
+      data->value = NULL;
+
+      hash_destroy(data);
+
+      return 0;
+    }
+  }
+}
+
+static HashData *
+hash_create(void)
+{
+  HashData *data = (HashData *) TSmalloc(sizeof(HashData));
+
+  data->contp = TSContCreate(hash_handler, TSMutexCreate());
+  TSContDataSet(data->contp, data);
+
+  data->mutexp = TSMutexCreate();
+
+  data->bufp = TSIOBufferCreate();
+  data->readerp = TSIOBufferReaderAlloc(data->bufp);
+
+  data->scheduled = 0;
+  data->complete = 0;
+  data->aborted = 0;
+
+  digest_init(&data->c, digest_algs, sha256_kernel);
+
+  data->value = NULL;
+
+  return data;
+}
+
+/* Hand over references to the content */
+
+static void
+hash_feed(HashData *data, TSIOBufferReader readerp, int64_t avail)
+{
+  TSMutexLock(data->mutexp);
+
+  TSIOBufferCopy(data->bufp, readerp, avail, 0);
+  hash_schedule(data);
+
+  TSMutexUnlock(data->mutexp);
+}
+
+/* All the content was handed over.  Takes ownership of the request
+ * URL. */
+
+static void
+hash_complete(HashData *data, char *value, int length, int64_t size, const char *validator, int validator_length)
+{
+  TSMutexLock(data->mutexp);
+
+  data->value = value;
+  data->length = length;
+
+  data->size = size;
+
+  memcpy(data->validator, validator, validator_length);
+  data->validator_length = validator_length;
+
+  data->complete = 1;
+  hash_schedule(data);
+
+  TSMutexUnlock(data->mutexp);
+}
+
+/* The transformation was closed before the content was complete.
+ * Destroy the data now unless a task is still using it. */
+
+static void
+hash_abort(HashData *data)
+{
+  TSMutexLock(data->mutexp);
+
+  data->aborted = 1;
+  int scheduled = data->scheduled;
+
+  TSMutexUnlock(data->mutexp);
+
+  if (!scheduled) {
+    hash_destroy(data);
+  }
+}
+
+/* Copy content from the input buffer to the output buffer without
+ * modification and feed it through the message digest at the same
+ * time.
+ *
+ *    1.  Check if we are "closed" before doing anything else to avoid
+ *        errors.
+ *
+ *    2.  Then deal with any input that's available now.
+ *
+ *    3.  Check if the input is complete after dealing with any
+ *        available input in case it was the last of it.  If it is
+ *        complete, tell downstream, thank upstream, and finish
+ *        computing the digest.  Otherwise either wait for more input
+ *        or abort if upstream is "closed".
+ *
+ * The handler is guaranteed to get called at least once, even if the
+ * response is 304 Not Modified, so we are guaranteed an opportunity
+ * to clean up e.g. data that we allocated when we called
+ * TSTransformCreate().
+ *
+ * TS_EVENT_VCONN_WRITE_READY and TS_EVENT_VCONN_WRITE_COMPLETE events
+ * are sent from downstream, e.g. by
+ * TransformTerminus::handle_event().  TS_EVENT_IMMEDIATE events are
+ * sent by INKVConnInternal::do_io_write(),
+ * INKVConnInternal::do_io_close(), and INKVConnInternal::reenable()
+ * which are called from upstream, e.g. by
+ * TransformVConnection::do_io_write(),
+ * TransformVConnection::do_io_close(), and
+ * HttpTunnel::producer_handler().
+ *
+ * Clean up the output buffer on TS_EVENT_VCONN_WRITE_COMPLETE and not
+ * before.  We are guaranteed a TS_EVENT_VCONN_WRITE_COMPLETE event
+ * *unless* we are "closed".  In that case we instead get a
+ * TS_EVENT_IMMEDIATE event where TSVConnClosedGet() is one.  We'll
+ * only ever get one event where TSVConnClosedGet() is one and it will
+ * be our last, so we *must* check for this case and clean up then
+ * too.  Because we'll only ever get one such event and it will be our
+ * last, there's no risk of double freeing.
+ *
+ * The response headers get sent when TSVConnWrite() gets called and
+ * not before.  (We could potentially edit them until then.)
+ *
+ * The events say nothing about the state of the input.  Gather this
+ * instead from TSVConnClosedGet(), TSVIOReaderGet(), and
+ * TSVIONTodoGet() and handle the end of the input independently from
+ * the TS_EVENT_VCONN_WRITE_COMPLETE event from downstream.
+ *
+ * When TSVConnClosedGet() is one, *we* are "closed".  We *must* check
+ * for this case, if only to clean up allocated data.  Some state is
+ * already inconsistent.  (This happens when the response is 304 Not
+ * Modified or when the client or origin disconnect before the message
+ * is complete.)
+ *
+ * When TSVIOReaderGet() is NULL, upstream is "closed".  In that case
+ * it's clearly an error to call TSIOBufferReaderAvail(), it's also an
+ * error at that point to send any events upstream with TSContCall().
+ * (This happens when the content length is zero or when we get the
+ * final chunk of a chunked response.)
+ *
+ * The input is complete only when TSVIONTodoGet() is zero.  (Don't
+ * update the downstream nbytes otherwise!)  Update the downstream
+ * nbytes when the input is complete in case the response is chunked
+ * (in which case nbytes is unknown until then).  Downstream will
+ * (normally) send the TS_EVENT_VCONN_WRITE_COMPLETE event (and the
+ * final chunk if the response is chunked) when ndone equals nbytes
+ * and not before.
+ *
+ * Send our own TS_EVENT_VCONN_WRITE_COMPLETE event upstream when the
+ * input is complete otherwise HttpSM::update_stats() won't get called
+ * and the transaction won't get logged.  (If there are upstream
+ * transformations they won't get a chance to clean up otherwise!)
+ *
+ * Summary of the cases each event can fall into:
+ *
+ *    Closed        *We* are "closed".  Clean up allocated data.
+ *     │
+ *     ├ Start      First (and last) time the handler was called.
+ *     │            (This happens when the response is 304 Not
+ *     │            Modified.)
+ *     │
+ *     └ Not start  (This happens when the client or origin disconnect
+ *                  before the message is complete.)
+ *
+ *    Start         First time the handler was called.  Initialize
+ *     │            data here because we can't call TSVConnWrite()
+ *     │            before TS_HTTP_RESPONSE_TRANSFORM_HOOK.
+ *     │
+ *     ├ Content length
+ *     │
+ *     └ Chunked response
+ *
+ *    Upstream closed
+ *                  (This happens when the content length is zero or
+ *                  when we get the final chunk of a chunked
+ *                  response.)
+ *
+ *    Available input
+ *
+ *    Input complete
+ *     │
+ *     ├ Deja vu    There might be multiple TS_EVENT_IMMEDIATE events
+ *     │            between the end of the input and the
+ *     │            TS_EVENT_VCONN_WRITE_COMPLETE event from
+ *     │            downstream.
+ *     │
+ *     └ Not deja vu
+ *                  Tell downstream and thank upstream.
+ *
+ *    Downstream complete
+ *                  Clean up the output buffer. */
+
+static int
+vconn_write_ready(TSCont contp, void */* edata ATS_UNUSED */)
+{
+  const char *value;
+  int64_t length;
+
+  TransformData *transform_data = (TransformData *) TSContDataGet(contp);
+
+  /* Check if we are "closed" before doing anything else to avoid
+   * errors.  We *must* check for this case, if only to clean up
+   * allocated data.  Some state is already inconsistent.  (This
+   * happens if the response is 304 Not Modified or if the client or
+   * origin disconnect before the message is complete.) */
+  int closed = TSVConnClosedGet(contp);
+  if (closed) {
+    TSContDestroy(contp);
+
+    /* Closed before the content was complete */
+    if (transform_data->txnp) {
+      stat_increment(STAT_TRANSFORM_ABORTED, 1);
+    }
+
+    trace_event(transform_data->trace, "closed", transform_data->txnp ? "aborted" : "done");
+    trace_end(transform_data->trace);
+
+    fill_forget(transform_data);
+
+    if (transform_data->hash_data) {
+      hash_abort(transform_data->hash_data);
+    }
+
+    /* Avoid failed assert "sdk_sanity_check_iocore_structure(bufp) ==
+     * TS_SUCCESS" in TSIOBufferDestroy() if the response is 304 Not
+     * Modified */
+    if (transform_data->output_bufp) {
+      TSIOBufferDestroy(transform_data->output_bufp);
+    }
+
+    freelist_free(&transform_freelist, STAT_LIVE_TRANSFORM, transform_data);
+
+    return 0;
+  }
+
+  TSVIO input_viop = TSVConnWriteVIOGet(contp);
+
+  /* Initialize data here because we can't call TSVConnWrite() before
+   * TS_HTTP_RESPONSE_TRANSFORM_HOOK */
+  if (!transform_data->output_bufp) {
+    TSVConn output_connp = TSTransformOutputVConnGet(contp);
+
+    transform_data->output_bufp = TSIOBufferCreate();
+    TSIOBufferReader readerp = TSIOBufferReaderAlloc(transform_data->output_bufp);
+
+    /* Determines the Content-Length header (or a chunked response) */
+
+    /* Reentrant!  Avoid failed assert "nbytes >= 0" if the response
+     * is chunked. */
+    int nbytes = TSVIONBytesGet(input_viop);
+    transform_data->output_viop = TSVConnWrite(output_connp, contp, readerp, nbytes < 0 ? INT64_MAX : nbytes);
+
+    if (transform_data->trusted_algs) {
+      /* Nothing to compute */
+
+    } else if (hash_offload) {
+      transform_data->hash_data = hash_create();
+
+    } else {
+      digest_init(&transform_data->c, digest_algs, sha256_kernel);
+    }
+
+    trace_event(transform_data->trace, "output", "open");
+  }
+
+  /* Then deal with any input that's available now.  Avoid failed
+   * assert "sdk_sanity_check_iocore_structure(readerp) == TS_SUCCESS"
+   * in TSIOBufferReaderAvail() if the content length is zero or when
+   * we get the final chunk of a chunked response. */
+  TSIOBufferReader readerp = TSVIOReaderGet(input_viop);
+  if (readerp) {
+
+    int avail = TSIOBufferReaderAvail(readerp);
+    if (avail) {
+      TSIOBufferCopy(transform_data->output_bufp, readerp, avail, 0);
+
+      /* Hand over the content to a task thread */
+      if (transform_data->hash_data) {
+        hash_feed(transform_data->hash_data, readerp, avail);
+
+      } else if (!transform_data->trusted_algs) {
+        TSHRTime start = TShrtime();
+
+        /* Feed content to the message digest */
+        TSIOBufferBlock blockp = TSIOBufferReaderStart(readerp);
+        while (blockp) {
+
+          /* No allocation? */
+          value = TSIOBufferBlockReadStart(blockp, readerp, &length);
+          digest_update(&transform_data->c, value, length);
+
+          blockp = TSIOBufferBlockNext(blockp);
+        }
+
+        stat_increment(STAT_HASH_BYTES, avail);
+        stat_increment(STAT_HASH_NS, TShrtime() - start);
+      }
+
+      TSIOBufferReaderConsume(readerp, avail);
+
+      /* Call TSVIONDoneSet() for TSVIONTodoGet() condition */
+      int ndone = TSVIONDoneGet(input_viop);
+      TSVIONDoneSet(input_viop, ndone + avail);
+    }
+  }
+
+  /* Check if the input is complete after dealing with any available
+   * input in case it was the last of it */
+  int ntodo = TSVIONTodoGet(input_viop);
+  if (ntodo) {
+    TSVIOReenable(transform_data->output_viop);
+
+    TSContCall(TSVIOContGet(input_viop), TS_EVENT_VCONN_WRITE_READY, input_viop);
+
+  /* Don't finish computing the digest (and tell downstream and thank
+   * upstream) more than once!  There might be multiple
+   * TS_EVENT_IMMEDIATE events between the end of the input and the
+   * TS_EVENT_VCONN_WRITE_COMPLETE event from downstream, e.g.
+   * INKVConnInternal::reenable() is called by
+   * HttpTunnel::producer_handler() when more input is available and
+   * TransformVConnection::do_io_shutdown() is called by
+   * HttpSM::tunnel_handler_transform_write() when we send our own
+   * TS_EVENT_VCONN_WRITE_COMPLETE event upstream. */
+  } else if (transform_data->txnp) {
+
+    int ndone = TSVIONDoneGet(input_viop);
+    TSVIONBytesSet(transform_data->output_viop, ndone);
+
+    TSVIOReenable(transform_data->output_viop);
+
+    /* Avoid failed assert "c->alive == true" in TSContCall() if the
+     * content length is zero or when we get the final chunk of a
+     * chunked response */
+    if (readerp) {
+      TSContCall(TSVIOContGet(input_viop), TS_EVENT_VCONN_WRITE_COMPLETE, input_viop);
+    }
+
+    TSHttpTxn txnp = transform_data->txnp;
+
+    /* Don't finish computing the digest more than once! */
+    transform_data->txnp = NULL;
+
+    trace_event(transform_data->trace, "input", "complete");
+
+    /* It's written, the index takes over */
+    fill_forget(transform_data);
+
+    /* Get the request URL now, while the transaction is still alive.
+     * Allocation!  Must free! */
+    int url_length;
+    char *url = request_url_get(txnp, &url_length);
+
+    /* Let the task thread finish computing the digest and write it to
+     * the cache */
+    if (transform_data->hash_data) {
+      if (url) {
+        hash_complete(transform_data->hash_data, url, url_length, ndone, transform_data->validator, transform_data->validator_length);
+
+        trace_event(transform_data->trace, "hash", "offloaded");
+
+      } else {
+        hash_abort(transform_data->hash_data);
+      }
+
+      /* Don't abort it when we are "closed" */
+      transform_data->hash_data = NULL;
+
+      return 0;
+    }
+
+    if (!url) {
+      return 0;
+    }
+
+    /* Write the digests to the cache */
+    if (transform_data->trusted_algs) {
+      digests_record(transform_data->trusted, transform_data->trusted_algs, url, url_length, ndone, transform_data->validator,
+                     transform_data->validator_length);
+
+    } else {
+      digests_write(&transform_data->c, url, url_length, ndone, transform_data->validator, transform_data->validator_length);
+    }
+
+    trace_event(transform_data->trace, "hash", "done");
+  }
+
+  return 0;
+}
+
+static int
+transform_vconn_write_complete(TSCont contp, void */* edata ATS_UNUSED */)
+{
+  TransformData *data = (TransformData *) TSContDataGet(contp);
+  TSContDestroy(contp);
+
+  trace_end(data->trace);
+
+  fill_forget(data);
+
+  TSIOBufferDestroy(data->output_bufp);
+  freelist_free(&transform_freelist, STAT_LIVE_TRANSFORM, data);
+
+  return 0;
+}
+
+/* TSTransformCreate() handler: Compute the SHA-256 digest of the
+ * content */
+
+static int
+transform_handler(TSCont contp, TSEvent event, void *edata)
+{
+  switch (event) {
+  case TS_EVENT_IMMEDIATE:
+  case TS_EVENT_VCONN_WRITE_READY:
+    return vconn_write_ready(contp, edata);
+
+  case TS_EVENT_VCONN_WRITE_COMPLETE:
+    return transform_vconn_write_complete(contp, edata);
+
+  default:
+    TSAssert(!"Unexpected event");
+  }
+
+  return 0;
+}
+
+/* Only GET responses are cached with a body */
+
+static int
+request_get(TSHttpTxn txnp)
+{
+  TSMBuffer bufp;
+  TSMLoc hdr_loc;
+
+  const char *value;
+  int length;
+
+  if (TSHttpTxnClientReqGet(txnp, &bufp, &hdr_loc) != TS_SUCCESS) {
+    TSError("Couldn't retrieve client request header");
+
+    return 0;
+  }
+
+  /* No allocation, freed with bufp? */
+  value = TSHttpHdrMethodGet(bufp, hdr_loc, &length);
+  int get = value && length == TS_HTTP_LEN_GET && !memcmp(value, TS_HTTP_METHOD_GET, length);
+
+  TSHandleMLocRelease(bufp, TS_NULL_MLOC, hdr_loc);
+
+  return get;
+}
+
+/* Metalink documents: Pass on what's written to the output */
+
+static void
+metalink_write(MetalinkData *data, const char *value, int64_t length)
+{
+  if (length <= 0) {
+    return;
+  }
+
+  TSIOBufferWrite(data->output_bufp, value, length);
+  data->output_length += length;
+}
+
+/* Escape the URL for the text of an element */
+
+static void
+metalink_write_escaped(MetalinkData *data, const char *value, int length)
+{
+  int start = 0;
+  for (int i = 0; i < length; i += 1) {
+    const char *entity;
+    switch (value[i]) {
+    case '&':
+      entity = "&amp;";
+      break;
+
+    case '<':
+      entity = "&lt;";
+      break;
+
+    case '>':
+      entity = "&gt;";
+      break;
+
+    default:
+      continue;
+    }
+
+    metalink_write(data, value + start, i - start);
+    metalink_write(data, entity, strlen(entity));
+
+    start = i + 1;
+  }
+
+  metalink_write(data, value + start, length - start);
+}
+
+/* Drop what's passed on from the pending input */
+
+static void
+metalink_shift(MetalinkData *data, int64_t length)
+{
+  if (!length) {
+    return;
+  }
+
+  memmove(data->pending, data->pending + length, data->pending_length - length);
+  data->pending_length -= length;
+
+  data->scanned = 0;
+}
+
+static void
+metalink_append(MetalinkData *data, TSIOBufferReader readerp, int64_t avail)
+{
+  const char *value;
+  int64_t length;
+
+  if (data->pending_length + avail > data->pending_size) {
+    data->pending_size = data->pending_length + avail > 2 * data->pending_size ? data->pending_length + avail : 2 * data->pending_size;
+    data->pending = (char *) TSrealloc(data->pending, data->pending_size);
+  }
+
+  int64_t appended = 0;
+  for (TSIOBufferBlock blockp = TSIOBufferReaderStart(readerp); blockp && appended < avail; blockp = TSIOBufferBlockNext(blockp)) {
+
+    /* No allocation? */
+    value = TSIOBufferBlockReadStart(blockp, readerp, &length);
+    if (length > avail - appended) {
+      length = avail - appended;
+    }
+
+    memcpy(data->pending + data->pending_length + appended, value, length);
+    appended += length;
+  }
+
+  data->pending_length += appended;
+}
+
+/* Find a start tag, e.g. "<url" followed by whitespace or '>'.  Not
+ * one that's cut off at the end. */
+
+static const char *
+metalink_tag_find(const char *p, const char *end, const char *tag, int length)
+{
+  while ((p = (const char *) memmem(p, end - p, tag, length))) {
+    if (p + length == end) {
+      return NULL;
+    }
+
+    if (memchr(" \t\r\n>", p[length], 5)) {
+      return p;
+    }
+
+    p += 1;
+  }
+
+  return NULL;
+}
+
+/* The value of an attribute in a start tag, between the tag name and
+ * the '>'.  If attr_start isn't NULL, also where the attribute starts
+ * (with the whitespace before it) and ends. */
+
+static const char *
+metalink_attr_get(const char *p, const char *end, const char *name, int *length, const char **attr_start, const char **attr_end)
+{
+  int name_length = strlen(name);
+
+  while (p < end) {
+    const char *start = p;
+
+    while (p < end && memchr(" \t\r\n", *p, 4)) {
+      p += 1;
+    }
+
+    const char *name_start = p;
+    while (p < end && *p != '=' && !memchr(" \t\r\n", *p, 4)) {
+      p += 1;
+    }
+
+    const char *name_end = p;
+    while (p < end && memchr(" \t\r\n", *p, 4)) {
+      p += 1;
+    }
+
+    if (p == end || *p != '=') {
+      return NULL;
+    }
+
+    p += 1;
+    while (p < end && memchr(" \t\r\n", *p, 4)) {
+      p += 1;
+    }
+
+    if (p == end || (*p != '"' && *p != '\'')) {
+      return NULL;
+    }
+
+    const char *quote = (const char *) memchr(p + 1, *p, end - p - 1);
+    if (!quote) {
+      return NULL;
+    }
+
+    if (name_end - name_start == name_length && !memcmp(name_start, name, name_length)) {
+      *length = quote - p - 1;
+
+      if (attr_start) {
+        *attr_start = start;
+        *attr_end = quote + 1;
+      }
+
+      return p + 1;
+    }
+
+    p = quote + 1;
+  }
+
+  return NULL;
+}
+
+/* The text of an element, without the whitespace around it and with
+ * the predefined entities replaced.  Allocation!  Must free! */
+
+static char *
+metalink_text_get(const char *p, const char *end, int *length)
+{
+  static const struct {
+    const char *entity;
+    char c;
+  } entities[] = {
+    { "&amp;", '&' },
+    { "&lt;", '<' },
+    { "&gt;", '>' },
+    { "&quot;", '"' },
+    { "&apos;", '\'' }
+  };
+
+  while (p < end && memchr(" \t\r\n", *p, 4)) {
+    p += 1;
+  }
+
+  while (end > p && memchr(" \t\r\n", end[-1], 4)) {
+    end -= 1;
+  }
+
+  char *value = (char *) TSmalloc(end - p + 1);
+  *length = 0;
+
+  while (p < end) {
+    size_t i = 0;
+    if (*p == '&') {
+      for (; i < sizeof(entities) / sizeof(*entities); i += 1) {
+        int n = strlen(entities[i].entity);
+        if (end - p >= n && !memcmp(p, entities[i].entity, n)) {
+          break;
+        }
+      }
+    }
+
+    /* An entity */
+    if (i < sizeof(entities) / sizeof(*entities) && *p == '&') {
+      value[(*length)++] = entities[i].c;
+      p += strlen(entities[i].entity);
+
+      continue;
+    }
+
+    value[(*length)++] = *p++;
+  }
+
+  return value;
+}
+
+/* The SHA-256 digest in a <hash type="sha-256"> element, in hex */
+
+static int
+metalink_hash_get(const char *p, const char *end, char *digest)
+{
+  while ((p = metalink_tag_find(p, end, "<hash", 5))) {
+    const char *gt = (const char *) memchr(p, '>', end - p);
+    if (!gt) {
+      return 0;
+    }
+
+    int length;
+    const char *type = metalink_attr_get(p + 5, gt, "type", &length, NULL, NULL);
+
+    p = gt + 1;
+
+    if (!type || length != 7 || strncasecmp(type, "sha-256", 7)) {
+      continue;
+    }
+
+    const char *lt = (const char *) memchr(p, '<', end - p);
+    if (!lt) {
+      return 0;
+    }
+
+    while (p < lt && memchr(" \t\r\n", *p, 4)) {
+      p += 1;
+    }
+
+    for (int i = 0; i < 64; i += 1) {
+      if (p + i == lt || !isxdigit((unsigned char) p[i])) {
+        return 0;
+      }
+
+      int nibble = isdigit((unsigned char) p[i]) ? p[i] - '0' : (tolower((unsigned char) p[i]) - 'a' + 10);
+      digest[i / 2] = i % 2 ? digest[i / 2] | nibble : nibble << 4;
+    }
+
+    return 1;
+  }
+
+  return 0;
+}
+
+static void
+metalink_urls_free(MetalinkData *data)
+{
+  for (int i = 0; i < data->nurls; i += 1) {
+    if (data->urls[i].key) {
+      TSCacheKeyDestroy(data->urls[i].key);
+    }
+
+    TSfree(data->urls[i].value);
+  }
+
+  if (data->urls) {
+    TSfree(data->urls);
+  }
+
+  data->urls = NULL;
+  data->nurls = 0;
+}
+
+static void
+metalink_unref(MetalinkData *data)
+{
+  /* Only ever changed with the transformation's lock held */
+  data->refcount -= 1;
+  if (data->refcount) {
+    return;
+  }
+
+  metalink_urls_free(data);
+
+  if (data->pending) {
+    TSfree(data->pending);
+  }
+
+  TSfree(data);
+}
+
+/* TSCacheRead() handler: Check if a URL from the document is cached,
+ * and resume the transformation when it's the last one */
+
+static int
+metalink_url_handler(TSCont contp, TSEvent event, void *edata)
+{
+  MetalinkUrl *urlp = (MetalinkUrl *) TSContDataGet(contp);
+  TSContDestroy(contp);
+
+  MetalinkData *data = urlp->data;
+
+  switch (event) {
+  case TS_EVENT_CACHE_OPEN_READ:
+    TSVConnClose((TSVConn) edata);
+
+    urlp->cached = 1;
+
+    break;
+
+  case TS_EVENT_CACHE_OPEN_READ_FAILED:
+    urlp->cached = 0;
+
+    break;
+
+  default:
+    TSAssert(!"Unexpected event");
+  }
+
+  data->lookups -= 1;
+
+  /* Reentrant!  The lookups share the transformation's lock. */
+  if (!data->lookups && !data->closed) {
+    TSContCall(data->contp, TS_EVENT_IMMEDIATE, NULL);
+  }
+
+  metalink_unref(data);
+
+  return 0;
+}
+
+/* Find the <url> elements of the <file> element at the start of the
+ * pending input, and the URL the index remembers for its SHA-256, and
+ * check if they're cached, all at the same time.  Return nonzero if
+ * the transformation has to wait for the answers. */
+
+static int
+metalink_lookup(MetalinkData *data)
+{
+  char digest[32];
+
+  const char *element = data->pending;
+  const char *end = element + data->element_length;
+
+  data->urls = (MetalinkUrl *) TSmalloc(sizeof(MetalinkUrl) * (METALINK_URLS_MAX + 1));
+  data->nurls = 0;
+
+  const char *p = element;
+  while (data->nurls < METALINK_URLS_MAX && (p = metalink_tag_find(p, end, "<url", 4))) {
+    const char *gt = (const char *) memchr(p, '>', end - p);
+    if (!gt) {
+      break;
+    }
+
+    const char *close = (const char *) memmem(gt + 1, end - gt - 1, "</url>", 6);
+    if (!close) {
+      break;
+    }
+
+    MetalinkUrl *urlp = &data->urls[data->nurls++];
+    urlp->data = data;
+
+    urlp->start = p - element;
+    urlp->tag_end = gt - element;
+    urlp->end = close + 6 - element;
+
+    /* The indentation, from the end of the previous line */
+    const char *ws = p;
+    while (ws > element && (ws[-1] == ' ' || ws[-1] == '\t')) {
+      ws -= 1;
+    }
+
+    if (ws > element && ws[-1] == '\n') {
+      ws -= ws - 1 > element && ws[-2] == '\r' ? 2 : 1;
+
+    } else {
+      ws = p;
+    }
+
+    urlp->ws_start = ws - element;
+
+    int length;
+    const char *pri = metalink_attr_get(p + 4, gt, "priority", &length, NULL, NULL);
+    urlp->pri = pri ? atoi(pri) : -1;
+
+    urlp->value = metalink_text_get(gt + 1, close, &urlp->length);
+
+    urlp->key = NULL;
+    urlp->cached = 0;
+
+    p = close + 6;
+  }
+
+  if (!data->nurls) {
+    metalink_urls_free(data);
+
+    return 0;
+  }
+
+  stat_increment(STAT_XML_FILES, 1);
+
+  /* The URL the index remembers, if it isn't listed already */
+  if (metalink_hash_get(element, end, digest)) {
+    int length;
+
+    /* Allocation!  Must free! */
+    char *value = index_lookup(&digest_index, DIGEST_SHA256, digest, 0, &length);
+    if (value) {
+      int i;
+      for (i = 0; i < data->nurls; i += 1) {
+        if (data->urls[i].length == length && !memcmp(data->urls[i].value, value, length)) {
+          break;
+        }
+      }
+
+      if (i == data->nurls) {
+        MetalinkUrl *urlp = &data->urls[data->nurls++];
+        urlp->data = data;
+
+        urlp->ws_start = -1;
+        urlp->start = -1;
+        urlp->tag_end = -1;
+        urlp->end = -1;
+
+        urlp->pri = -1;
+
+        urlp->value = value;
+        urlp->length = length;
+
+        urlp->key = NULL;
+        urlp->cached = 0;
+
+      } else {
+        TSfree(value);
+      }
+    }
+  }
+
+  /* Reuse one URL handle for all the keys */
+  TSMBuffer bufp = TSMBufferCreate();
+
+  TSMLoc url_loc;
+  TSUrlCreate(bufp, &url_loc);
+
+  for (int i = 0; i < data->nurls; i += 1) {
+    MetalinkUrl *urlp = &data->urls[i];
+
+    const char *value = urlp->value;
+
+    urlp->key = TSCacheKeyCreate();
+    if (TSUrlParse(bufp, url_loc, &value, value + urlp->length) != TS_PARSE_DONE
+        || TSCacheKeyDigestFromUrlSet(urlp->key, url_loc) != TS_SUCCESS) {
+      TSCacheKeyDestroy(urlp->key);
+      urlp->key = NULL;
+    }
+  }
+
+  TSHandleMLocRelease(bufp, TS_NULL_MLOC, url_loc);
+  TSMBufferDestroy(bufp);
+
+  /* Hold one lookup while they're started, so one that answers right
+   * away doesn't resume the transformation yet */
+  data->lookups = 1;
+
+  for (int i = 0; i < data->nurls; i += 1) {
+    if (!data->urls[i].key) {
+      continue;
+    }
+
+    data->lookups += 1;
+    data->refcount += 1;
+
+    TSCont contp = TSContCreate(metalink_url_handler, TSContMutexGet(data->contp));
+    TSContDataSet(contp, &data->urls[i]);
+
+    /* Reentrant! */
+    TSCacheRead(contp, data->urls[i].key);
+  }
+
+  data->lookups -= 1;
+
+  return data->lookups;
+}
+
+/* Write a <url> element with a new priority, -1 for none */
+
+static void
+metalink_url_write(MetalinkData *data, const MetalinkUrl *urlp, int pri)
+{
+  char attr[32];
+
+  const char *element = data->pending;
+
+  /* From the index */
+  if (urlp->start == -1) {
+    metalink_write(data, "<url priority=\"1\">", 18);
+    metalink_write_escaped(data, urlp->value, urlp->length);
+    metalink_write(data, "</url>", 6);
+
+    return;
+  }
+
+  if (pri == urlp->pri) {
+    metalink_write(data, element + urlp->start, urlp->end - urlp->start);
+
+    return;
+  }
+
+  const char *attrs = element + urlp->start + 4;
+  const char *gt = element + urlp->tag_end;
+
+  metalink_write(data, "<url", 4);
+
+  if (pri != -1) {
+    metalink_write(data, attr, snprintf(attr, sizeof(attr), " priority=\"%d\"", pri));
+  }
+
+  /* The other attributes */
+  int length;
+  const char *attr_start;
+  const char *attr_end;
+  if (metalink_attr_get(attrs, gt, "priority", &length, &attr_start, &attr_end)) {
+    metalink_write(data, attrs, attr_start - attrs);
+    metalink_write(data, attr_end, gt - attr_end);
+
+  } else {
+    metalink_write(data, attrs, gt - attrs);
+  }
+
+  metalink_write(data, gt, element + urlp->end - gt);
+}
+
+/* Pass on the <file> element that was looked up.  If any of its URLs
+ * are cached, put them first, with the highest priority, and lower the
+ * priority of the rest so they never tie. */
+
+static void
+metalink_emit(MetalinkData *data)
+{
+  const char *element = data->pending;
+
+  int cached = 0;
+  for (int i = 0; i < data->nurls; i += 1) {
+    cached += data->urls[i].cached == 1;
+  }
+
+  if (!cached) {
+    metalink_write(data, element, data->element_length);
+
+  } else {
+    stat_increment(STAT_XML_REWRITTEN, 1);
+
+    /* Where the first <url> element was, with its indentation */
+    const MetalinkUrl *firstp = &data->urls[0];
+    metalink_write(data, element, firstp->ws_start);
+
+    for (int cached_pass = 1; cached_pass >= 0; cached_pass -= 1) {
+      for (int i = 0; i < data->nurls; i += 1) {
+        const MetalinkUrl *urlp = &data->urls[i];
+
+        /* Forget the index's URL if it isn't cached */
+        if ((urlp->cached == 1) != cached_pass || (!cached_pass && urlp->start == -1)) {
+          continue;
+        }
+
+        metalink_write(data, element + firstp->ws_start, firstp->start - firstp->ws_start);
+        metalink_url_write(data, urlp, cached_pass ? 1 : urlp->pri > 0 && urlp->pri < 999999 ? urlp->pri + 1 : urlp->pri);
+      }
+    }
+
+    /* The rest, without the <url> elements */
+    int64_t offset = firstp->end;
+    for (int i = 1; i < data->nurls && data->urls[i].start != -1; i += 1) {
+      metalink_write(data, element + offset, data->urls[i].ws_start - offset);
+      offset = data->urls[i].end;
+    }
+
+    metalink_write(data, element + offset, data->element_length - offset);
+  }
+
+  metalink_urls_free(data);
+
+  metalink_shift(data, data->element_length);
+  data->state = METALINK_OUTSIDE;
+}
+
+/* Pass on as much of the pending input as possible, until a <file>
+ * element has to be looked up */
+
+static void
+metalink_process(MetalinkData *data)
+{
+  for (;;) {
+    const char *end = data->pending + data->pending_length;
+
+    if (!data->pending_length) {
+      return;
+    }
+
+    switch (data->state) {
+    case METALINK_OUTSIDE: {
+      const char *p = metalink_tag_find(data->pending, end, "<file", 5);
+      if (p) {
+        metalink_write(data, data->pending, p - data->pending);
+        metalink_shift(data, p - data->pending);
+
+        data->state = METALINK_FILE;
+
+        continue;
+      }
+
+      /* Hold on to what might be the start of one */
+      const char *lt = (const char *) memrchr(data->pending, '<', data->pending_length);
+      int64_t keep = lt && end - lt <= 5 ? end - lt : 0;
+
+      metalink_write(data, data->pending, data->pending_length - keep);
+      metalink_shift(data, data->pending_length - keep);
+
+      return;
+    }
+
+    case METALINK_FILE: {
+      int64_t from = data->scanned > 6 ? data->scanned - 6 : 0;
+
+      const char *close = (const char *) memmem(data->pending + from, data->pending_length - from, "</file>", 7);
+      if (close && close + 7 - data->pending <= METALINK_FILE_MAX) {
+        data->element_length = close + 7 - data->pending;
+
+        if (metalink_lookup(data)) {
+          data->state = METALINK_WAITING;
+
+          return;
+        }
+
+        metalink_emit(data);
+
+        continue;
+      }
+
+      data->scanned = data->pending_length;
+
+      if (close || data->pending_length > METALINK_FILE_MAX) {
+        metalink_write(data, data->pending, data->pending_length);
+        metalink_shift(data, data->pending_length);
+
+        data->state = METALINK_PASS;
+      }
+
+      return;
+    }
+
+    case METALINK_PASS:
+      metalink_write(data, data->pending, data->pending_length);
+      metalink_shift(data, data->pending_length);
+
+      return;
+
+    default:
+      return;
+    }
+  }
+}
+
+static int
+metalink_vconn_write_ready(TSCont contp, MetalinkData *data)
+{
+  TSVIO input_viop = TSVConnWriteVIOGet(contp);
+
+  /* The length changes, so the response is chunked */
+  if (!data->output_bufp) {
+    TSVConn output_connp = TSTransformOutputVConnGet(contp);
+
+    data->output_bufp = TSIOBufferCreate();
+    TSIOBufferReader readerp = TSIOBufferReaderAlloc(data->output_bufp);
+
+    /* Reentrant! */
+    data->output_viop = TSVConnWrite(output_connp, contp, readerp, INT64_MAX);
+  }
+
+  /* Resumed after the lookups */
+  if (data->state == METALINK_WAITING) {
+    if (data->lookups) {
+      return 0;
+    }
+
+    metalink_emit(data);
+  }
+
+  /* Don't finish more than once */
+  if (data->done) {
+    return 0;
+  }
+
+  TSIOBufferReader readerp = TSVIOReaderGet(input_viop);
+  for (;;) {
+    metalink_process(data);
+
+    /* Don't read any more input until the lookups are done */
+    if (data->state == METALINK_WAITING) {
+      TSVIOReenable(data->output_viop);
+
+      return 0;
+    }
+
+    int avail = readerp ? TSIOBufferReaderAvail(readerp) : 0;
+    if (!avail) {
+      break;
+    }
+
+    /* Nothing more to rewrite */
+    if (data->state == METALINK_PASS) {
+      TSIOBufferCopy(data->output_bufp, readerp, avail, 0);
+      data->output_length += avail;
+
+    } else {
+      metalink_append(data, readerp, avail);
+    }
+
+    TSIOBufferReaderConsume(readerp, avail);
+
+    /* Call TSVIONDoneSet() for TSVIONTodoGet() condition */
+    TSVIONDoneSet(input_viop, TSVIONDoneGet(input_viop) + avail);
+  }
+
+  if (TSVIONTodoGet(input_viop)) {
+    TSVIOReenable(data->output_viop);
+
+    TSContCall(TSVIOContGet(input_viop), TS_EVENT_VCONN_WRITE_READY, input_viop);
+
+    return 0;
+  }
+
+  /* The input is complete: Whatever's left, e.g. a <file> element that
+   * was cut off, is passed on as it is */
+  metalink_write(data, data->pending, data->pending_length);
+  metalink_shift(data, data->pending_length);
+
+  data->done = 1;
+
+  TSVIONBytesSet(data->output_viop, data->output_length);
+  TSVIOReenable(data->output_viop);
+
+  /* Avoid failed assert "c->alive == true" in TSContCall(), like
+   * vconn_write_ready() */
+  if (readerp) {
+    TSContCall(TSVIOContGet(input_viop), TS_EVENT_VCONN_WRITE_COMPLETE, input_viop);
+  }
+
+  return 0;
+}
+
+/* TSTransformCreate() handler: Rewrite a Metalink document */
+
+static int
+metalink_transform_handler(TSCont contp, TSEvent event, void */* edata ATS_UNUSED */)
+{
+  MetalinkData *data = (MetalinkData *) TSContDataGet(contp);
+
+  /* Closed, or downstream is done: Lookups still in flight hold on to
+   * the data */
+  if (TSVConnClosedGet(contp) || event == TS_EVENT_VCONN_WRITE_COMPLETE) {
+    TSContDestroy(contp);
+
+    data->closed = 1;
+
+    if (data->output_bufp) {
+      TSIOBufferDestroy(data->output_bufp);
+    }
+
+    metalink_unref(data);
+
+    return 0;
+  }
+
+  switch (event) {
+  case TS_EVENT_IMMEDIATE:
+  case TS_EVENT_VCONN_WRITE_READY:
+    return metalink_vconn_write_ready(contp, data);
+
+  default:
+    TSAssert(!"Unexpected event");
+  }
+
+  return 0;
+}
+
+/* Is it a Metalink document?  By the Content-Type, or the .meta4
+ * extension if the server doesn't know the type. */
+
+static int
+metalink_response(TSHttpTxn txnp, TSMBuffer bufp, TSMLoc hdr_loc)
+{
+  const char *value;
+  int length;
+
+  if (TSHttpHdrStatusGet(bufp, hdr_loc) != TS_HTTP_STATUS_OK) {
+    return 0;
+  }
+
+  /* Can't scan compressed content */
+  TSMLoc field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, "Content-Encoding", 16);
+  if (field_loc) {
+
+    /* No allocation, freed with bufp? */
+    value = TSMimeHdrFieldValueStringGet(bufp, hdr_loc, field_loc, -1, &length);
+
+    int identity = length == 8 && !strncasecmp(value, "identity", 8);
+
+    TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+
+    if (!identity) {
+      return 0;
+    }
+  }
+
+  field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, TS_MIME_FIELD_CONTENT_TYPE, TS_MIME_LEN_CONTENT_TYPE);
+  if (field_loc) {
+
+    /* No allocation, freed with bufp? */
+    value = TSMimeHdrFieldValueStringGet(bufp, hdr_loc, field_loc, -1, &length);
+
+    int metalink = length >= (int) sizeof(METALINK_CONTENT_TYPE) - 1
+                   && !strncasecmp(value, METALINK_CONTENT_TYPE, sizeof(METALINK_CONTENT_TYPE) - 1);
+
+    TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+
+    if (metalink) {
+      return 1;
+    }
+  }
+
+  /* Allocation!  Must free! */
+  char *url = request_url_get(txnp, &length);
+  if (!url) {
+    return 0;
+  }
+
+  /* Without the query */
+  const char *query = (const char *) memchr(url, '?', length);
+  if (query) {
+    length = query - url;
+  }
+
+  int metalink = length >= 6 && !memcmp(url + length - 6, ".meta4", 6);
+
+  TSfree(url);
+
+  return metalink;
+}
+
+static void
+metalink_transform_add(TSHttpTxn txnp)
+{
+  MetalinkData *data = (MetalinkData *) TSmalloc(sizeof(MetalinkData));
+
+  data->output_bufp = NULL;
+  data->output_viop = NULL;
+  data->output_length = 0;
+
+  data->pending = NULL;
+  data->pending_length = 0;
+  data->pending_size = 0;
+  data->scanned = 0;
+
+  data->state = METALINK_OUTSIDE;
+
+  data->urls = NULL;
+  data->nurls = 0;
+  data->element_length = 0;
+
+  data->lookups = 0;
+
+  data->refcount = 1;
+  data->closed = 0;
+  data->done = 0;
+
+  data->contp = TSTransformCreate(metalink_transform_handler, txnp);
+  TSContDataSet(data->contp, data);
+
+  TSHttpTxnHookAdd(txnp, TS_HTTP_RESPONSE_TRANSFORM_HOOK, data->contp);
+
+  /* Which mirrors are cached changes, so cache the document as it is */
+  TSHttpTxnUntransformedRespCache(txnp, 1);
+  TSHttpTxnTransformedRespCache(txnp, 0);
+
+  stat_increment(STAT_XML_DOCUMENTS, 1);
+}
+
+/* Implement TS_HTTP_READ_RESPONSE_HDR_HOOK and
+ * TS_HTTP_CACHE_LOOKUP_COMPLETE_HOOK to rewrite Metalink documents,
+ * whether they're from the origin or the cache */
+
+static int
+metalink_hook_handler(TSCont /* contp ATS_UNUSED */, TSEvent event, void *edata)
+{
+  TSHttpTxn txnp = (TSHttpTxn) edata;
+
+  TSMBuffer bufp;
+  TSMLoc hdr_loc;
+
+  int lookup_status;
+
+  switch (event) {
+  case TS_EVENT_HTTP_READ_RESPONSE_HDR:
+    if (request_get(txnp) && TSHttpTxnServerRespGet(txnp, &bufp, &hdr_loc) == TS_SUCCESS) {
+      if (metalink_response(txnp, bufp, hdr_loc)) {
+        metalink_transform_add(txnp);
+      }
+
+      TSHandleMLocRelease(bufp, TS_NULL_MLOC, hdr_loc);
+    }
+
+    break;
+
+  case TS_EVENT_HTTP_CACHE_LOOKUP_COMPLETE:
+    if (TSHttpTxnCacheLookupStatusGet(txnp, &lookup_status) == TS_SUCCESS && lookup_status == TS_CACHE_LOOKUP_HIT_FRESH
+        && request_get(txnp) && TSHttpTxnCachedRespGet(txnp, &bufp, &hdr_loc) == TS_SUCCESS) {
+      if (metalink_response(txnp, bufp, hdr_loc)) {
+        metalink_transform_add(txnp);
+      }
+
+      TSHandleMLocRelease(bufp, TS_NULL_MLOC, hdr_loc);
+    }
+
+    break;
+
+  default:
+    TSAssert(!"Unexpected event");
+  }
+
+  TSHttpTxnReenable(txnp, TS_EVENT_HTTP_CONTINUE);
+
+  return 0;
+}
+
+/* Only responses that a redirect could ever be rewritten to are worth
+ * the transform, the message digest and the cache write.  Most
+ * responses are small pages, errors, 304 Not Modified, and so on, so
+ * decide before any content arrives.  Rewritten URLs must be cached,
+ * so skip anything the cache won't store. */
+
+static int
+admit_response(TSMBuffer bufp, TSMLoc hdr_loc)
+{
+  const char *value;
+  int length;
+
+  /* Status code */
+  int status = TSHttpHdrStatusGet(bufp, hdr_loc);
+  if (status < 0 || status >= (int) sizeof(admit_status) || !admit_status[status]) {
+    return 0;
+  }
+
+  /* Content-Length, if it's known (the response might be chunked) */
+  TSMLoc field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, TS_MIME_FIELD_CONTENT_LENGTH, TS_MIME_LEN_CONTENT_LENGTH);
+  if (field_loc) {
+    int64_t content_length = TSMimeHdrFieldValueInt64Get(bufp, hdr_loc, field_loc, 0);
+
+    TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+
+    if (content_length < admit_min_length || content_length > admit_max_length) {
+      return 0;
+    }
+  }
+
+  /* Content-Type */
+  if (admit_ntypes) {
+    field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, TS_MIME_FIELD_CONTENT_TYPE, TS_MIME_LEN_CONTENT_TYPE);
+    if (!field_loc) {
+      return 0;
+    }
+
+    /* No allocation, freed with bufp? */
+    value = TSMimeHdrFieldValueStringGet(bufp, hdr_loc, field_loc, -1, &length);
+
+    int i;
+    for (i = 0; i < admit_ntypes; i += 1) {
+      int n = strlen(admit_types[i]);
+      if (length >= n && !strncasecmp(value, admit_types[i], n)) {
+        break;
+      }
+    }
+
+    TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+
+    if (i == admit_ntypes) {
+      return 0;
+    }
+  }
+
+  /* Cacheable: Cache-Control: no-store or private */
+  field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, TS_MIME_FIELD_CACHE_CONTROL, TS_MIME_LEN_CACHE_CONTROL);
+  while (field_loc) {
+
+    int count = TSMimeHdrFieldValuesCount(bufp, hdr_loc, field_loc);
+    for (int idx = 0; idx < count; idx += 1) {
+
+      /* No allocation, freed with bufp? */
+      value = TSMimeHdrFieldValueStringGet(bufp, hdr_loc, field_loc, idx, &length);
+      if ((length >= TS_HTTP_LEN_NO_STORE && !strncasecmp(value, TS_HTTP_VALUE_NO_STORE, TS_HTTP_LEN_NO_STORE))
+          || (length >= TS_HTTP_LEN_PRIVATE && !strncasecmp(value, TS_HTTP_VALUE_PRIVATE, TS_HTTP_LEN_PRIVATE))) {
+        TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+
+        return 0;
+      }
+    }
+
+    TSMLoc next_loc = TSMimeHdrFieldNextDup(bufp, hdr_loc, field_loc);
+
+    TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+
+    field_loc = next_loc;
+  }
+
+  return 1;
+}
+
+static int
+admit(TSHttpTxn txnp)
+{
+  TSMBuffer bufp;
+  TSMLoc hdr_loc;
+
+  if (!request_get(txnp)) {
+    return 0;
+  }
+
+  if (TSHttpTxnServerRespGet(txnp, &bufp, &hdr_loc) != TS_SUCCESS) {
+    TSError("Couldn't retrieve server response header");
+
+    return 0;
+  }
+
+  /* Metalink documents are rewritten instead */
+  int admitted = admit_response(bufp, hdr_loc) && !(metalink_contp && metalink_response(txnp, bufp, hdr_loc));
+
+  TSHandleMLocRelease(bufp, TS_NULL_MLOC, hdr_loc);
+
+  return admitted;
+}
+
+/* Decode the digests in a Digest header.  It can list several
+ * [RFC 3230].  Return the bit set of the algorithms it has. */
+
+static unsigned int
+digest_header_parse(TSMBuffer bufp, TSMLoc hdr_loc, unsigned char digests[DIGEST_NALGS][DIGEST_MAX_LENGTH])
+{
+  const char *value;
+  int length;
+
+  char digest[DIGEST_MAX_LENGTH + 3]; /* ATS_BASE64_DECODE_DSTLEN() */
+
+  unsigned int algs = 0;
+
+  TSMLoc digest_loc = TSMimeHdrFieldFind(bufp, hdr_loc, "Digest", 6);
+  while (digest_loc) {
+
+    int count = TSMimeHdrFieldValuesCount(bufp, hdr_loc, digest_loc);
+    for (int idx = 0; idx < count; idx += 1) {
+
+      /* No allocation, freed with bufp? */
+      value = TSMimeHdrFieldValueStringGet(bufp, hdr_loc, digest_loc, idx, &length);
+
+      const char *equals = (const char *) memchr(value, '=', length);
+      if (!equals) {
+        continue;
+      }
+
+      int alg = digest_algorithm_get(value, equals - value);
+      if (alg == -1) {
+        continue;
+      }
+
+      /* Base64 */
+      int encoded_length = length - (equals + 1 - value);
+
+      size_t decoded_length;
+      if (encoded_length != (digest_algorithms[alg].length + 2) / 3 * 4
+          || TSBase64Decode(equals + 1, encoded_length, (unsigned char *) digest, sizeof(digest), &decoded_length) != TS_SUCCESS
+          || (int) decoded_length != digest_algorithms[alg].length) {
+        continue;
+      }
+
+      algs |= 1 << alg;
+      memcpy(digests[alg], digest, digest_algorithms[alg].length);
+    }
+
+    TSMLoc next_loc = TSMimeHdrFieldNextDup(bufp, hdr_loc, digest_loc);
+
+    TSHandleMLocRelease(bufp, hdr_loc, digest_loc);
+
+    digest_loc = next_loc;
+  }
+
+  return algs;
+}
+
+/* Is the response from one of the trusted parents?  Only the address
+ * is compared, not the port. */
+
+static int
+digest_trusted(TSHttpTxn txnp)
+{
+  const struct sockaddr *addrp = TSHttpTxnServerAddrGet(txnp);
+  if (!addrp) {
+    return 0;
+  }
+
+  for (int i = 0; i < ntrusted_addrs; i += 1) {
+    const struct sockaddr *trusted_addrp = (const struct sockaddr *) &trusted_addrs[i];
+
+    if (addrp->sa_family != trusted_addrp->sa_family) {
+      continue;
+    }
+
+    if (addrp->sa_family == AF_INET
+        && ((const struct sockaddr_in *) addrp)->sin_addr.s_addr == ((const struct sockaddr_in *) trusted_addrp)->sin_addr.s_addr) {
+      return 1;
+    }
+
+    if (addrp->sa_family == AF_INET6
+        && !memcmp(&((const struct sockaddr_in6 *) addrp)->sin6_addr, &((const struct sockaddr_in6 *) trusted_addrp)->sin6_addr, sizeof(struct in6_addr))) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* With --trust-digest, take the digests from the Digest header of a
+ * response from a trusted parent, if it has all the ones we compute */
+
+static void
+digest_trust(TSHttpTxn txnp, TransformData *data)
+{
+  TSMBuffer bufp;
+  TSMLoc hdr_loc;
+
+  data->trusted_algs = 0;
+
+  if (!ntrusted_addrs || !digest_trusted(txnp) || TSHttpTxnServerRespGet(txnp, &bufp, &hdr_loc) != TS_SUCCESS) {
+    return;
+  }
+
+  if ((digest_header_parse(bufp, hdr_loc, data->trusted) & digest_algs) == digest_algs) {
+    data->trusted_algs = digest_algs;
+
+    stat_increment(STAT_TRANSFORM_TRUSTED, 1);
+  }
+
+  TSHandleMLocRelease(bufp, TS_NULL_MLOC, hdr_loc);
+}
+
+/* Compute the SHA-256 digest of the content, write it to the cache
+ * and store the request URL at that key */
+
+static int
+http_read_response_hdr(TSCont /* contp ATS_UNUSED */, void *edata)
+{
+  TSHttpTxn txnp = (TSHttpTxn) edata;
+
+  if (!admit(txnp)) {
+    stat_increment(STAT_TRANSFORM_NOT_ADMITTED, 1);
+
+    TSHttpTxnReenable(txnp, TS_EVENT_HTTP_CONTINUE);
+
+    return 0;
+  }
+
+  stat_increment(STAT_TRANSFORM_ADMITTED, 1);
+
+  TransformData *data = (TransformData *) freelist_alloc(&transform_freelist, STAT_LIVE_TRANSFORM, sizeof(TransformData));
+  data->txnp = txnp;
+
+  data->trace = trace_start("transform");
+
+  /* Can't initialize data here because we can't call TSVConnWrite()
+   * before TS_HTTP_RESPONSE_TRANSFORM_HOOK */
+  data->output_bufp = NULL;
+  data->hash_data = NULL;
+
+  data->validator_length = 0;
+
+  TSMBuffer bufp;
+  TSMLoc hdr_loc;
+
+  if (TSHttpTxnServerRespGet(txnp, &bufp, &hdr_loc) == TS_SUCCESS) {
+    data->validator_length = validator_get(bufp, hdr_loc, data->validator);
+
+    TSHandleMLocRelease(bufp, TS_NULL_MLOC, hdr_loc);
+  }
+
+  digest_trust(txnp, data);
+  fill_start(txnp, data);
+
+  TSVConn connp = TSTransformCreate(transform_handler, data->txnp);
+  TSContDataSet(connp, data);
+
+  TSHttpTxnHookAdd(data->txnp, TS_HTTP_RESPONSE_TRANSFORM_HOOK, connp);
+
+  /* The transformation doesn't change the content, so there's no need
+   * to put it between the origin and the cache.  Tap the content on
+   * its way to the client instead: The cache is written straight from
+   * the origin, exactly like it is without the plugin, so other clients
+   * can read the object while it's written and ranges are served from
+   * the cache as usual.  (TSIOBufferCopy() already only clones the
+   * buffer blocks, the transformation never copies the bytes.) */
+  if (tap) {
+    TSHttpTxnUntransformedRespCache(data->txnp, 1);
+    TSHttpTxnTransformedRespCache(data->txnp, 0);
+  }
+
+  TSHttpTxnReenable(data->txnp, TS_EVENT_HTTP_CONTINUE);
+
+  return 0;
+}
+
+/* Implement TS_HTTP_SEND_RESPONSE_HDR_HOOK to check the Location and
+ * Digest headers */
+
+/* Serve mode: Follow the rewritten Location URL inside the proxy.  It's
+ * cached, so the client gets the content in the same transaction.  The
+ * Location header is still rewritten, in case the proxy doesn't follow
+ * it, e.g. proxy.config.http.number_of_redirections is zero. */
+
+static void
+serve_redirect(TSHttpTxn txnp, const char *value, int length)
+{
+  if (!serve) {
+    return;
+  }
+
+  /* The transaction takes ownership */
+  TSHttpTxnRedirectUrlSet(txnp, TSstrndup(value, length), length);
+  TSHttpTxnArgSet(txnp, serve_arg, (void *) 1);
+
+  stat_increment(STAT_SEND_SERVED, 1);
+}
+
+/* What the lookups depend on: The digest, the Location URL and the
+ * Link headers */
+
+static void
+coalesce_key_get(SendData *data, char *key)
+{
+  const char *value;
+  int length;
+
+  Sha256Context c;
+
+  sha256_kernel->init(&c);
+
+  unsigned char alg = data->alg;
+  sha256_kernel->update(&c, &alg, 1);
+  sha256_kernel->update(&c, data->digest, digest_algorithms[data->alg].length);
+
+  /* No allocation, freed with data->resp_bufp? */
+  value = TSMimeHdrFieldValueStringGet(data->resp_bufp, data->hdr_loc, data->location_loc, -1, &length);
+  sha256_kernel->update(&c, value, length);
+
+  if (duplicates_max) {
+    TSMLoc link_loc = TSMimeHdrFieldFind(data->resp_bufp, data->hdr_loc, "Link", 4);
+    while (link_loc) {
+
+      /* Separate the values, so they can't run together */
+      value = TSMimeHdrFieldValueStringGet(data->resp_bufp, data->hdr_loc, link_loc, -1, &length);
+      sha256_kernel->update(&c, "\n", 1);
+      sha256_kernel->update(&c, value, length);
+
+      TSMLoc next_loc = TSMimeHdrFieldNextDup(data->resp_bufp, data->hdr_loc, link_loc);
+
+      TSHandleMLocRelease(data->resp_bufp, data->hdr_loc, link_loc);
+
+      link_loc = next_loc;
+    }
+  }
+
+  sha256_kernel->final((unsigned char *) key, &c);
+}
+
+/* Answer a transaction like the one it was coalesced with, then
+ * reenable the response.  The header handles are released. */
+
+static void
+coalesce_apply(TSHttpTxn txnp, TSMBuffer resp_bufp, TSMLoc hdr_loc, TSMLoc location_loc, const char *value, int length, int cached)
+{
+  if (length) {
+    TSMimeHdrFieldValuesClear(resp_bufp, hdr_loc, location_loc);
+    TSMimeHdrFieldValueStringInsert(resp_bufp, hdr_loc, location_loc, -1, value, length);
+
+    if (cached) {
+      serve_redirect(txnp, value, length);
+    }
+  }
+
+  TSHandleMLocRelease(resp_bufp, hdr_loc, location_loc);
+  TSHandleMLocRelease(resp_bufp, TS_NULL_MLOC, hdr_loc);
+
+  TSHttpTxnReenable(txnp, TS_EVENT_HTTP_CONTINUE);
+}
+
+/* Return nonzero if the transaction was answered from a remembered
+ * answer, or is waiting for identical lookups already in flight.
+ * Either way the data is freed.  Otherwise these lookups are
+ * registered for others to wait for. */
+
+static int
+coalesce_join(SendData *data)
+{
+  char key[32];
+  coalesce_key_get(data, key);
+
+  /* Allocation!  Must free! */
+  int length;
+  char *value = index_lookup(&coalesce_index, DIGEST_SHA256, key, TShrtime() - coalesce_ttl, &length);
+  if (value) {
+    stat_increment(STAT_SEND_MEMO_HIT, 1);
+    trace_event(data->trace, "coalesce", "remembered");
+
+    coalesce_apply(data->txnp, data->resp_bufp, data->hdr_loc, data->location_loc, value + 1, length - 1, value[0] == '1');
+
+    latency_record(LATENCY_HOLD, data->start);
+
+    TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->url_loc);
+
+    TSfree(value);
+
+  } else {
+    unsigned int hash;
+    memcpy(&hash, key, sizeof(hash));
+
+    FlightShard *shardp = &flight_shards[hash % INDEX_SHARDS];
+
+    TSMutexLock(shardp->mutexp);
+
+    Flight *flightp;
+    for (flightp = shardp->flights; flightp && memcmp(flightp->key, key, sizeof(key)); flightp = flightp->next) {
+    }
+
+    /* First: Others wait for these lookups */
+    if (!flightp) {
+      flightp = (Flight *) TSmalloc(sizeof(Flight));
+
+      memcpy(flightp->key, key, sizeof(key));
+      flightp->waiters = NULL;
+
+      flightp->next = shardp->flights;
+      shardp->flights = flightp;
+
+      TSMutexUnlock(shardp->mutexp);
+
+      data->flight = flightp;
+
+      return 0;
+    }
+
+    /* The response can be reenabled as soon as the lock is released,
+     * so be done with the URL handle first */
+    TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->url_loc);
+
+    Waiter *waiterp = (Waiter *) TSmalloc(sizeof(Waiter));
+
+    waiterp->txnp = data->txnp;
+    waiterp->resp_bufp = data->resp_bufp;
+    waiterp->hdr_loc = data->hdr_loc;
+    waiterp->location_loc = data->location_loc;
+    waiterp->start = data->start;
+
+    waiterp->next = flightp->waiters;
+    flightp->waiters = waiterp;
+
+    TSMutexUnlock(shardp->mutexp);
+
+    stat_increment(STAT_SEND_COALESCED, 1);
+    trace_event(data->trace, "coalesce", "waiting");
+  }
+
+  trace_end(data->trace);
+
+  if (data->index_value) {
+    TSfree(data->index_value);
+  }
+
+  TSCacheKeyDestroy(data->key);
+
+  freelist_free(&send_freelist, STAT_LIVE_SEND, data);
+
+  return 1;
+}
+
+/* The lookups are finished: Remember the answer and give it to
+ * everyone waiting for it.  Call before the response is reenabled. */
+
+static void
+coalesce_done(SendData *data, const char *value, int length, int cached)
+{
+  Flight *flightp = data->flight;
+  if (!flightp) {
+    return;
+  }
+
+  data->flight = NULL;
+
+  /* Remember it before the flight is gone, so the next transaction
+   * finds one or the other */
+  if (coalesce_index.nsets) {
+    char *remembered = (char *) TSmalloc(length + 1);
+
+    remembered[0] = cached ? '1' : '0';
+    if (length) {
+      memcpy(remembered + 1, value, length);
+    }
+
+    index_set(&coalesce_index, DIGEST_SHA256, flightp->key, remembered, length + 1, TShrtime());
+
+    TSfree(remembered);
+  }
+
+  unsigned int hash;
+  memcpy(&hash, flightp->key, sizeof(hash));
+
+  FlightShard *shardp = &flight_shards[hash % INDEX_SHARDS];
+
+  TSMutexLock(shardp->mutexp);
+
+  Flight **flightpp;
+  for (flightpp = &shardp->flights; *flightpp != flightp; flightpp = &(*flightpp)->next) {
+  }
+
+  *flightpp = flightp->next;
+
+  TSMutexUnlock(shardp->mutexp);
+
+  /* No one else can find them any more */
+  for (Waiter *waiterp = flightp->waiters; waiterp;) {
+    Waiter *next = waiterp->next;
+
+    coalesce_apply(waiterp->txnp, waiterp->resp_bufp, waiterp->hdr_loc, waiterp->location_loc, value, length, cached);
+
+    latency_record(LATENCY_HOLD, waiterp->start);
+
+    TSfree(waiterp);
+
+    waiterp = next;
+  }
+
+  TSfree(flightp);
+}
+
+/* Check if the Location URL is already cached and look up the record
+ * at the digest at the same time, rather than one after the other.
+ * Each lookup records its answer and calls lookup_decide(), which
+ * reenables the response as soon as the answer is known:
+ *
+ *    Location URL cached
+ *                  Do nothing.  Don't wait for the digest lookup,
+ *                  it's abandoned.  (A cache read can't be canceled,
+ *                  so it still runs to completion, but it doesn't
+ *                  touch the response again.)
+ *
+ *    Location URL not cached
+ *                  Wait for the digest lookup.  Rewrite the Location
+ *                  header with the most recently seen candidate from
+ *                  the record that's cached.
+ *
+ * All of a transaction's continuations share the mutex of data->contp
+ * so the lookups never run at the same time.  The data is reference
+ * counted: one reference for each lookup in flight, plus one for
+ * whoever is starting them.  The last one frees it. */
+
+static void
+lookup_decide(SendData *data)
+{
+  const char *value;
+  int64_t length;
+
+  char *fill_value = NULL;
+  int fill_length;
+
+  char *peer_value = NULL;
+  int peer_length;
+
+  /* Already reenabled, don't touch the response */
+  if (data->done) {
+    return;
+  }
+
+  /* After the deadline, whatever we don't know yet isn't cached */
+  int location_cached = data->location_cached == -1 && data->timed_out ? 0 : data->location_cached;
+  int digest_read = data->digest_read == -1 && data->timed_out ? 0 : data->digest_read;
+
+  value = NULL;
+  length = 0;
+
+  switch (location_cached) {
+
+  /* Yes: Do nothing, just reenable the response */
+  case 1:
+    stat_increment(STAT_SEND_LOCATION_CACHED, 1);
+
+    break;
+
+  /* No: Rewrite the Location header with the cached duplicate with the
+   * highest priority, otherwise with the most recently seen candidate
+   * from the record at the digest that's cached */
+  case 0:
+    for (int i = 0; i < data->nduplicates; i += 1) {
+      int cached = data->duplicates[i].cached == -1 && data->timed_out ? 0 : data->duplicates[i].cached;
+
+      /* Wait for it, it's preferred over the rest */
+      if (cached == -1) {
+        return;
+      }
+
+      if (cached) {
+        value = data->duplicates[i].value;
+        length = data->duplicates[i].length;
+
+        stat_increment(STAT_SEND_REWRITTEN_DUPLICATE, 1);
+
+        break;
+      }
+    }
+
+    if (value) {
+      break;
+    }
+
+    if (digest_read == -1) {
+      return;
+    }
+
+    for (int i = 0; i < data->ncandidates; i += 1) {
+      int cached = data->candidates[i].cached == -1 && data->timed_out ? 0 : data->candidates[i].cached;
+
+      if (cached == -1) {
+        return;
+      }
+
+      if (cached) {
+        value = data->candidates[i].value;
+        length = data->candidates[i].length;
+
+        /* Remember the URL so next time the cache reads can be
+         * skipped */
+        index_insert(&digest_index, data->alg, data->digest, value, length);
+
+        stat_increment(STAT_SEND_REWRITTEN_CANDIDATE, 1);
+
+        break;
+      }
+    }
+
+    if (value) {
+      break;
+    }
+
+    /* Nothing's cached here.  If a peer has it cached, send the client
+     * there. */
+    if (peer_index.nsets) {
+
+      /* Allocation!  Must free! */
+      peer_value = index_lookup(&peer_index, data->alg, data->digest, TShrtime() - peer_timeout, &peer_length);
+
+      /* No allocation, freed with data->resp_bufp? */
+      int location_length;
+      const char *location = TSMimeHdrFieldValueStringGet(data->resp_bufp, data->hdr_loc, data->location_loc, -1, &location_length);
+
+      if (peer_value && !(peer_length == location_length && !memcmp(peer_value, location, location_length))) {
+        value = peer_value;
+        length = peer_length;
+
+        stat_increment(STAT_SEND_REWRITTEN_PEER, 1);
+
+        break;
+      }
+    }
+
+    /* If the same content is already being filled from another
+     * mirror, send the client there to read it while it's written.
+     * Otherwise remember which digest the Location URL should have,
+     * in case the client fills it from there. */
+    if (fill_index.nsets) {
+
+      /* Allocation!  Must free! */
+      fill_value = index_lookup(&fill_index, data->alg, data->digest, TShrtime() - fill_timeout, &fill_length);
+
+      /* No allocation, freed with data->resp_bufp? */
+      int location_length;
+      const char *location = TSMimeHdrFieldValueStringGet(data->resp_bufp, data->hdr_loc, data->location_loc, -1, &location_length);
+
+      if (fill_value && !(fill_length == location_length && !memcmp(fill_value, location, location_length))) {
+        value = fill_value;
+        length = fill_length;
+
+        stat_increment(STAT_SEND_REWRITTEN_FILL, 1);
+
+        break;
+      }
+
+      if (!fill_value) {
+        fill_expect(data->alg, data->digest, location, location_length);
+      }
+    }
+
+    stat_increment(STAT_SEND_NOT_REWRITTEN, 1);
+
+    break;
+
+  /* Don't know yet */
+  default:
+    return;
+  }
+
+  if (value) {
+    TSMimeHdrFieldValuesClear(data->resp_bufp, data->hdr_loc, data->location_loc);
+    TSMimeHdrFieldValueStringInsert(data->resp_bufp, data->hdr_loc, data->location_loc, -1, value, length);
+
+    /* A fill isn't cached yet, and a peer's isn't cached here */
+    if (value != fill_value && value != peer_value) {
+      serve_redirect(data->txnp, value, length);
+    }
+  }
+
+  trace_event(data->trace, "decide", value ? (value == fill_value ? "fill" : value == peer_value ? "peer" : "rewritten") : "kept");
+
+  coalesce_done(data, value, length, value && value != fill_value && value != peer_value);
+
+  if (fill_value) {
+    TSfree(fill_value);
+  }
+
+  if (peer_value) {
+    TSfree(peer_value);
+  }
+
+  data->done = 1;
+
+  /* Don't wait for the deadline any longer */
+  if (data->timeout_actionp) {
+    TSActionCancel(data->timeout_actionp);
+    data->timeout_actionp = NULL;
+
+    TSContDestroy(data->timeout_contp);
+    data->timeout_contp = NULL;
+
+    __sync_sub_and_fetch(&data->refcount, 1);
+  }
+
+  TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->url_loc);
+  TSHandleMLocRelease(data->resp_bufp, data->hdr_loc, data->location_loc);
+  TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->hdr_loc);
+
+  latency_record(LATENCY_HOLD, data->start);
+
+  TSHttpTxnReenable(data->txnp, TS_EVENT_HTTP_CONTINUE);
+}
+
+static void
+lookup_unref(SendData *data)
+{
+  if (__sync_sub_and_fetch(&data->refcount, 1)) {
+    return;
+  }
+
+  TSContDestroy(data->contp);
+
+  trace_end(data->trace);
+
+  TSCacheKeyDestroy(data->key);
+  TSCacheKeyDestroy(data->digest_key);
+
+  if (data->cache_bufp) {
+    TSIOBufferDestroy(data->cache_bufp);
+  }
+
+  for (int i = 0; i < data->ncandidates; i += 1) {
+    TSCacheKeyDestroy(data->candidates[i].key);
+    TSfree(data->candidates[i].value);
+  }
+
+  if (data->candidates) {
+    TSfree(data->candidates);
+  }
+
+  for (int i = 0; i < data->nduplicates; i += 1) {
+    TSCacheKeyDestroy(data->duplicates[i].key);
+    TSfree(data->duplicates[i].value);
+  }
+
+  if (data->duplicates) {
+    TSfree(data->duplicates);
+  }
+
+  freelist_free(&send_freelist, STAT_LIVE_SEND, data);
+}
+
+/* TSCacheRead() handler: Check if a duplicate or a candidate is
+ * cached */
+
+static int
+candidate_handler(TSCont contp, TSEvent event, void *edata)
+{
+  Candidate *candidate = (Candidate *) TSContDataGet(contp);
+  TSContDestroy(contp);
+
+  SendData *data = candidate->data;
+
+  switch (event) {
+  case TS_EVENT_CACHE_OPEN_READ:
+    TSVConnClose((TSVConn) edata);
+
+    candidate->cached = 1;
+
+    break;
+
+  case TS_EVENT_CACHE_OPEN_READ_FAILED:
+    candidate->cached = 0;
+
+    break;
+
+  default:
+    TSAssert(!"Unexpected event");
+  }
+
+  int duplicate = candidate >= data->duplicates && candidate < data->duplicates + data->nduplicates;
+  trace_event(data->trace, duplicate ? "duplicate" : "candidate", candidate->cached ? "cached" : "miss");
+
+  lookup_decide(data);
+  lookup_unref(data);
+
+  return 0;
+}
+
+/* Check if the candidates are cached, all at the same time.  Call with
+ * the lock held and a reference. */
+
+static void
+candidates_check(SendData *data, Candidate *candidates, int n)
+{
+  for (int i = 0; i < n; i += 1) {
+    __sync_add_and_fetch(&data->refcount, 1);
+
+    TSCont contp = TSContCreate(candidate_handler, TSContMutexGet(data->contp));
+    TSContDataSet(contp, &candidates[i]);
+
+    /* Reentrant! */
+    TSCacheRead(contp, candidates[i].key);
+  }
+}
+
+/* Read the record at the digest */
+
+static int
+cache_open_read(TSCont contp, void *edata)
+{
+  SendData *data = (SendData *) TSContDataGet(contp);
+  data->connp = (TSVConn) edata;
+
+  /* Learn about records written before the proxy started */
+  filter_insert(&digest_filter, data->alg, data->digest);
+
+  /* Abandoned */
+  if (data->done) {
+    TSContDestroy(contp);
+
+    TSVConnClose(data->connp);
+
+    lookup_unref(data);
+
+    return 0;
+  }
+
+  data->cache_bufp = TSIOBufferCreate();
+  data->cache_readerp = TSIOBufferReaderAlloc(data->cache_bufp);
+
+  /* Reentrant!  Reuse the TSCacheRead() continuation. */
+  data->cache_viop = TSVConnRead(data->connp, contp, data->cache_bufp, INT64_MAX);
+
+  return 0;
+}
+
+/* No record at the digest */
+
+static int
+cache_open_read_failed(TSCont contp, void */* edata ATS_UNUSED */)
+{
+  SendData *data = (SendData *) TSContDataGet(contp);
+  TSContDestroy(contp);
+
+  latency_record(LATENCY_RECORD, data->record_start);
+  stat_increment(STAT_SEND_RECORD_MISSING, 1);
+
+  trace_event(data->trace, "record", "missing");
+
+  data->digest_read = 0;
+
+  lookup_decide(data);
+  lookup_unref(data);
+
+  return 0;
+}
+
+/* Read the record at the digest, then check if its candidates are
+ * cached.  They're all checked at the same time, the most recently
+ * seen one that's cached wins. */
+
+static int
+vconn_read_ready(TSCont contp, TSEvent event)
+{
+  const char *value;
+  int64_t length;
+
+  SendData *data = (SendData *) TSContDataGet(contp);
+
+  /* Abandoned: The URL handle was already released */
+  if (data->done) {
+    TSContDestroy(contp);
+
+    TSVConnClose(data->connp);
+
+    lookup_unref(data);
+
+    return 0;
+  }
+
+  /* Allocation!  Must free! */
+  char *record = record_gather(data->connp, data->cache_readerp, event == TS_EVENT_VCONN_READ_COMPLETE, &length);
+  if (!record) {
+    TSVIOReenable(data->cache_viop);
+
+    return 0;
+  }
+
+  latency_record(LATENCY_RECORD, data->record_start);
+
+  trace_event(data->trace, "record", "found");
+
+  /* The last lookup_unref() will clean up the TSVConnRead() buffer so
+   * be sure to close this virtual connection or
+   * CacheVC::openReadMain() will continue operating on it! */
+  TSVConnClose(data->connp);
+
+  TSContDestroy(contp);
+
+  RecordCandidate *candidates = (RecordCandidate *) TSmalloc(sizeof(RecordCandidate) * record_candidates);
+  int n = record_parse(record, length, candidates, record_candidates);
+
+  /* Most recently seen first.  They're written in that order, but
+   * don't count on it. */
+  for (int i = 1; i < n; i += 1) {
+    RecordCandidate candidate = candidates[i];
+
+    int j;
+    for (j = i; j && candidates[j - 1].seen < candidate.seen; j -= 1) {
+      candidates[j] = candidates[j - 1];
+    }
+
+    candidates[j] = candidate;
+  }
+
+  data->candidates = (Candidate *) TSmalloc(sizeof(Candidate) * record_candidates);
+  data->ncandidates = 0;
+
+  /* Skip any we can't parse or lookup */
+  for (int i = 0; i < n; i += 1) {
+    Candidate *candidate = &data->candidates[data->ncandidates];
+
+    /* The start pointer is both an input and an output parameter.
+     * After a successful parse the start pointer equals the end
+     * pointer. */
+    value = candidates[i].value;
+    if (TSUrlParse(data->resp_bufp, data->url_loc, &value, candidates[i].value + candidates[i].length) != TS_PARSE_DONE) {
+      continue;
+    }
+
+    candidate->key = TSCacheKeyCreate();
+    if (TSCacheKeyDigestFromUrlSet(candidate->key, data->url_loc) != TS_SUCCESS) {
+      TSCacheKeyDestroy(candidate->key);
+
+      continue;
+    }
+
+    candidate->data = data;
+
+    candidate->value = TSstrndup(candidates[i].value, candidates[i].length);
+    candidate->length = candidates[i].length;
+
+    candidate->pri = i;
+    candidate->cached = -1;
+
+    data->ncandidates += 1;
+  }
+
+  TSfree(candidates);
+  TSfree(record);
+
+  data->digest_read = 1;
+
+  /* Reentrant!  (Particularly in case of a cache miss.) */
+  candidates_check(data, data->candidates, data->ncandidates);
+
+  lookup_decide(data);
+  lookup_unref(data);
+
+  return 0;
+}
+
+/* TSCacheRead() and TSVConnRead() handler: Check if the digest
+ * already exists in the cache */
+
+static int
+digest_handler(TSCont contp, TSEvent event, void *edata)
+{
+  switch (event) {
+
+  /* Yes: Read the record at that key */
+  case TS_EVENT_CACHE_OPEN_READ:
+    return cache_open_read(contp, edata);
+
+  /* No: Do nothing */
+  case TS_EVENT_CACHE_OPEN_READ_FAILED:
+    return cache_open_read_failed(contp, edata);
+
+  case TS_EVENT_VCONN_READ_READY:
+  case TS_EVENT_VCONN_READ_COMPLETE:
+    return vconn_read_ready(contp, event);
+
+  default:
+    TSAssert(!"Unexpected event");
+  }
+
+  return 0;
+}
+
+/* TSCacheRead() handler: Check if the Location URL is already cached.
+ * This is data->contp, so don't destroy it here. */
+
+static int
+location_handler(TSCont contp, TSEvent event, void *edata)
+{
+  SendData *data = (SendData *) TSContDataGet(contp);
+
+  latency_record(LATENCY_LOCATION, data->location_start);
+
+  switch (event) {
+
+  /* Yes: Do nothing */
+  case TS_EVENT_CACHE_OPEN_READ:
+    TSVConnClose((TSVConn) edata);
+
+    data->location_cached = 1;
+
+    break;
+
+  /* No: Rewrite it if a candidate from the record at the digest is
+   * cached */
+  case TS_EVENT_CACHE_OPEN_READ_FAILED:
+    data->location_cached = 0;
+
+    break;
+
+  default:
+    TSAssert(!"Unexpected event");
+  }
+
+  trace_event(data->trace, "location", data->location_cached ? "cached" : "miss");
+
+  lookup_decide(data);
+  lookup_unref(data);
+
+  return 0;
+}
+
+/* TSContSchedule() handler: Stop waiting for the lookups */
+
+static int
+timeout_handler(TSCont contp, TSEvent /* event ATS_UNUSED */, void */* edata ATS_UNUSED */)
+{
+  SendData *data = (SendData *) TSContDataGet(contp);
+  TSContDestroy(contp);
+
+  data->timeout_contp = NULL;
+  data->timeout_actionp = NULL;
+  data->timed_out = 1;
+
+  stat_increment(STAT_SEND_TIMEOUTS, 1);
+  trace_event(data->trace, "timeout", "fired");
+
+  lookup_decide(data);
+  lookup_unref(data);
+
+  return 0;
+}
+
+/* Parse a Link header field value, e.g.
+ *
+ *    <http://example.com/file>; rel=duplicate; pri=1
+ *
+ * Return nonzero if it's a duplicate.  Priorities default to 999999,
+ * the lowest [RFC 6249]. */
+
+static int
+link_parse(const char *value, int length, const char **url, int *url_length, int *pri)
+{
+  const char *end = value + length;
+
+  int duplicate = 0;
+  *pri = 999999;
+
+  while (value < end && (*value == ' ' || *value == '\t')) {
+    value += 1;
+  }
+
+  if (value == end || *value != '<') {
+    return 0;
+  }
+
+  *url = value + 1;
+
+  value = (const char *) memchr(value, '>', end - value);
+  if (!value) {
+    return 0;
+  }
+
+  *url_length = value - *url;
+
+  /* Parameters */
+  for (value = (const char *) memchr(value, ';', end - value); value; value = (const char *) memchr(value, ';', end - value)) {
+    value += 1;
+
+    while (value < end && (*value == ' ' || *value == '\t')) {
+      value += 1;
+    }
+
+    const char *name = value;
+    while (value < end && *value != '=' && *value != ';') {
+      value += 1;
+    }
+
+    int name_length = value - name;
+    while (name_length && (name[name_length - 1] == ' ' || name[name_length - 1] == '\t')) {
+      name_length -= 1;
+    }
+
+    if (value == end || *value != '=') {
+      continue;
+    }
+
+    value += 1;
+
+    while (value < end && (*value == ' ' || *value == '\t')) {
+      value += 1;
+    }
+
+    /* Quoted or not */
+    const char *param;
+    int param_length;
+
+    if (value < end && *value == '"') {
+      param = value + 1;
+
+      value = (const char *) memchr(param, '"', end - param);
+      if (!value) {
+        return 0;
+      }
+
+      param_length = value - param;
+
+    } else {
+      param = value;
+      while (value < end && *value != ';') {
+        value += 1;
+      }
+
+      param_length = value - param;
+      while (param_length && (param[param_length - 1] == ' ' || param[param_length - 1] == '\t')) {
+        param_length -= 1;
+      }
+    }
+
+    /* rel is a space separated list of relation types */
+    if (name_length == 3 && !strncasecmp(name, "rel", 3)) {
+      for (int i = 0; i + 9 <= param_length; i += 1) {
+        if ((!i || param[i - 1] == ' ') && !strncasecmp(param + i, "duplicate", 9) && (i + 9 == param_length || param[i + 9] == ' ')) {
+          duplicate = 1;
+        }
+      }
+
+    } else if (name_length == 3 && !strncasecmp(name, "pri", 3)) {
+      *pri = atoi(param);
+    }
+
+    if (value == end) {
+      break;
+    }
+  }
+
+  return duplicate;
+}
+
+/* Parse the duplicates from the Link headers, in order of priority.
+ * Skip any we can't parse or lookup. */
+
+static void
+duplicates_parse(SendData *data)
+{
+  const char *value;
+  int length;
+
+  const char *url;
+  int url_length;
+  int pri;
+
+  data->duplicates = NULL;
+  data->nduplicates = 0;
+
+  if (!duplicates_max) {
+    return;
+  }
+
+  TSMLoc link_loc = TSMimeHdrFieldFind(data->resp_bufp, data->hdr_loc, "Link", 4);
+  while (link_loc) {
+
+    int count = TSMimeHdrFieldValuesCount(data->resp_bufp, data->hdr_loc, link_loc);
+    for (int idx = 0; idx < count; idx += 1) {
+
+      /* No allocation, freed with data->resp_bufp? */
+      value = TSMimeHdrFieldValueStringGet(data->resp_bufp, data->hdr_loc, link_loc, idx, &length);
+      if (!link_parse(value, length, &url, &url_length, &pri)) {
+        continue;
+      }
+
+      /* Keep the ones with the highest priority */
+      if (data->nduplicates == duplicates_max && pri >= data->duplicates[data->nduplicates - 1].pri) {
+        continue;
+      }
+
+      value = url;
+      if (TSUrlParse(data->resp_bufp, data->url_loc, &value, url + url_length) != TS_PARSE_DONE) {
+        continue;
+      }
+
+      TSCacheKey key = TSCacheKeyCreate();
+      if (TSCacheKeyDigestFromUrlSet(key, data->url_loc) != TS_SUCCESS) {
+        TSCacheKeyDestroy(key);
+
+        continue;
+      }
+
+      if (!data->duplicates) {
+        data->duplicates = (Candidate *) TSmalloc(sizeof(Candidate) * duplicates_max);
+      }
+
+      /* Drop the one with the lowest priority */
+      if (data->nduplicates == duplicates_max) {
+        data->nduplicates -= 1;
+
+        TSCacheKeyDestroy(data->duplicates[data->nduplicates].key);
+        TSfree(data->duplicates[data->nduplicates].value);
+      }
+
+      /* Insertion sort, stable so equal priorities keep their order */
+      int i;
+      for (i = data->nduplicates; i && data->duplicates[i - 1].pri > pri; i -= 1) {
+        data->duplicates[i] = data->duplicates[i - 1];
+      }
+
+      data->duplicates[i].data = data;
+
+      data->duplicates[i].value = TSstrndup(url, url_length);
+      data->duplicates[i].length = url_length;
+
+      data->duplicates[i].pri = pri;
+      data->duplicates[i].key = key;
+
+      data->duplicates[i].cached = -1;
+
+      data->nduplicates += 1;
+    }
+
+    TSMLoc next_loc = TSMimeHdrFieldNextDup(data->resp_bufp, data->hdr_loc, link_loc);
+
+    TSHandleMLocRelease(data->resp_bufp, data->hdr_loc, link_loc);
+
+    link_loc = next_loc;
+  }
+}
+
+/* Start all the lookups: The Location URL, the candidates from the
+ * record at the digest and the duplicates from Link headers.  Call
+ * with the lock held and a reference. */
+
+static void
+lookup_start(SendData *data)
+{
+  data->location_cached = -1;
+  data->digest_read = -1;
+
+  /* Check if the duplicates are cached */
+
+  duplicates_parse(data);
+  candidates_check(data, data->duplicates, data->nduplicates);
+
+  /* Don't wait for them forever */
+  if (data->nduplicates && duplicates_timeout) {
+    __sync_add_and_fetch(&data->refcount, 1);
+
+    data->timeout_contp = TSContCreate(timeout_handler, TSContMutexGet(data->contp));
+    TSContDataSet(data->timeout_contp, data);
+
+    data->timeout_actionp = TSContSchedule(data->timeout_contp, duplicates_timeout, TS_THREAD_POOL_DEFAULT);
+  }
+
+  /* Check if the digest already exists in the cache first, it's the
+   * longer way.  Skip it if the filter knows there's no record. */
+  if (filter_maybe(&digest_filter, data->alg, data->digest) && digest_key_set(data->digest_key, data->alg, data->digest) == TS_SUCCESS) {
+    __sync_add_and_fetch(&data->refcount, 1);
+
+    TSCont contp = TSContCreate(digest_handler, TSContMutexGet(data->contp));
+    TSContDataSet(contp, data);
+
+    data->record_start = TShrtime();
+
+    /* Reentrant! */
+    TSCacheRead(contp, data->digest_key);
+
+  } else {
+    stat_increment(STAT_SEND_FILTER_SKIPPED, 1);
+    trace_event(data->trace, "record", "skipped");
+
+    data->digest_read = 0;
+  }
+
+  /* Check if the Location URL is already cached */
+
+  __sync_add_and_fetch(&data->refcount, 1);
+
+  data->location_start = TShrtime();
+
+  /* Reentrant! */
+  TSCacheRead(data->contp, data->key);
+}
+
+/* TSCacheRead() handler: Check if the URL in the index is cached.
+ * This is data->contp, so don't destroy it here. */
+
+static int
+index_handler(TSCont contp, TSEvent event, void *edata)
+{
+  SendData *data = (SendData *) TSContDataGet(contp);
+
+  /* Anything else is for location_handler() */
+  data->index_reading = 0;
+
+  TSCacheKeyDestroy(data->index_key);
+
+  switch (event) {
+
+  /* Yes: Rewrite the Location header and reenable the response */
+  case TS_EVENT_CACHE_OPEN_READ:
+    TSVConnClose((TSVConn) edata);
+
+    TSMimeHdrFieldValuesClear(data->resp_bufp, data->hdr_loc, data->location_loc);
+    TSMimeHdrFieldValueStringInsert(data->resp_bufp, data->hdr_loc, data->location_loc, -1, data->index_value, data->index_length);
+
+    serve_redirect(data->txnp, data->index_value, data->index_length);
+
+    coalesce_done(data, data->index_value, data->index_length, 1);
+
+    TSfree(data->index_value);
+
+    data->done = 1;
+
+    stat_increment(STAT_SEND_INDEX_HIT, 1);
+    trace_event(data->trace, "index", "cached");
+
+    TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->url_loc);
+    TSHandleMLocRelease(data->resp_bufp, data->hdr_loc, data->location_loc);
+    TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->hdr_loc);
+
+    latency_record(LATENCY_HOLD, data->start);
+
+    TSHttpTxnReenable(data->txnp, TS_EVENT_HTTP_CONTINUE);
+
+    break;
+
+  /* No: Forget the entry and check the Location URL and the digest
+   * the long way */
+  case TS_EVENT_CACHE_OPEN_READ_FAILED:
+    index_remove(&digest_index, data->alg, data->digest, data->index_value, data->index_length);
+
+    stat_increment(STAT_SEND_INDEX_STALE, 1);
+    trace_event(data->trace, "index", "stale");
+
+    TSfree(data->index_value);
+
+    lookup_start(data);
+
+    break;
+
+  default:
+    TSAssert(!"Unexpected event");
+  }
+
+  lookup_unref(data);
+
+  return 0;
+}
+
+/* TSCacheRead() handler for data->contp: The one continuation first
+ * reads the URL in the index, if any, then the Location URL */
+
+static int
+send_handler(TSCont contp, TSEvent event, void *edata)
+{
+  SendData *data = (SendData *) TSContDataGet(contp);
+
+  if (data->index_reading) {
+    return index_handler(contp, event, edata);
+  }
 
-      /* Feed content to the message digest */
-      TSIOBufferBlock blockp = TSIOBufferReaderStart(readerp);
-      while (blockp) {
+  return location_handler(contp, event, edata);
+}
 
-        /* No allocation? */
-        value = TSIOBufferBlockReadStart(blockp, readerp, &length);
-        SHA256_Update(&transform_data->c, value, length);
+/* Digest headers: The algorithms the client asked for with a
+ * Want-Digest header [RFC 3230], except any with q=0.  Without one,
+ * just SHA-256, which Metalink requires. */
 
-        blockp = TSIOBufferBlockNext(blockp);
-      }
+static unsigned int
+want_digest_get(TSHttpTxn txnp)
+{
+  const char *value;
+  int length;
 
-      TSIOBufferReaderConsume(readerp, avail);
+  TSMBuffer req_bufp;
+  TSMLoc hdr_loc;
 
-      /* Call TSVIONDoneSet() for TSVIONTodoGet() condition */
-      int ndone = TSVIONDoneGet(input_viop);
-      TSVIONDoneSet(input_viop, ndone + avail);
-    }
+  if (TSHttpTxnClientReqGet(txnp, &req_bufp, &hdr_loc) != TS_SUCCESS) {
+    return 1 << DIGEST_SHA256;
   }
 
-  /* Check if the input is complete after dealing with any available
-   * input in case it was the last of it */
-  int ntodo = TSVIONTodoGet(input_viop);
-  if (ntodo) {
-    TSVIOReenable(transform_data->output_viop);
+  TSMLoc field_loc = TSMimeHdrFieldFind(req_bufp, hdr_loc, "Want-Digest", 11);
+  if (!field_loc) {
+    TSHandleMLocRelease(req_bufp, TS_NULL_MLOC, hdr_loc);
 
-    TSContCall(TSVIOContGet(input_viop), TS_EVENT_VCONN_WRITE_READY, input_viop);
+    return 1 << DIGEST_SHA256;
+  }
 
-  /* Don't finish computing the digest (and tell downstream and thank
-   * upstream) more than once!  There might be multiple
-   * TS_EVENT_IMMEDIATE events between the end of the input and the
-   * TS_EVENT_VCONN_WRITE_COMPLETE event from downstream, e.g.
-   * INKVConnInternal::reenable() is called by
-   * HttpTunnel::producer_handler() when more input is available and
-   * TransformVConnection::do_io_shutdown() is called by
-   * HttpSM::tunnel_handler_transform_write() when we send our own
-   * TS_EVENT_VCONN_WRITE_COMPLETE event upstream. */
-  } else if (transform_data->txnp) {
+  unsigned int want = 0;
+  while (field_loc) {
 
-    int ndone = TSVIONDoneGet(input_viop);
-    TSVIONBytesSet(transform_data->output_viop, ndone);
+    int count = TSMimeHdrFieldValuesCount(req_bufp, hdr_loc, field_loc);
+    for (int idx = 0; idx < count; idx += 1) {
 
-    TSVIOReenable(transform_data->output_viop);
+      /* No allocation, freed with req_bufp? */
+      value = TSMimeHdrFieldValueStringGet(req_bufp, hdr_loc, field_loc, idx, &length);
 
-    /* Avoid failed assert "c->alive == true" in TSContCall() if the
-     * content length is zero or when we get the final chunk of a
-     * chunked response */
-    if (readerp) {
-      TSContCall(TSVIOContGet(input_viop), TS_EVENT_VCONN_WRITE_COMPLETE, input_viop);
-    }
+      const char *semicolon = (const char *) memchr(value, ';', length);
 
-    /* Write the digest to the cache */
+      int name_length = semicolon ? semicolon - value : length;
+      while (name_length && value[name_length - 1] == ' ') {
+        name_length -= 1;
+      }
 
-    SHA256_Final((unsigned char *) digest, &transform_data->c);
+      int alg = digest_algorithm_get(value, name_length);
+      if (alg == -1) {
+        continue;
+      }
 
-    WriteData *write_data = (WriteData *) TSmalloc(sizeof(WriteData));
-    write_data->txnp = transform_data->txnp;
+      /* "q=0", "q=0.0", ...  Anything else is wanted. */
+      if (semicolon) {
+        const char *p = semicolon + 1;
+        const char *end = value + length;
 
-    /* Don't finish computing the digest more than once! */
-    transform_data->txnp = NULL;
+        while (p < end && *p == ' ') {
+          p += 1;
+        }
 
-    write_data->key = TSCacheKeyCreate();
-    if (TSCacheKeyDigestSet(write_data->key, digest, sizeof(digest)) != TS_SUCCESS) {
+        if (end - p >= 3 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=' && p[2] == '0') {
+          for (p += 3; p < end && (*p == '.' || *p == '0'); p += 1) {
+          }
 
-      TSCacheKeyDestroy(write_data->key);
-      TSfree(write_data);
+          if (p == end) {
+            continue;
+          }
+        }
+      }
 
-      return 0;
+      want |= 1 << alg;
     }
 
-    /* Can't reuse the TSTransformCreate() continuation because we
-     * don't know whether to destroy it in
-     * cache_open_write()/cache_open_write_failed() or
-     * transform_vconn_write_complete() */
-    contp = TSContCreate(write_handler, NULL);
-    TSContDataSet(contp, write_data);
-
-    /* Reentrant! */
-    TSCacheWrite(contp, write_data->key);
-  }
+    TSMLoc next_loc = TSMimeHdrFieldNextDup(req_bufp, hdr_loc, field_loc);
 
-  return 0;
-}
+    TSHandleMLocRelease(req_bufp, hdr_loc, field_loc);
 
-static int
-transform_vconn_write_complete(TSCont contp, void */* edata ATS_UNUSED */)
-{
-  TransformData *data = (TransformData *) TSContDataGet(contp);
-  TSContDestroy(contp);
+    field_loc = next_loc;
+  }
 
-  TSIOBufferDestroy(data->output_bufp);
-  TSfree(data);
+  TSHandleMLocRelease(req_bufp, TS_NULL_MLOC, hdr_loc);
 
-  return 0;
+  return want;
 }
 
-/* TSTransformCreate() handler: Compute the SHA-256 digest of the
- * content */
+/* Add a Digest header with the wanted algorithms from a stored value,
+ * unless it's for content of a different length.  Return nonzero if
+ * it added one. */
 
 static int
-transform_handler(TSCont contp, TSEvent event, void *edata)
+header_set(TSMBuffer bufp, TSMLoc hdr_loc, const char *value, int length, unsigned int want, int64_t size, const char *validator,
+           int validator_length)
 {
-  switch (event) {
-  case TS_EVENT_IMMEDIATE:
-  case TS_EVENT_VCONN_WRITE_READY:
-    return vconn_write_ready(contp, edata);
+  const char *end = value + length;
 
-  case TS_EVENT_VCONN_WRITE_COMPLETE:
-    return transform_vconn_write_complete(contp, edata);
+  int64_t stored_size = 0;
 
-  default:
-    TSAssert(!"Unexpected event");
+  const char *p;
+  for (p = value; p < end && *p >= '0' && *p <= '9'; p += 1) {
+    stored_size = stored_size * 10 + *p - '0';
   }
 
-  return 0;
-}
-
-/* Compute the SHA-256 digest of the content, write it to the cache
- * and store the request URL at that key */
+  if (p == value || p == end || *p != ' ' || stored_size != size) {
+    return 0;
+  }
 
-static int
-http_read_response_hdr(TSCont /* contp ATS_UNUSED */, void *edata)
-{
-  TransformData *data = (TransformData *) TSmalloc(sizeof(TransformData));
-  data->txnp = (TSHttpTxn) edata;
+  /* The same validator, then the Digest header value from the next
+   * character on */
+  const char *validator_start = p + 1;
 
-  /* Can't initialize data here because we can't call TSVConnWrite()
-   * before TS_HTTP_RESPONSE_TRANSFORM_HOOK */
-  data->output_bufp = NULL;
+  p = (const char *) memchr(validator_start, '\n', end - validator_start);
+  if (!p || p - validator_start != validator_length || memcmp(validator_start, validator, validator_length)) {
+    return 0;
+  }
 
-  TSVConn connp = TSTransformCreate(transform_handler, data->txnp);
-  TSContDataSet(connp, data);
+  TSMLoc field_loc = NULL;
+  while (p < end) {
+    const char *entry = p + 1;
 
-  TSHttpTxnHookAdd(data->txnp, TS_HTTP_RESPONSE_TRANSFORM_HOOK, connp);
+    p = (const char *) memchr(entry, ',', end - entry);
+    if (!p) {
+      p = end;
+    }
 
-  TSHttpTxnReenable(data->txnp, TS_EVENT_HTTP_CONTINUE);
+    const char *equals = (const char *) memchr(entry, '=', p - entry);
+    if (!equals) {
+      continue;
+    }
 
-  return 0;
-}
+    int alg = digest_algorithm_get(entry, equals - entry);
+    if (alg == -1 || !(want & 1 << alg)) {
+      continue;
+    }
 
-/* Implement TS_HTTP_SEND_RESPONSE_HDR_HOOK to check the Location and
- * Digest headers */
+    if (!field_loc && TSMimeHdrFieldCreateNamed(bufp, hdr_loc, "Digest", 6, &field_loc) != TS_SUCCESS) {
+      return 0;
+    }
 
-/* Read the URL stored at the digest */
+    TSMimeHdrFieldValueStringInsert(bufp, hdr_loc, field_loc, -1, entry, p - entry);
+  }
 
-static int
-cache_open_read(TSCont contp, void *edata)
-{
-  SendData *data = (SendData *) TSContDataGet(contp);
-  data->connp = (TSVConn) edata;
+  if (!field_loc) {
+    return 0;
+  }
 
-  data->cache_bufp = TSIOBufferCreate();
+  TSMimeHdrFieldAppend(bufp, hdr_loc, field_loc);
 
-  /* Reentrant!  Reuse the TSCacheRead() continuation. */
-  TSVConnRead(data->connp, contp, data->cache_bufp, INT64_MAX);
+  TSHandleMLocRelease(bufp, hdr_loc, field_loc);
 
-  return 0;
+  return 1;
 }
 
-/* Do nothing, just reenable the response */
+/* Reenable the response, with or without a Digest header */
 
-static int
-cache_open_read_failed(TSCont contp, void */* edata ATS_UNUSED */)
+static void
+header_done(HeaderData *data, const char *value, int length)
 {
-  SendData *data = (SendData *) TSContDataGet(contp);
-  TSContDestroy(contp);
+  if (value && header_set(data->resp_bufp, data->hdr_loc, value, length, data->want, data->size, data->validator, data->validator_length)) {
+    stat_increment(STAT_HEADER_ADDED, 1);
 
-  TSCacheKeyDestroy(data->key);
+  } else {
+    stat_increment(STAT_HEADER_MISSING, 1);
+  }
 
-  TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->url_loc);
-  TSHandleMLocRelease(data->resp_bufp, data->hdr_loc, data->location_loc);
   TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->hdr_loc);
 
   TSHttpTxnReenable(data->txnp, TS_EVENT_HTTP_CONTINUE);
-  TSfree(data);
 
-  return 0;
+  TSfree(data);
 }
 
-/* TSCacheRead() handler: Check if the URL stored at the digest is
- * cached */
+/* TSCacheRead() and TSVConnRead() handler: Read the stored Digest
+ * header and remember it in the index */
 
 static int
-rewrite_handler(TSCont contp, TSEvent event, void */* edata ATS_UNUSED */)
+header_handler(TSCont contp, TSEvent event, void *edata)
 {
-  SendData *data = (SendData *) TSContDataGet(contp);
-  TSContDestroy(contp);
+  int64_t length;
 
-  TSCacheKeyDestroy(data->key);
+  HeaderData *data = (HeaderData *) TSContDataGet(contp);
 
   switch (event) {
-
-  /* Yes: Rewrite the Location header and reenable the response */
   case TS_EVENT_CACHE_OPEN_READ:
+    data->connp = (TSVConn) edata;
 
-    TSMimeHdrFieldValuesClear(data->resp_bufp, data->hdr_loc, data->location_loc);
-    TSMimeHdrFieldValueStringInsert(data->resp_bufp, data->hdr_loc, data->location_loc, -1, data->value, data->length);
+    TSCacheKeyDestroy(data->key);
+
+    data->cache_bufp = TSIOBufferCreate();
+    data->cache_readerp = TSIOBufferReaderAlloc(data->cache_bufp);
+
+    /* Reentrant!  Reuse the TSCacheRead() continuation. */
+    data->cache_viop = TSVConnRead(data->connp, contp, data->cache_bufp, INT64_MAX);
 
     break;
 
-  /* No: Do nothing, just reenable the response */
   case TS_EVENT_CACHE_OPEN_READ_FAILED:
+    TSContDestroy(contp);
+
+    TSCacheKeyDestroy(data->key);
+
+    header_done(data, NULL, 0);
+
     break;
 
-  default:
-    TSAssert(!"Unexpected event");
-  }
+  case TS_EVENT_VCONN_READ_READY:
+  case TS_EVENT_VCONN_READ_COMPLETE: {
 
-  TSIOBufferDestroy(data->cache_bufp);
+    /* Allocation!  Must free! */
+    char *value = record_gather(data->connp, data->cache_readerp, event == TS_EVENT_VCONN_READ_COMPLETE, &length);
+    if (!value) {
+      TSVIOReenable(data->cache_viop);
 
-  TSHandleMLocRelease(data->resp_bufp, data->hdr_loc, data->location_loc);
-  TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->hdr_loc);
+      break;
+    }
 
-  TSHttpTxnReenable(data->txnp, TS_EVENT_HTTP_CONTINUE);
-  TSfree(data);
+    TSContDestroy(contp);
 
-  return 0;
-}
+    TSVConnClose(data->connp);
 
-/* Read the URL stored at the digest */
+    TSIOBufferDestroy(data->cache_bufp);
 
-static int
-vconn_read_ready(TSCont contp, void */* edata ATS_UNUSED */)
-{
-  SendData *data = (SendData *) TSContDataGet(contp);
-  TSContDestroy(contp);
+    if (length < HEADER_VALUE_MAX) {
+      index_set(&header_index, DIGEST_SHA256, data->hash, value, length, TShrtime());
+    }
 
-  TSVConnClose(data->connp);
+    header_done(data, value, length);
 
-  TSIOBufferReader readerp = TSIOBufferReaderAlloc(data->cache_bufp);
+    TSfree(value);
 
-  TSIOBufferBlock blockp = TSIOBufferReaderStart(readerp);
+    break;
+  }
 
-  /* No allocation, freed with data->cache_bufp? */
-  const char *value = data->value = TSIOBufferBlockReadStart(blockp, readerp, &data->length);
+  default:
+    TSAssert(!"Unexpected event");
+  }
 
-  /* The start pointer is both an input and an output parameter.
-   * After a successful parse the start pointer equals the end
-   * pointer. */
-  if (TSUrlParse(data->resp_bufp, data->url_loc, &value, value + data->length) != TS_PARSE_DONE) {
-    TSIOBufferDestroy(data->cache_bufp);
+  return 0;
+}
 
-    TSCacheKeyDestroy(data->key);
+/* Add a Digest header to a response from the cache, from the index or
+ * the cache.  Return nonzero if the response is left to the cache
+ * read, which releases the header and reenables it. */
 
-    TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->url_loc);
-    TSHandleMLocRelease(data->resp_bufp, data->hdr_loc, data->location_loc);
-    TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->hdr_loc);
+static int
+header_add(TSHttpTxn txnp, TSMBuffer bufp, TSMLoc hdr_loc)
+{
+  char hash[32];
 
-    TSHttpTxnReenable(data->txnp, TS_EVENT_HTTP_CONTINUE);
-    TSfree(data);
+  int length;
+  int lookup_status;
 
+  if (!header_index.nsets) {
     return 0;
   }
 
-  if (TSCacheKeyDigestFromUrlSet(data->key, data->url_loc) != TS_SUCCESS) {
-    TSIOBufferDestroy(data->cache_bufp);
-
-    TSCacheKeyDestroy(data->key);
+  if (TSHttpTxnCacheLookupStatusGet(txnp, &lookup_status) != TS_SUCCESS
+      || (lookup_status != TS_CACHE_LOOKUP_HIT_FRESH && lookup_status != TS_CACHE_LOOKUP_HIT_STALE)) {
+    return 0;
+  }
 
-    TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->url_loc);
-    TSHandleMLocRelease(data->resp_bufp, data->hdr_loc, data->location_loc);
-    TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->hdr_loc);
+  /* Already has one, e.g. from a parent proxy */
+  TSMLoc field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, "Digest", 6);
+  if (field_loc) {
+    TSHandleMLocRelease(bufp, hdr_loc, field_loc);
 
-    TSHttpTxnReenable(data->txnp, TS_EVENT_HTTP_CONTINUE);
-    TSfree(data);
+    return 0;
+  }
 
+  /* Can't tell if the stored digests are for this content */
+  field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, TS_MIME_FIELD_CONTENT_LENGTH, TS_MIME_LEN_CONTENT_LENGTH);
+  if (!field_loc) {
     return 0;
   }
 
-  TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->url_loc);
+  int64_t size = TSMimeHdrFieldValueInt64Get(bufp, hdr_loc, field_loc, 0);
 
-  /* Check if the URL stored at the digest is cached */
+  TSHandleMLocRelease(bufp, hdr_loc, field_loc);
 
-  contp = TSContCreate(rewrite_handler, NULL);
-  TSContDataSet(contp, data);
+  /* Or if it's the same content */
+  char validator[HEADER_VALIDATOR_MAX];
 
-  /* Reentrant!  (Particularly in case of a cache miss.)
-   * rewrite_handler() will clean up the TSVConnRead() buffer so be
-   * sure to close this virtual connection or CacheVC::openReadMain()
-   * will continue operating on it! */
-  TSCacheRead(contp, data->key);
+  int validator_length = validator_get(bufp, hdr_loc, validator);
+  if (!validator_length) {
+    return 0;
+  }
 
-  return 0;
-}
+  unsigned int want = want_digest_get(txnp) & digest_algs;
+  if (!want) {
+    return 0;
+  }
 
-/* TSCacheRead() and TSVConnRead() handler: Check if the digest
- * already exists in the cache */
+  /* Allocation!  Must free! */
+  char *url = request_url_get(txnp, &length);
+  if (!url) {
+    return 0;
+  }
 
-static int
-digest_handler(TSCont contp, TSEvent event, void *edata)
-{
-  switch (event) {
+  url_hash(url, length, hash);
 
-  /* Yes: Read the URL stored at that key */
-  case TS_EVENT_CACHE_OPEN_READ:
-    return cache_open_read(contp, edata);
+  int value_length;
 
-  /* No: Do nothing, just reenable the response */
-  case TS_EVENT_CACHE_OPEN_READ_FAILED:
-    return cache_open_read_failed(contp, edata);
+  /* Allocation!  Must free! */
+  char *value = index_lookup(&header_index, DIGEST_SHA256, hash, 0, &value_length);
+  if (value) {
+    if (header_set(bufp, hdr_loc, value, value_length, want, size, validator, validator_length)) {
+      stat_increment(STAT_HEADER_ADDED, 1);
 
-  case TS_EVENT_VCONN_READ_READY:
-    return vconn_read_ready(contp, edata);
+    } else {
+      stat_increment(STAT_HEADER_MISSING, 1);
+    }
 
-  default:
-    TSAssert(!"Unexpected event");
+    TSfree(value);
+    TSfree(url);
+
+    return 0;
   }
 
-  return 0;
-}
+  HeaderData *data = (HeaderData *) TSmalloc(sizeof(HeaderData));
 
-/* TSCacheRead() handler: Check if the Location URL is already cached */
+  data->txnp = txnp;
+  data->resp_bufp = bufp;
+  data->hdr_loc = hdr_loc;
 
-static int
-location_handler(TSCont contp, TSEvent event, void */* edata ATS_UNUSED */)
-{
-  const char *value;
-  int length;
+  data->want = want;
+  data->size = size;
 
-  char digest[33]; /* ATS_BASE64_DECODE_DSTLEN() */
+  memcpy(data->validator, validator, validator_length);
+  data->validator_length = validator_length;
 
-  SendData *data = (SendData *) TSContDataGet(contp);
-  TSContDestroy(contp);
+  memcpy(data->hash, hash, sizeof(hash));
 
-  switch (event) {
+  data->key = TSCacheKeyCreate();
+  if (header_key_set(data->key, url, length) != TS_SUCCESS) {
+    TSCacheKeyDestroy(data->key);
 
-  /* Yes: Do nothing, just reenable the response */
-  case TS_EVENT_CACHE_OPEN_READ:
-    break;
+    TSfree(data);
+    TSfree(url);
 
-  /* No: Check if the digest already exists in the cache */
-  case TS_EVENT_CACHE_OPEN_READ_FAILED:
+    return 0;
+  }
 
-    /* No allocation, freed with data->resp_bufp? */
-    value = TSMimeHdrFieldValueStringGet(data->resp_bufp, data->hdr_loc, data->digest_loc, data->idx, &length);
-    if (TSBase64Decode(value + 8, length - 8, (unsigned char *) digest, sizeof(digest), NULL) != TS_SUCCESS
-        || TSCacheKeyDigestSet(data->key, digest, 32 /* SHA-256 */ ) != TS_SUCCESS) {
-      break;
-    }
+  TSfree(url);
 
-    TSHandleMLocRelease(data->resp_bufp, data->hdr_loc, data->digest_loc);
+  TSCont contp = TSContCreate(header_handler, TSMutexCreate());
+  TSContDataSet(contp, data);
 
-    /* Check if the digest already exists in the cache */
+  /* Reentrant! */
+  TSCacheRead(contp, data->key);
 
-    contp = TSContCreate(digest_handler, NULL);
-    TSContDataSet(contp, data);
+  return 1;
+}
 
-    /* Reentrant! */
-    TSCacheRead(contp, data->key);
+/* Serve mode: The response to a redirect the proxy followed.  Say
+ * which URL the content came from, it's the request URL now. */
 
-    return 0;
+static void
+content_location_set(TSHttpTxn txnp, TSMBuffer bufp, TSMLoc hdr_loc)
+{
+  TSMLoc field_loc;
+  int length;
 
-  default:
-    TSAssert(!"Unexpected event");
+  /* Allocation!  Must free! */
+  char *value = request_url_get(txnp, &length);
+  if (!value) {
+    return;
   }
 
-  TSHandleMLocRelease(data->resp_bufp, data->hdr_loc, data->digest_loc);
-
-  TSCacheKeyDestroy(data->key);
-
-  TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->url_loc);
-  TSHandleMLocRelease(data->resp_bufp, data->hdr_loc, data->location_loc);
-  TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->hdr_loc);
+  if (TSMimeHdrFieldCreateNamed(bufp, hdr_loc, TS_MIME_FIELD_CONTENT_LOCATION, TS_MIME_LEN_CONTENT_LOCATION, &field_loc) == TS_SUCCESS) {
+    TSMimeHdrFieldValueStringInsert(bufp, hdr_loc, field_loc, -1, value, length);
+    TSMimeHdrFieldAppend(bufp, hdr_loc, field_loc);
 
-  TSHttpTxnReenable(data->txnp, TS_EVENT_HTTP_CONTINUE);
-  TSfree(data);
+    TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+  }
 
-  return 0;
+  TSfree(value);
 }
 
 /* Use TSCacheRead() to check if the URL in the Location header is
@@ -748,23 +6329,51 @@ location_handler(TSCont contp, TSEvent event, void */* edata ATS_UNUSED */)
  * after responses are cached because the cache will change. */
 
 static int
-http_send_response_hdr(TSCont contp, void *edata)
+http_send_response_hdr(TSCont /* contp ATS_UNUSED */, void *edata)
 {
   const char *value;
   int length;
 
-  SendData *data = (SendData *) TSmalloc(sizeof(SendData));
-  data->txnp = (TSHttpTxn) edata;
+  TSHttpTxn txnp = (TSHttpTxn) edata;
 
-  if (TSHttpTxnClientRespGet(data->txnp, &data->resp_bufp, &data->hdr_loc) != TS_SUCCESS) {
+  TSMBuffer resp_bufp;
+  TSMLoc hdr_loc;
+
+  if (TSHttpTxnClientRespGet(txnp, &resp_bufp, &hdr_loc) != TS_SUCCESS) {
     TSError("Couldn't retrieve client response header");
 
-    TSHttpTxnReenable(data->txnp, TS_EVENT_HTTP_CONTINUE);
-    TSfree(data);
+    TSHttpTxnReenable(txnp, TS_EVENT_HTTP_CONTINUE);
+
+    return 0;
+  }
+
+  /* Only redirects are worth looking at.  The status is already
+   * parsed, so check it before touching any header fields, or
+   * allocating anything. */
+  TSHttpStatus status = TSHttpHdrStatusGet(resp_bufp, hdr_loc);
+  if (status < 300 || status > 399) {
+    if (serve && TSHttpTxnArgGet(txnp, serve_arg)) {
+      content_location_set(txnp, resp_bufp, hdr_loc);
+    }
+
+    /* Reentrant! */
+    if (status == TS_HTTP_STATUS_OK && header_add(txnp, resp_bufp, hdr_loc)) {
+      return 0;
+    }
+
+    TSHandleMLocRelease(resp_bufp, TS_NULL_MLOC, hdr_loc);
+
+    TSHttpTxnReenable(txnp, TS_EVENT_HTTP_CONTINUE);
 
     return 0;
   }
 
+  SendData *data = (SendData *) freelist_alloc(&send_freelist, STAT_LIVE_SEND, sizeof(SendData));
+
+  data->txnp = txnp;
+  data->resp_bufp = resp_bufp;
+  data->hdr_loc = hdr_loc;
+
   /* If Instance Digests are not provided by the Metalink servers, the
    * Link header fields pertaining to this specification MUST be
    * ignored */
@@ -786,7 +6395,7 @@ http_send_response_hdr(TSCont contp, void *edata)
     TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->hdr_loc);
 
     TSHttpTxnReenable(data->txnp, TS_EVENT_HTTP_CONTINUE);
-    TSfree(data);
+    freelist_free(&send_freelist, STAT_LIVE_SEND, data);
 
     return 0;
   }
@@ -806,7 +6415,7 @@ http_send_response_hdr(TSCont contp, void *edata)
     TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->hdr_loc);
 
     TSHttpTxnReenable(data->txnp, TS_EVENT_HTTP_CONTINUE);
-    TSfree(data);
+    freelist_free(&send_freelist, STAT_LIVE_SEND, data);
 
     return 0;
   }
@@ -820,52 +6429,148 @@ http_send_response_hdr(TSCont contp, void *edata)
     TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->hdr_loc);
 
     TSHttpTxnReenable(data->txnp, TS_EVENT_HTTP_CONTINUE);
-    TSfree(data);
+    freelist_free(&send_freelist, STAT_LIVE_SEND, data);
 
     return 0;
   }
 
-  /* ... and a Digest header */
-  data->digest_loc = TSMimeHdrFieldFind(data->resp_bufp, data->hdr_loc, "Digest", 6);
-  while (data->digest_loc) {
+  /* ... and a Digest header.  Use the digest we prefer out of the
+   * algorithms we compute. */
+  data->alg = -1;
 
-    int count = TSMimeHdrFieldValuesCount(data->resp_bufp, data->hdr_loc, data->digest_loc);
-    for (data->idx = 0; data->idx < count; data->idx += 1) {
+  unsigned char digests[DIGEST_NALGS][DIGEST_MAX_LENGTH];
 
-      /* No allocation, freed with data->resp_bufp? */
-      value = TSMimeHdrFieldValueStringGet(data->resp_bufp, data->hdr_loc, data->digest_loc, data->idx, &length);
-      if (length < 8 + 44 /* 32 bytes, Base64 */ || strncasecmp(value, "SHA-256=", 8)) {
-        continue;
-      }
+  unsigned int algs = digest_header_parse(data->resp_bufp, data->hdr_loc, digests) & digest_algs;
+  if (algs) {
+    data->alg = __builtin_ctz(algs);
+    memcpy(data->digest, digests[data->alg], digest_algorithms[data->alg].length);
+  }
 
-      /* Check if the Location URL is already cached */
+  /* Didn't find a Digest header, just reenable the response */
+  if (data->alg == -1) {
+    TSCacheKeyDestroy(data->key);
 
-      contp = TSContCreate(location_handler, NULL);
-      TSContDataSet(contp, data);
+    TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->url_loc);
+    TSHandleMLocRelease(data->resp_bufp, data->hdr_loc, data->location_loc);
+    TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->hdr_loc);
 
-      /* Reentrant! */
-      TSCacheRead(contp, data->key);
+    TSHttpTxnReenable(data->txnp, TS_EVENT_HTTP_CONTINUE);
+    freelist_free(&send_freelist, STAT_LIVE_SEND, data);
+
+    return 0;
+  }
+
+  stat_increment(STAT_SEND_LOOKUPS, 1);
+
+  data->trace = trace_start("send");
+
+  /* Check the index first.  If it remembers a URL for the digest,
+   * only check that URL is still cached.  (If the Location URL is
+   * also cached it doesn't matter which one the client uses.) */
+
+  /* Allocation!  Must free! */
+  data->index_value = index_lookup(&digest_index, data->alg, data->digest, 0, &data->index_length);
+  if (data->index_value) {
+
+    /* No allocation, freed with data->resp_bufp? */
+    value = TSMimeHdrFieldValueStringGet(data->resp_bufp, data->hdr_loc, data->location_loc, -1, &length);
+
+    /* Same as the Location URL: Nothing to rewrite.  Either it's
+     * cached or the digest won't find anything better. */
+    if (data->index_length == length && !memcmp(data->index_value, value, length)) {
+      stat_increment(STAT_SEND_INDEX_SAME, 1);
+
+      trace_event(data->trace, "index", "same");
+      trace_end(data->trace);
+
+      TSfree(data->index_value);
+
+      TSCacheKeyDestroy(data->key);
+
+      TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->url_loc);
+      TSHandleMLocRelease(data->resp_bufp, data->hdr_loc, data->location_loc);
+      TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->hdr_loc);
+
+      TSHttpTxnReenable(data->txnp, TS_EVENT_HTTP_CONTINUE);
+      freelist_free(&send_freelist, STAT_LIVE_SEND, data);
 
       return 0;
     }
+  }
 
-    TSMLoc next_loc = TSMimeHdrFieldNextDup(data->resp_bufp, data->hdr_loc, data->digest_loc);
-
-    TSHandleMLocRelease(data->resp_bufp, data->hdr_loc, data->digest_loc);
+  /* Answer it like an identical redirect, or wait for one.  Both
+   * record the hold latency, so start the clock first. */
+  data->start = TShrtime();
 
-    data->digest_loc = next_loc;
+  data->flight = NULL;
+  if (coalesce && coalesce_join(data)) {
+    return 0;
   }
 
-  /* Didn't find a Digest header, just reenable the response */
+  /* Start the lookups */
 
-  TSCacheKeyDestroy(data->key);
+  data->contp = TSContCreate(send_handler, TSMutexCreate());
+  TSContDataSet(data->contp, data);
 
-  TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->url_loc);
-  TSHandleMLocRelease(data->resp_bufp, data->hdr_loc, data->location_loc);
-  TSHandleMLocRelease(data->resp_bufp, TS_NULL_MLOC, data->hdr_loc);
+  data->index_reading = 0;
 
-  TSHttpTxnReenable(data->txnp, TS_EVENT_HTTP_CONTINUE);
-  TSfree(data);
+  data->digest_key = TSCacheKeyCreate();
+
+  data->connp = NULL;
+  data->cache_bufp = NULL;
+
+  data->candidates = NULL;
+  data->ncandidates = 0;
+
+  data->duplicates = NULL;
+  data->nduplicates = 0;
+
+  data->timeout_contp = NULL;
+  data->timeout_actionp = NULL;
+  data->timed_out = 0;
+
+  data->location_start = 0;
+  data->record_start = 0;
+
+  data->refcount = 1;
+  data->done = 0;
+
+  TSMutex mutexp = TSContMutexGet(data->contp);
+  TSMutexLock(mutexp);
+
+  if (data->index_value) {
+
+    /* The Location URL key is already computed, so reuse the URL
+     * handle */
+    value = data->index_value;
+    data->index_key = TSCacheKeyCreate();
+    if (TSUrlParse(data->resp_bufp, data->url_loc, &value, value + data->index_length) == TS_PARSE_DONE
+        && TSCacheKeyDigestFromUrlSet(data->index_key, data->url_loc) == TS_SUCCESS) {
+      __sync_add_and_fetch(&data->refcount, 1);
+
+      /* Reuse data->contp, the Location URL isn't read until after */
+      data->index_reading = 1;
+
+      /* Reentrant! */
+      TSCacheRead(data->contp, data->index_key);
+
+    } else {
+      TSCacheKeyDestroy(data->index_key);
+
+      index_remove(&digest_index, data->alg, data->digest, data->index_value, data->index_length);
+
+      TSfree(data->index_value);
+
+      lookup_start(data);
+    }
+
+  } else {
+    lookup_start(data);
+  }
+
+  TSMutexUnlock(mutexp);
+
+  lookup_unref(data);
 
   return 0;
 }
@@ -874,6 +6579,12 @@ static int
 handler(TSCont contp, TSEvent event, void *edata)
 {
   switch (event) {
+  case TS_EVENT_HTTP_POST_REMAP:
+    return http_post_remap(contp, edata);
+
+  case TS_EVENT_HTTP_CACHE_LOOKUP_COMPLETE:
+    return http_cache_lookup_complete(contp, edata);
+
   case TS_EVENT_HTTP_READ_RESPONSE_HDR:
     return http_read_response_hdr(contp, edata);
 
@@ -887,8 +6598,326 @@ handler(TSCont contp, TSEvent event, void *edata)
   return 0;
 }
 
+/* Parse the options, starting at argv[first], and initialize
+ * everything the first time.  The rule options go in *rulep. */
+
+static void
+options_init(int argc, const char *argv[], int first, Rule *rulep)
+{
+  /* Options */
+
+  static const struct option longopts[] = {
+    { "index-size", required_argument, NULL, 'i' },
+    { "sha256-kernel", required_argument, NULL, 'k' },
+    { "hash-offload", no_argument, NULL, 'o' },
+    { "digest", required_argument, NULL, 'g' },
+    { "tap", no_argument, NULL, 'p' },
+    { "write-interval", required_argument, NULL, 'w' },
+    { "record-candidates", required_argument, NULL, 'c' },
+    { "filter-size", required_argument, NULL, 'f' },
+    { "filter-warmup", required_argument, NULL, 'W' },
+    { "snapshot", required_argument, NULL, 'S' },
+    { "duplicates-max", required_argument, NULL, 'd' },
+    { "duplicates-timeout", required_argument, NULL, 'T' },
+    { "admit-status", required_argument, NULL, 's' },
+    { "admit-min-length", required_argument, NULL, 'm' },
+    { "admit-max-length", required_argument, NULL, 'M' },
+    { "admit-content-type", required_argument, NULL, 't' },
+    { "trace-rate", required_argument, NULL, 'r' },
+    { "fill-timeout", required_argument, NULL, 'F' },
+    { "no-hash", no_argument, NULL, 'H' },
+    { "no-rewrite", no_argument, NULL, 'R' },
+    { "alias", required_argument, NULL, 'a' },
+    { "alias-timeout", required_argument, NULL, 'A' },
+    { "serve", no_argument, NULL, 'e' },
+    { "digest-header", required_argument, NULL, 'D' },
+    { "trust-digest", required_argument, NULL, 'u' },
+    { "peer", required_argument, NULL, 'P' },
+    { "peer-port", required_argument, NULL, 'L' },
+    { "peer-timeout", required_argument, NULL, 'E' },
+    { "peer-bind", required_argument, NULL, 'B' },
+    { "metalink-xml", no_argument, NULL, 'x' },
+    { "coalesce", required_argument, NULL, 'C' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  int index_size = 65536;
+  int filter_size = 0;
+  int alias_size = 0;
+  int header_size = 0;
+  int peer_port = 0;
+  const char *peer_bind = NULL;
+  const char *snapshot_path = NULL;
+  const char *kernel_name = NULL;
+
+  /* By default only SHA-256 */
+  const char *algs = NULL;
+
+  /* By default only 200 OK */
+  const char *status = "200";
+
+  optind = first;
+
+  for (;;) {
+    int opt = getopt_long(argc, (char * const *) argv, "", longopts, NULL);
+    if (opt == -1) {
+      break;
+    }
+
+    /* Everything but the rule options is shared by all the rules, so
+     * it's only read once */
+    if (handler_contp && opt != 'H' && opt != 'R') {
+      TSDebug("metalink", "Option %s ignored, only the first rule's are used", argv[optind - 1]);
+
+      continue;
+    }
+
+    switch (opt) {
+    case 'i':
+      index_size = atoi(optarg);
+      break;
+
+    case 'k':
+      kernel_name = optarg;
+      break;
+
+    case 'o':
+      hash_offload = 1;
+      break;
+
+    case 'g':
+      algs = optarg;
+      break;
+
+    case 'p':
+      tap = 1;
+      break;
+
+    case 'w':
+      write_interval = TS_HRTIME_SECONDS(atoi(optarg));
+      break;
+
+    case 'f':
+      filter_size = atoi(optarg);
+      break;
+
+    case 'W':
+      filter_warmup = TS_HRTIME_SECONDS(atoi(optarg));
+      break;
+
+    case 'S':
+      snapshot_path = optarg;
+      break;
+
+    case 'c':
+      record_candidates = atoi(optarg);
+
+      /* The count is one byte */
+      if (record_candidates < 1 || record_candidates > 255) {
+        TSError("Invalid number of record candidates: %s", optarg);
+
+        record_candidates = 4;
+      }
+
+      break;
+
+    case 'd':
+      duplicates_max = atoi(optarg);
+      break;
+
+    case 'T':
+      duplicates_timeout = atoi(optarg);
+      break;
+
+    case 's':
+      status = optarg;
+      break;
+
+    case 'm':
+      admit_min_length = strtoll(optarg, NULL, 10);
+      break;
+
+    case 'M':
+      admit_max_length = strtoll(optarg, NULL, 10);
+      break;
+
+    case 't':
+      admit_types = (char **) TSrealloc(admit_types, sizeof(char *) * (admit_ntypes + 1));
+      admit_types[admit_ntypes++] = TSstrdup(optarg);
+      break;
+
+    case 'r':
+      trace_rate = atoi(optarg);
+      break;
+
+    case 'F':
+      fill_timeout = TS_HRTIME_SECONDS(atoi(optarg));
+      break;
+
+    case 'a':
+      alias_size = atoi(optarg);
+      break;
+
+    case 'A':
+      alias_timeout = TS_HRTIME_SECONDS(atoi(optarg));
+      break;
+
+    case 'e':
+      serve = 1;
+      break;
+
+    case 'D':
+      header_size = atoi(optarg);
+      break;
+
+    case 'u':
+      trust_add(optarg);
+      break;
+
+    case 'P':
+      peer_add(optarg);
+      break;
+
+    case 'L':
+      peer_port = atoi(optarg);
+      break;
+
+    case 'E':
+      peer_timeout = TS_HRTIME_SECONDS(atoi(optarg));
+      break;
+
+    case 'B':
+      peer_bind = optarg;
+      break;
+
+    case 'x':
+      metalink_xml = 1;
+      break;
+
+    case 'C':
+      coalesce = 1;
+      coalesce_ttl = atoi(optarg) * TS_HRTIME_MSECOND;
+      break;
+
+    case 'H':
+      rulep->hash = 0;
+      break;
+
+    case 'R':
+      rulep->rewrite = 0;
+      break;
+
+    default:
+      TSError("Unknown option");
+    }
+  }
+
+  if (handler_contp) {
+    return;
+  }
+
+  /* Comma separated status codes */
+  for (char *end; *status; status = end + (*end == ',')) {
+    long code = strtol(status, &end, 10);
+    if (end == status || code < 0 || code >= (long) sizeof(admit_status)) {
+      TSError("Invalid status code: %s", status);
+
+      break;
+    }
+
+    admit_status[code] = 1;
+  }
+
+  /* Comma separated digest algorithms */
+  if (algs) {
+    digest_algs = 0;
+
+    for (const char *end; *algs; algs = end + (*end == ',')) {
+      end = strchrnul(algs, ',');
+
+      int alg = digest_algorithm_get(algs, end - algs);
+      if (alg == -1) {
+        TSError("Unknown digest algorithm: %.*s", (int) (end - algs), algs);
+
+        continue;
+      }
+
+      digest_algs |= 1 << alg;
+    }
+
+    if (!digest_algs) {
+      digest_algs = 1 << DIGEST_SHA256;
+    }
+  }
+
+  stats_init();
+
+  /* metalink.log in the log directory */
+  if (trace_rate > 0 && TSTextLogObjectCreate("metalink", TS_LOG_MODE_ADD_TIMESTAMP, &trace_log) != TS_SUCCESS) {
+    TSError("Couldn't create the trace log");
+
+    trace_log = NULL;
+  }
+
+  index_init(&digest_index, index_size);
+  digest_index.snapshotp = &digest_snapshot;
+
+  if (fill_timeout) {
+    index_init(&fill_index, FILL_INDEX_SIZE);
+    index_init(&fill_redirect_index, FILL_INDEX_SIZE);
+  }
+
+  index_init(&alias_index, alias_size);
+
+  if (serve && TSHttpArgIndexReserve("metalink", "Redirect followed from the cache", &serve_arg) != TS_SUCCESS) {
+    TSError("Couldn't reserve a transaction argument, not serving redirects from the cache");
+
+    serve = 0;
+  }
+
+  index_init(&header_index, header_size);
+
+  peer_init(peer_bind, peer_port, index_size);
+
+  if (coalesce) {
+    for (int i = 0; i < INDEX_SHARDS; i += 1) {
+      flight_shards[i].mutexp = TSMutexCreate();
+      flight_shards[i].flights = NULL;
+    }
+  }
+
+  if (coalesce_ttl) {
+    index_init(&coalesce_index, COALESCE_INDEX_SIZE);
+  }
+
+  if (metalink_xml) {
+    metalink_contp = TSContCreate(metalink_hook_handler, NULL);
+  }
+
+  /* The snapshot seeds the filter */
+  if (filter_size && !snapshot_path) {
+    TSError("The filter needs a snapshot to start from, give --snapshot");
+
+    filter_size = 0;
+  }
+
+  filter_init(&digest_filter, filter_size);
+
+  /* Prime them */
+  snapshot_init(&digest_snapshot, snapshot_path);
+
+  sha256_kernel = sha256_kernel_get(kernel_name);
+  if (kernel_name && strcmp(sha256_kernel->name, kernel_name)) {
+    TSError("SHA-256 kernel %s isn't supported, using %s", kernel_name, sha256_kernel->name);
+  }
+
+  TSDebug("metalink", "SHA-256 kernel %s", sha256_kernel->name);
+
+  handler_contp = TSContCreate(handler, NULL);
+}
+
 void
-TSPluginInit(int /* argc ATS_UNUSED */, const char */* argv ATS_UNUSED */[])
+TSPluginInit(int argc, const char *argv[])
 {
   TSPluginRegistrationInfo info;
 
@@ -900,8 +6929,93 @@ TSPluginInit(int /* argc ATS_UNUSED */, const char */* argv ATS_UNUSED */[])
     TSError("Plugin registration failed");
   }
 
-  TSCont contp = TSContCreate(handler, NULL);
+  Rule rule = { 1, 1 };
+
+  /* argv[0] is the plugin name */
+  options_init(argc, argv, 1, &rule);
+
+  /* Aliases are only ever created by the hashing */
+  if (rule.hash && alias_index.nsets) {
+    TSHttpHookAdd(TS_HTTP_POST_REMAP_HOOK, handler_contp);
+  }
+
+  if (rule.hash) {
+    TSHttpHookAdd(TS_HTTP_READ_RESPONSE_HDR_HOOK, handler_contp);
+  }
+
+  if (rule.rewrite) {
+    TSHttpHookAdd(TS_HTTP_SEND_RESPONSE_HDR_HOOK, handler_contp);
+  }
+
+  if (rule.rewrite && metalink_contp) {
+    TSHttpHookAdd(TS_HTTP_READ_RESPONSE_HDR_HOOK, metalink_contp);
+    TSHttpHookAdd(TS_HTTP_CACHE_LOOKUP_COMPLETE_HOOK, metalink_contp);
+  }
+}
+
+/* Or as a remap plugin, e.g. in remap.config
+ *
+ *    map http://download.example.com/ http://download.example.com/ @plugin=metalink.so @pparam=--no-rewrite
+ *
+ * Then only the transactions that match a rule pay for the hooks */
+
+TSReturnCode
+TSRemapInit(TSRemapInterface *api_info, char *errbuf, int errbuf_size)
+{
+  if (!api_info || api_info->size < sizeof(TSRemapInterface)) {
+    snprintf(errbuf, errbuf_size, "Invalid TSRemapInterface argument");
+
+    return TS_ERROR;
+  }
+
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSRemapNewInstance(int argc, char *argv[], void **ih, char */* errbuf ATS_UNUSED */, int /* errbuf_size ATS_UNUSED */)
+{
+  Rule *rulep = (Rule *) TSmalloc(sizeof(Rule));
+
+  rulep->hash = 1;
+  rulep->rewrite = 1;
+
+  /* argv[0] and argv[1] are the "from" and "to" URLs */
+  options_init(argc, (const char **) argv, 2, rulep);
+
+  *ih = rulep;
+
+  return TS_SUCCESS;
+}
+
+void
+TSRemapDeleteInstance(void *ih)
+{
+  TSfree(ih);
+}
+
+/* Add the hooks to this transaction only.  Don't remap anything. */
+
+TSRemapStatus
+TSRemapDoRemap(void *ih, TSHttpTxn txnp, TSRemapRequestInfo */* rri ATS_UNUSED */)
+{
+  Rule *rulep = (Rule *) ih;
+
+  if (rulep->hash && alias_index.nsets) {
+    TSHttpTxnHookAdd(txnp, TS_HTTP_POST_REMAP_HOOK, handler_contp);
+  }
+
+  if (rulep->hash) {
+    TSHttpTxnHookAdd(txnp, TS_HTTP_READ_RESPONSE_HDR_HOOK, handler_contp);
+  }
+
+  if (rulep->rewrite) {
+    TSHttpTxnHookAdd(txnp, TS_HTTP_SEND_RESPONSE_HDR_HOOK, handler_contp);
+  }
+
+  if (rulep->rewrite && metalink_contp) {
+    TSHttpTxnHookAdd(txnp, TS_HTTP_READ_RESPONSE_HDR_HOOK, metalink_contp);
+    TSHttpTxnHookAdd(txnp, TS_HTTP_CACHE_LOOKUP_COMPLETE_HOOK, metalink_contp);
+  }
 
-  TSHttpHookAdd(TS_HTTP_READ_RESPONSE_HDR_HOOK, contp);
-  TSHttpHookAdd(TS_HTTP_SEND_RESPONSE_HDR_HOOK, contp);
+  return TSREMAP_NO_REMAP;
 }
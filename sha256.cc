@@ -0,0 +1,332 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "sha256.h"
+
+/* Round constants */
+
+static const uint32_t K[64] __attribute__((aligned(32))) = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t H0[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static inline uint32_t
+load_be32(const unsigned char *p)
+{
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static inline uint32_t
+ror32(uint32_t x, int n)
+{
+  return x >> n | x << (32 - n);
+}
+
+/* Portable C */
+
+static void
+generic_blocks(uint32_t state[8], const unsigned char *data, size_t nblocks)
+{
+  uint32_t w[64];
+
+  while (nblocks--) {
+    for (int t = 0; t < 16; t += 1) {
+      w[t] = load_be32(data + t * 4);
+    }
+
+    for (int t = 16; t < 64; t += 1) {
+      uint32_t s0 = ror32(w[t - 15], 7) ^ ror32(w[t - 15], 18) ^ w[t - 15] >> 3;
+      uint32_t s1 = ror32(w[t - 2], 17) ^ ror32(w[t - 2], 19) ^ w[t - 2] >> 10;
+
+      w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int t = 0; t < 64; t += 1) {
+      uint32_t t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) + ((e & f) ^ (~e & g)) + K[t] + w[t];
+      uint32_t t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+
+    data += 64;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+static int
+cpuid_supported(unsigned int leaf, int reg, unsigned int bit)
+{
+  unsigned int regs[4];
+
+  if (!__get_cpuid_count(leaf, 0, &regs[0], &regs[1], &regs[2], &regs[3])) {
+    return 0;
+  }
+
+  return regs[reg] >> bit & 1;
+}
+
+/* SHA-NI: Needs SHA (leaf 7, EBX bit 29), SSSE3 (leaf 1, ECX bit 9)
+ * and SSE4.1 (leaf 1, ECX bit 19) */
+
+static int
+shani_supported(void)
+{
+  return cpuid_supported(7, 1, 29) && cpuid_supported(1, 2, 9) && cpuid_supported(1, 2, 19);
+}
+
+/* The SHA extensions keep the state as ABEF and CDGH rather than ABCD
+ * and EFGH.  Each _mm_sha256rnds2_epu32() does two rounds, and the
+ * message schedule advances four words at a time. */
+
+__attribute__((target("sha,sse4.1,ssse3"))) static void
+shani_blocks(uint32_t state[8], const unsigned char *data, size_t nblocks)
+{
+  const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xb1); /* CDAB */
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1b); /* EFGH */
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); /* ABEF */
+  state1 = _mm_blend_epi16(state1, tmp, 0xf0); /* CDGH */
+
+  while (nblocks--) {
+    __m128i abef = state0;
+    __m128i cdgh = state1;
+
+    __m128i w[4];
+
+#pragma GCC unroll 16
+    for (int i = 0; i < 16; i += 1) {
+      if (i < 4) {
+        w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + i * 16)), mask);
+
+      } else {
+        w[i % 4] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]), _mm_alignr_epi8(w[(i + 3) % 4], w[(i + 2) % 4], 4)), w[(i + 3) % 4]);
+      }
+
+      __m128i msg = _mm_add_epi32(w[i % 4], _mm_load_si128((const __m128i *) &K[i * 4]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+
+    data += 64;
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1b); /* FEBA */
+  state1 = _mm_shuffle_epi32(state1, 0xb1); /* DCHG */
+
+  _mm_storeu_si128((__m128i *) &state[0], _mm_blend_epi16(tmp, state1, 0xf0)); /* DCBA */
+  _mm_storeu_si128((__m128i *) &state[4], _mm_alignr_epi8(state1, tmp, 8)); /* HGFE */
+}
+
+#else
+
+static int
+shani_supported(void)
+{
+  return 0;
+}
+
+static void
+shani_blocks(uint32_t /* state ATS_UNUSED */[8], const unsigned char */* data ATS_UNUSED */, size_t /* nblocks ATS_UNUSED */)
+{
+}
+
+#endif
+
+/* Block kernels share the buffering and the padding and differ only
+ * in how they compress whole blocks */
+
+static void
+blocks_init(Sha256Context *c)
+{
+  memcpy(c->b.state, H0, sizeof(c->b.state));
+  c->b.length = 0;
+}
+
+static void
+blocks_update(Sha256Context *c, const void *data, size_t length, void (*blocks)(uint32_t[8], const unsigned char *, size_t))
+{
+  const unsigned char *p = (const unsigned char *) data;
+
+  size_t n = c->b.length % 64;
+  c->b.length += length;
+
+  /* Fill a partial block first */
+  if (n) {
+    size_t m = 64 - n < length ? 64 - n : length;
+    memcpy(c->b.buffer + n, p, m);
+
+    if (n + m < 64) {
+      return;
+    }
+
+    blocks(c->b.state, c->b.buffer, 1);
+
+    p += m;
+    length -= m;
+  }
+
+  /* Then compress whole blocks straight from the input */
+  if (length >= 64) {
+    blocks(c->b.state, p, length / 64);
+
+    p += length / 64 * 64;
+    length %= 64;
+  }
+
+  memcpy(c->b.buffer, p, length);
+}
+
+static void
+blocks_final(unsigned char *md, Sha256Context *c, void (*blocks)(uint32_t[8], const unsigned char *, size_t))
+{
+  uint64_t length = c->b.length;
+  size_t n = length % 64;
+
+  c->b.buffer[n++] = 0x80;
+  if (n > 56) {
+    memset(c->b.buffer + n, 0, 64 - n);
+    blocks(c->b.state, c->b.buffer, 1);
+
+    n = 0;
+  }
+
+  memset(c->b.buffer + n, 0, 56 - n);
+  for (int i = 0; i < 8; i += 1) {
+    c->b.buffer[56 + i] = length * 8 >> (56 - i * 8);
+  }
+
+  blocks(c->b.state, c->b.buffer, 1);
+
+  for (int i = 0; i < 8; i += 1) {
+    md[i * 4] = c->b.state[i] >> 24;
+    md[i * 4 + 1] = c->b.state[i] >> 16;
+    md[i * 4 + 2] = c->b.state[i] >> 8;
+    md[i * 4 + 3] = c->b.state[i];
+  }
+}
+
+static void
+generic_update(Sha256Context *c, const void *data, size_t length)
+{
+  blocks_update(c, data, length, generic_blocks);
+}
+
+static void
+generic_final(unsigned char *md, Sha256Context *c)
+{
+  blocks_final(md, c, generic_blocks);
+}
+
+static void
+shani_update(Sha256Context *c, const void *data, size_t length)
+{
+  blocks_update(c, data, length, shani_blocks);
+}
+
+static void
+shani_final(unsigned char *md, Sha256Context *c)
+{
+  blocks_final(md, c, shani_blocks);
+}
+
+static int
+always_supported(void)
+{
+  return 1;
+}
+
+/* OpenSSL deprecated the low level interface in 3.0, but EVP costs an
+ * allocation and an indirection per call */
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+
+static void
+openssl_init(Sha256Context *c)
+{
+  SHA256_Init(&c->c);
+}
+
+static void
+openssl_update(Sha256Context *c, const void *data, size_t length)
+{
+  SHA256_Update(&c->c, data, length);
+}
+
+static void
+openssl_final(unsigned char *md, Sha256Context *c)
+{
+  SHA256_Final(md, &c->c);
+}
+
+#pragma GCC diagnostic pop
+
+const Sha256Kernel sha256_kernels[] = {
+  { "shani", shani_supported, blocks_init, shani_update, shani_final },
+  { "openssl", always_supported, openssl_init, openssl_update, openssl_final },
+  { "generic", always_supported, blocks_init, generic_update, generic_final },
+  { NULL, NULL, NULL, NULL, NULL }
+};
+
+const Sha256Kernel *
+sha256_kernel_get(const char *name)
+{
+  const Sha256Kernel *kernel;
+
+  if (name) {
+    for (kernel = sha256_kernels; kernel->name; kernel += 1) {
+      if (!strcmp(kernel->name, name) && kernel->supported()) {
+        return kernel;
+      }
+    }
+  }
+
+  for (kernel = sha256_kernels; !kernel->supported(); kernel += 1) {
+  }
+
+  return kernel;
+}
+
+int
+sha256_kernel_blocks(const Sha256Kernel *kernel)
+{
+  return kernel->init == blocks_init;
+}
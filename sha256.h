@@ -0,0 +1,61 @@
+#ifndef METALINK_SHA256_H
+#define METALINK_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <openssl/sha.h>
+
+/* SHA-256 kernels.  Every byte of every response gets fed through the
+ * message digest on the net thread, so pick the fastest implementation
+ * the CPU supports at runtime:
+ *
+ *    shani         Intel SHA extensions (SHA-NI)
+ *
+ *    openssl       OpenSSL's SHA256_Update(), whatever it does on this
+ *                  build
+ *
+ *    generic       Portable C, only useful to check and benchmark the
+ *                  others */
+
+typedef struct {
+  union {
+
+    /* openssl */
+    SHA256_CTX c;
+
+    /* Block kernels */
+    struct {
+      uint32_t state[8];
+      uint64_t length;
+
+      unsigned char buffer[64];
+
+    } b;
+  };
+
+} Sha256Context;
+
+typedef struct {
+  const char *name;
+
+  /* Nonzero if the CPU can run it */
+  int (*supported)(void);
+
+  void (*init)(Sha256Context *c);
+  void (*update)(Sha256Context *c, const void *data, size_t length);
+  void (*final)(unsigned char *md, Sha256Context *c);
+
+} Sha256Kernel;
+
+/* In order of preference, terminated by a NULL name */
+extern const Sha256Kernel sha256_kernels[];
+
+/* The named kernel if the CPU supports it, otherwise the fastest one
+ * that it does.  NULL name picks the fastest. */
+const Sha256Kernel *sha256_kernel_get(const char *name);
+
+/* Nonzero if it is a block kernel */
+int sha256_kernel_blocks(const Sha256Kernel *kernel);
+
+#endif /* METALINK_SHA256_H */